@@ -0,0 +1,290 @@
+//
+// External Sorter
+// Sorts more fixed size records than fit a memory budget: records
+// are gathered up to the budget, sorted, and spilled to temporary
+// files as sorted runs, which are then k-way merged back in order.
+// Too many runs to merge at once with a useful read buffer each
+// are merged a group at a time into longer runs first.
+//
+// Records are written out as raw bytes, so T must be a POD type.
+// Temporary files are removed when closed, even on a crash.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __EXTSORT_H
+#define __EXTSORT_H
+
+#include "types.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+template <typename T, typename Less = std::less<T> >
+class ExternalSorter
+{
+public:
+    ExternalSorter(u64 memoryBudget, Less less = Less())
+    : _less(less), _count(0), _spilled(0), _merging(false), _pos(0)
+    {
+        u64 records = memoryBudget / sizeof(T);
+        _capacity = (size_t)std::max<u64>(records, MIN_BUFFER_BYTES / sizeof(T));
+    }
+
+    ~ExternalSorter()
+    {
+        CloseRuns(_files);
+        for (size_t i = 0; i < _runs.size(); ++i)
+            if (_runs[i].fp)
+                fclose(_runs[i].fp);
+    }
+
+    void Add(T const & x)
+    {
+        if (_merging)
+            throw std::runtime_error("Records can't be added once sorted.");
+        if (_buffer.size() >= _capacity)
+            Spill();
+        if (_buffer.capacity() < _capacity)
+            _buffer.reserve(_capacity);
+        _buffer.push_back(x);
+        ++_count;
+    }
+
+    // after the last Add(), then Next() gives records in order
+    void Sort()
+    {
+        if (_merging)
+            return;
+        _merging = true;
+        if (_files.empty())
+        {
+            std::sort(_buffer.begin(), _buffer.end(), _less);
+            _pos = 0;
+            return;
+        }
+
+        Spill();
+        std::vector<T>().swap(_buffer);
+
+        // each run gets an equal share of the budget to read with
+        size_t fanIn = std::max<size_t>(2, _capacity * sizeof(T) / MIN_BUFFER_BYTES);
+        while (_files.size() > fanIn)
+        {
+            // a group at a time into one longer run
+            std::vector<FILE*> longer;
+            try
+            {
+                for (size_t i = 0; i < _files.size(); i += fanIn)
+                {
+                    std::vector<FILE*> group(_files.begin() + i, _files.begin() + std::min(i + fanIn, _files.size()));
+                    for (size_t k = i; k < i + group.size(); ++k)
+                        _files[k] = 0;
+                    if (group.size() == 1)
+                        longer.push_back(group[0]);
+                    else
+                        longer.push_back(MergeGroup(group));
+                }
+            }
+            catch(...)
+            {
+                CloseRuns(longer);
+                throw;
+            }
+            _files.swap(longer);
+        }
+        StartMerge(_files, _files.size());
+        _files.clear();
+    }
+
+    bool Next(T & x)
+    {
+        if (!_merging)
+            throw std::runtime_error("Records read before sorted.");
+        if (_runs.empty())
+        {
+            if (_pos >= _buffer.size())
+                return false;
+            x = _buffer[_pos++];
+            return true;
+        }
+        return MergeNext(x);
+    }
+
+    u64 Count() const { return _count; }
+    u32 Spilled() const { return _spilled; }    // sorted runs written to temporary files
+
+private:
+    static u64 const MIN_BUFFER_BYTES = 64 * 1024;
+
+    // sorted run being merged, read a buffer at a time
+    struct Run
+    {
+        FILE * fp;
+        std::vector<T> buf;
+        size_t pos;
+    };
+
+    // heap of run indices on their current records, earlier run first on ties
+    struct RunGreater
+    {
+        RunGreater(std::vector<Run> const & runs, Less const & less) : _runs(runs), _less(less) { }
+        bool operator () (u32 a, u32 b) const
+        {
+            T const & x = _runs[a].buf[_runs[a].pos];
+            T const & y = _runs[b].buf[_runs[b].pos];
+            if (_less(y, x))
+                return true;
+            return !_less(x, y) && b < a;
+        }
+        std::vector<Run> const & _runs;
+        Less const & _less;
+    };
+
+    ExternalSorter(ExternalSorter const &);                 // not copyable
+    ExternalSorter & operator = (ExternalSorter const &);
+
+    static void CloseRuns(std::vector<FILE*> & files)
+    {
+        for (size_t i = 0; i < files.size(); ++i)
+            if (files[i])
+                fclose(files[i]);
+        files.clear();
+    }
+
+    static FILE * NewRunFile()
+    {
+        FILE * fp = tmpfile();
+        if (!fp)
+            throw std::runtime_error("Can't create temporary file to sort with.");
+        return fp;
+    }
+
+    static void WriteRecords(FILE * fp, T const * p, size_t n)
+    {
+        if (n > 0 && fwrite(p, sizeof(T), n, fp) != n)
+            throw std::runtime_error("Can't write temporary file to sort with.");
+    }
+
+    void Spill()
+    {
+        if (_buffer.empty())
+            return;
+        std::sort(_buffer.begin(), _buffer.end(), _less);
+        FILE * fp = NewRunFile();
+        _files.push_back(fp);
+        WriteRecords(fp, &_buffer[0], _buffer.size());
+        if (fflush(fp) != 0)
+            throw std::runtime_error("Can't write temporary file to sort with.");
+        _buffer.clear();
+        ++_spilled;
+    }
+
+    bool Fill(Run & r)
+    {
+        size_t n = fread(&r.buf[0], sizeof(T), r.buf.size(), r.fp);
+        if (n == 0 && ferror(r.fp))
+            throw std::runtime_error("Can't read temporary file to sort with.");
+        r.buf.resize(n);
+        r.pos = 0;
+        return n > 0;
+    }
+
+    // merges the files, the budget shared by them & `shares` more buffers
+    void StartMerge(std::vector<FILE*> const & files, size_t shares)
+    {
+        size_t records = std::max<size_t>(1, _capacity / std::max<size_t>(1, shares));
+        _runs.clear();
+        _heap.clear();
+        _runs.resize(files.size());
+        for (u32 i = 0; i < files.size(); ++i)
+        {
+            Run & r = _runs[i];
+            r.fp = files[i];
+            rewind(r.fp);
+            r.buf.resize(records);
+            if (Fill(r))
+                _heap.push_back(i);
+        }
+        std::make_heap(_heap.begin(), _heap.end(), RunGreater(_runs, _less));
+    }
+
+    bool MergeNext(T & x)
+    {
+        if (_heap.empty())
+            return false;
+        RunGreater greater(_runs, _less);
+        std::pop_heap(_heap.begin(), _heap.end(), greater);
+        Run & r = _runs[_heap.back()];
+        x = r.buf[r.pos++];
+        if (r.pos < r.buf.size())
+        {
+            std::push_heap(_heap.begin(), _heap.end(), greater);
+        }
+        else
+        {
+            r.buf.resize(r.buf.capacity());
+            if (Fill(r))
+                std::push_heap(_heap.begin(), _heap.end(), greater);
+            else
+                _heap.pop_back();
+        }
+        return true;
+    }
+
+    FILE * MergeGroup(std::vector<FILE*> & group)
+    {
+        // the group's inputs and the output share the budget
+        FILE * out = NewRunFile();
+        try
+        {
+            StartMerge(group, group.size() + 1);
+            std::vector<T> buf;
+            buf.reserve(std::max<size_t>(1, _capacity / (group.size() + 1)));
+            T x;
+            while (MergeNext(x))
+            {
+                buf.push_back(x);
+                if (buf.size() == buf.capacity())
+                {
+                    WriteRecords(out, &buf[0], buf.size());
+                    buf.clear();
+                }
+            }
+            if (!buf.empty())
+                WriteRecords(out, &buf[0], buf.size());
+            if (fflush(out) != 0)
+                throw std::runtime_error("Can't write temporary file to sort with.");
+        }
+        catch(...)
+        {
+            fclose(out);
+            CloseRuns(group);
+            _runs.clear();
+            throw;
+        }
+        CloseRuns(group);
+        _runs.clear();
+        _heap.clear();
+        return out;
+    }
+
+    Less _less;
+    size_t _capacity;       // records held in memory
+    u64 _count;
+    u32 _spilled;
+    bool _merging;
+
+    std::vector<T> _buffer; // records not spilled yet, or all of them if none were
+    size_t _pos;            // next of _buffer to give
+    std::vector<FILE*> _files;  // spilled runs not being merged
+    std::vector<Run> _runs;     // runs being merged
+    std::vector<u32> _heap;
+};
+
+#endif // __EXTSORT_H
@@ -18,7 +18,14 @@
 #include <stdexcept>
 #include <assert.h>
 
+IFile64::MAKER IFile64::s_maker = &IFile64::PlatformMaker;
+
 IFile64 * IFile64::FileMaker()
+{
+    return s_maker();
+}
+
+IFile64 * IFile64::PlatformMaker()
 {
 
 #ifdef _MSC_VER
@@ -29,6 +36,13 @@ IFile64 * IFile64::FileMaker()
 
 }
 
+IFile64::MAKER IFile64::SetMaker(MAKER maker)
+{
+    MAKER old = s_maker;
+    s_maker = maker ? maker : &IFile64::PlatformMaker;
+    return old;
+}
+
 
 // if using Microsoft Visual Studio compiler
 // We can safely assume Win32 API exists
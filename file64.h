@@ -4,6 +4,9 @@
 // reading object. Both Win32 & Linux definition are
 // conditionally preprocessed depends on compiler platforms.
 //
+// The factory can be replaced, e.g. by one that wraps the
+// platform file to watch or alter its reads.
+//
 // Based on the _MSC_VER symbol, if defined means Win32,
 // otherwise Linux.
 //
@@ -20,7 +23,11 @@
 class IFile64
 {
 public:
-    static IFile64 * FileMaker();
+    typedef IFile64 * (*MAKER)();
+    static IFile64 * FileMaker();       // by the current maker
+    static IFile64 * PlatformMaker();   // Win32 or POSIX file
+    static MAKER SetMaker(MAKER maker); // returns the one replaced, for the new one to wrap
+
     IFile64() : _autoClose(true) { }
     virtual ~IFile64() { }
     virtual bool Open(char const * filename) = 0;
@@ -35,6 +42,9 @@ public:
 
 protected:
     bool _autoClose;
+
+private:
+    static MAKER s_maker;
 };
 
 
@@ -0,0 +1,252 @@
+//
+// Message Digests
+// MD5 (RFC 1321), SHA-1 & SHA-256 (FIPS 180-4), incremental:
+// Update() as data comes, then Final() for the digest.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "hash.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace
+{
+    inline u32 Rol(u32 x, int n) { return (x << n) | (x >> (32 - n)); }
+    inline u32 Ror(u32 x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    inline u32 LoadLE(u8 const * p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24); }
+    inline u32 LoadBE(u8 const * p) { return ((u32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+    inline void StoreLE(u8 * p, u32 x) { p[0] = (u8)x; p[1] = (u8)(x >> 8); p[2] = (u8)(x >> 16); p[3] = (u8)(x >> 24); }
+    inline void StoreBE(u8 * p, u32 x) { p[0] = (u8)(x >> 24); p[1] = (u8)(x >> 16); p[2] = (u8)(x >> 8); p[3] = (u8)x; }
+
+    u32 const MD5_K[64] =
+    {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+    };
+    int const MD5_S[64] =
+    {
+        7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+        5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+        4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+        6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+    };
+
+    u32 const SHA256_K[64] =
+    {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+}
+
+//=============================================================================
+void BlockHash::Update(void const * data, size_t size)
+{
+    u8 const * p = (u8 const *)data;
+    _length += size;
+
+    // top up a partial block first, then whole blocks straight from data
+    if (_used > 0)
+    {
+        size_t n = std::min<size_t>(size, sizeof(_block) - _used);
+        memcpy(_block + _used, p, n);
+        _used += n;
+        p += n;
+        size -= n;
+        if (_used < sizeof(_block))
+            return;
+        Transform(_block);
+        _used = 0;
+    }
+    for (; size >= sizeof(_block); p += sizeof(_block), size -= sizeof(_block))
+        Transform(p);
+    memcpy(_block, p, size);
+    _used = size;
+}
+
+void BlockHash::Pad(bool bigEndian)
+{
+    u64 bits = _length * 8;
+    u8 pad[72] = { 0x80 };
+    size_t n = (_used < 56) ? (56 - _used) : (120 - _used);
+    for (int i = 0; i < 8; ++i)
+        pad[n + i] = (u8)(bigEndian ? (bits >> (56 - 8 * i)) : (bits >> (8 * i)));
+    Update(pad, n + 8);
+}
+
+//=============================================================================
+Md5::Md5()
+{
+    _h[0] = 0x67452301;
+    _h[1] = 0xefcdab89;
+    _h[2] = 0x98badcfe;
+    _h[3] = 0x10325476;
+}
+
+void Md5::Transform(u8 const * block)
+{
+    u32 w[16];
+    for (int i = 0; i < 16; ++i)
+        w[i] = LoadLE(block + 4 * i);
+
+    u32 a = _h[0], b = _h[1], c = _h[2], d = _h[3];
+    for (int i = 0; i < 64; ++i)
+    {
+        u32 f;
+        int g;
+        if (i < 16)      { f = (b & c) | (~b & d); g = i; }
+        else if (i < 32) { f = (d & b) | (~d & c); g = (5 * i + 1) & 15; }
+        else if (i < 48) { f = b ^ c ^ d;          g = (3 * i + 5) & 15; }
+        else             { f = c ^ (b | ~d);       g = (7 * i) & 15; }
+        u32 t = d;
+        d = c;
+        c = b;
+        b = b + Rol(a + f + MD5_K[i] + w[g], MD5_S[i]);
+        a = t;
+    }
+    _h[0] += a;
+    _h[1] += b;
+    _h[2] += c;
+    _h[3] += d;
+}
+
+void Md5::Final(u8 * digest)
+{
+    Pad(false);
+    for (int i = 0; i < 4; ++i)
+        StoreLE(digest + 4 * i, _h[i]);
+}
+
+//=============================================================================
+Sha1::Sha1()
+{
+    _h[0] = 0x67452301;
+    _h[1] = 0xefcdab89;
+    _h[2] = 0x98badcfe;
+    _h[3] = 0x10325476;
+    _h[4] = 0xc3d2e1f0;
+}
+
+void Sha1::Transform(u8 const * block)
+{
+    u32 w[80];
+    int i;
+    for (i = 0; i < 16; ++i)
+        w[i] = LoadBE(block + 4 * i);
+    for (; i < 80; ++i)
+        w[i] = Rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    u32 a = _h[0], b = _h[1], c = _h[2], d = _h[3], e = _h[4];
+    for (i = 0; i < 80; ++i)
+    {
+        u32 f, k;
+        if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5a827999; }
+        else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ed9eba1; }
+        else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8f1bbcdc; }
+        else             { f = b ^ c ^ d;                   k = 0xca62c1d6; }
+        u32 t = Rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = Rol(b, 30);
+        b = a;
+        a = t;
+    }
+    _h[0] += a;
+    _h[1] += b;
+    _h[2] += c;
+    _h[3] += d;
+    _h[4] += e;
+}
+
+void Sha1::Final(u8 * digest)
+{
+    Pad(true);
+    for (int i = 0; i < 5; ++i)
+        StoreBE(digest + 4 * i, _h[i]);
+}
+
+//=============================================================================
+Sha256::Sha256()
+{
+    _h[0] = 0x6a09e667;
+    _h[1] = 0xbb67ae85;
+    _h[2] = 0x3c6ef372;
+    _h[3] = 0xa54ff53a;
+    _h[4] = 0x510e527f;
+    _h[5] = 0x9b05688c;
+    _h[6] = 0x1f83d9ab;
+    _h[7] = 0x5be0cd19;
+}
+
+void Sha256::Transform(u8 const * block)
+{
+    u32 w[64];
+    int i;
+    for (i = 0; i < 16; ++i)
+        w[i] = LoadBE(block + 4 * i);
+    for (; i < 64; ++i)
+    {
+        u32 s0 = Ror(w[i - 15], 7) ^ Ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        u32 s1 = Ror(w[i - 2], 17) ^ Ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    u32 a = _h[0], b = _h[1], c = _h[2], d = _h[3], e = _h[4], f = _h[5], g = _h[6], h = _h[7];
+    for (i = 0; i < 64; ++i)
+    {
+        u32 t1 = h + (Ror(e, 6) ^ Ror(e, 11) ^ Ror(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+        u32 t2 = (Ror(a, 2) ^ Ror(a, 13) ^ Ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    _h[0] += a;
+    _h[1] += b;
+    _h[2] += c;
+    _h[3] += d;
+    _h[4] += e;
+    _h[5] += f;
+    _h[6] += g;
+    _h[7] += h;
+}
+
+void Sha256::Final(u8 * digest)
+{
+    Pad(true);
+    for (int i = 0; i < 8; ++i)
+        StoreBE(digest + 4 * i, _h[i]);
+}
+
+//=============================================================================
+std::string ToHex(u8 const * digest, u32 size)
+{
+    static char const digits[] = "0123456789abcdef";
+    std::string hex(2 * size, '0');
+    for (u32 i = 0; i < size; ++i)
+    {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0xf];
+    }
+    return hex;
+}
@@ -0,0 +1,78 @@
+//
+// Message Digests
+// MD5 (RFC 1321), SHA-1 & SHA-256 (FIPS 180-4), incremental:
+// Update() as data comes, then Final() for the digest.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __HASH_H
+#define __HASH_H
+
+#include "types.h"
+
+#include <string>
+
+//=============================================================================
+// common 64 byte block buffering of the three
+class BlockHash
+{
+public:
+    void Update(void const * data, size_t size);
+
+protected:
+    BlockHash() : _length(0), _used(0) { }
+    virtual ~BlockHash() { }
+    virtual void Transform(u8 const * block) = 0;
+    void Pad(bool bigEndian);   // appends padding & bit length
+
+    u64 _length;    // bytes so far
+    u32 _used;      // bytes in _block
+    u8 _block[64];
+};
+
+//=============================================================================
+class Md5 : public BlockHash
+{
+public:
+    static u32 const DIGEST_SIZE = 16;
+    Md5();
+    void Final(u8 * digest);
+
+private:
+    void Transform(u8 const * block);
+    u32 _h[4];
+};
+
+//=============================================================================
+class Sha1 : public BlockHash
+{
+public:
+    static u32 const DIGEST_SIZE = 20;
+    Sha1();
+    void Final(u8 * digest);
+
+private:
+    void Transform(u8 const * block);
+    u32 _h[5];
+};
+
+//=============================================================================
+class Sha256 : public BlockHash
+{
+public:
+    static u32 const DIGEST_SIZE = 32;
+    Sha256();
+    void Final(u8 * digest);
+
+private:
+    void Transform(u8 const * block);
+    u32 _h[8];
+};
+
+// lower case hex of a digest
+std::string ToHex(u8 const * digest, u32 size);
+
+#endif // __HASH_H
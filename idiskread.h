@@ -13,6 +13,8 @@
 #include "types.h"
 
 #include <deque>
+#include <utility>
+#include <vector>
 
 namespace disk
 {
@@ -70,6 +72,8 @@ namespace disk
     };
     typedef std::deque<Partition> Partitions;
 
+    typedef std::vector<std::pair<u64, u64> > SectorRanges;
+
 
     class IDiskRead
     {
@@ -77,6 +81,14 @@ namespace disk
         virtual bool RawSector(u64 x, void * buf) = 0;
         virtual bool ReadSector(u64 x, void * buf, unsigned partitionNum=0) = 0;
         virtual bool ReadSectorN(u64 x, u32 count, void * buf, unsigned partitionNum=0) = 0;
+
+        // (first, count) ascending of sectors [x, x + count) held by this disk
+        // itself; the rest are read through to a parent (base) image and so
+        // are the same as in there
+        virtual void GetOwnSectors(u64 x, u64 count, SectorRanges & ranges, unsigned /*partitionNum*/ = 0)
+        {
+            ranges.assign(1, std::make_pair(x, count));
+        }
     };
 
 }
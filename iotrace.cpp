@@ -0,0 +1,292 @@
+//
+// I/O Access Trace
+// Records every read request made through IFile64 during a run,
+// and replays such a trace through a simulated block cache.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "iotrace.h"
+#include "stats.h"
+
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+
+namespace
+{
+    char const TRACE_HEADER[] = "# vmdkparse io trace 1";
+
+    // name without its folders, which may tell more than needed
+    std::string BaseName(std::string const & path)
+    {
+        std::string::size_type sep = path.find_last_of("/\\");
+        return (sep == std::string::npos) ? path : path.substr(sep + 1);
+    }
+}
+
+//=============================================================================
+Mutex IoRecorder::s_lock;
+std::ofstream IoRecorder::s_os;
+u32 IoRecorder::s_files = 0;
+IFile64::MAKER IoRecorder::s_wrapped = 0;
+
+void IoRecorder::Start(char const * traceFile)
+{
+    ScopedLock lock(s_lock);
+    if (s_wrapped)
+        throw std::runtime_error("I/O trace already recording.");
+    s_os.open(traceFile);
+    if (!s_os.is_open())
+        throw std::runtime_error("Can't open I/O trace file.");
+    s_os << TRACE_HEADER << '\n';
+    s_files = 0;
+    s_wrapped = IFile64::SetMaker(&IoRecorder::Maker);
+}
+
+void IoRecorder::Stop()
+{
+    ScopedLock lock(s_lock);
+    if (!s_wrapped)
+        return;
+    IFile64::SetMaker(s_wrapped);
+    s_wrapped = 0;
+    s_os.close();   // files still open stop recording too
+}
+
+IFile64 * IoRecorder::Maker()
+{
+    return new File(s_wrapped());
+}
+
+bool IoRecorder::File::Open(char const * filename)
+{
+    if (!_file->Open(filename))
+        return false;
+    Opened(BaseName(filename));
+    return true;
+}
+
+bool IoRecorder::File::Open(wchar_t const * filename)
+{
+    if (!_file->Open(filename))
+        return false;
+    std::string name;
+    for (wchar_t const * p = filename; *p; ++p)
+        name.push_back((*p > 0x20 && *p < 0x7f) ? (char)*p : '_');
+    Opened(BaseName(name));
+    return true;
+}
+
+void IoRecorder::File::Opened(std::string const & name)
+{
+    // spaces would split the line
+    std::string safe(name);
+    std::replace(safe.begin(), safe.end(), ' ', '_');
+    s64 size = _file->Size();
+    _pos = 0;
+
+    ScopedLock lock(s_lock);
+    _id = s_files++;
+    if (s_os.is_open())
+        s_os << "O " << _id << ' ' << (size < 0 ? 0 : size) << ' ' << safe << '\n';
+}
+
+unsigned long IoRecorder::File::Read(void * buf, unsigned long size)
+{
+    {
+        ScopedLock lock(s_lock);
+        if (s_os.is_open())
+            s_os << "R " << _id << ' ' << _pos << ' ' << size << '\n';
+    }
+    unsigned long reads = _file->Read(buf, size);
+    _pos += reads;
+    return reads;
+}
+
+bool IoRecorder::File::Seek(s64 pos, u32 moveMethod)
+{
+    if (!_file->Seek(pos, moveMethod))
+        return false;
+    switch (moveMethod)
+    {
+    case 0: _pos = pos; break;
+    case 1: _pos += pos; break;
+    case 2: _pos = _file->Size() + pos; break;
+    }
+    return true;
+}
+
+//=============================================================================
+IoReplay::IoReplay(char const * traceFile, char const * imageDir, Options const & options)
+: _trace(traceFile), _imageDir(imageDir ? imageDir : ""), _options(options),
+  _requests(0), _requestBytes(0), _hits(0), _misses(0), _reads(0), _readBytes(0), _seeks(0), _nanos(0),
+  _lastFile(~0U), _lastEnd(0)
+{
+    if (!_trace.is_open())
+        throw std::runtime_error("Can't open I/O trace file.");
+    std::string header;
+    if (!std::getline(_trace, header) || header != TRACE_HEADER)
+        throw std::runtime_error("Not an I/O trace file.");
+    if (_options.blockSize == 0)
+        throw std::runtime_error("Block size can't be zero.");
+    while (!_imageDir.empty() && (*_imageDir.rbegin() == '/' || *_imageDir.rbegin() == '\\'))
+        _imageDir.resize(_imageDir.size() - 1);
+    if (imageDir)
+        _buf.resize((size_t)_options.blockSize * (1 + _options.readAhead));
+}
+
+IoReplay::~IoReplay()
+{
+    for (size_t i = 0; i < _files.size(); ++i)
+        delete _files[i].file;
+}
+
+void IoReplay::Run()
+{
+    u64 start = Stats::Now();
+    std::string line;
+    while (std::getline(_trace, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream istr(line);
+        char type;
+        u32 id;
+        istr >> type >> id;
+        if (type == 'O')
+        {
+            u64 size;
+            std::string name;
+            istr >> size >> name;
+            if (!istr)
+                throw std::runtime_error("Bad open in I/O trace: " + line);
+            OpenFile(id, size, name);
+        }
+        else if (type == 'R')
+        {
+            u64 offset, length;
+            istr >> offset >> length;
+            if (!istr || id >= _files.size())
+                throw std::runtime_error("Bad read in I/O trace: " + line);
+            Request(id, offset, length);
+        }
+        else
+        {
+            throw std::runtime_error("Unknown event in I/O trace: " + line);
+        }
+    }
+    _nanos = Stats::Now() - start;
+}
+
+void IoReplay::WriteReport(std::ostream & os) const
+{
+    u64 blocks = _hits + _misses;
+    os << "requests        " << _requests << '\n'
+        << "request bytes   " << _requestBytes << '\n'
+        << "block hits      " << _hits << '\n'
+        << "block misses    " << _misses << '\n'
+        << "hit rate        " << (blocks ? 100.0 * _hits / blocks : 0.0) << "%\n"
+        << "backing reads   " << _reads << '\n'
+        << "backing bytes   " << _readBytes << '\n'
+        << "backing seeks   " << _seeks << '\n'
+        << "elapsed ms      " << _nanos / 1000000 << std::endl;
+}
+
+//=============================================================================
+void IoReplay::OpenFile(u32 id, u64 size, std::string const & name)
+{
+    if (id != _files.size())
+        throw std::runtime_error("I/O trace file ids out of order.");
+    TraceFile f;
+    f.name = name;
+    f.size = size;
+    f.file = 0;
+    if (!_imageDir.empty())
+    {
+        f.file = IFile64::FileMaker();
+        std::string path(_imageDir + "/" + name);
+        if (!f.file->Open(path.c_str()))
+        {
+            delete f.file;
+            throw std::runtime_error("Can't open file to replay on: " + path);
+        }
+    }
+    _files.push_back(f);
+}
+
+void IoReplay::Request(u32 id, u64 offset, u64 length)
+{
+    ++_requests;
+    _requestBytes += length;
+    if (length == 0)
+        return;
+
+    TraceFile & f = _files[id];
+    u64 bs = _options.blockSize;
+    u64 first = offset / bs;
+    u64 last = (offset + length - 1) / bs;
+    for (u64 block = first; block <= last; ++block)
+    {
+        if (Lookup(BLOCKKEY(id, block)))
+        {
+            ++_hits;
+            continue;
+        }
+        ++_misses;
+
+        // the missed block & read-ahead, up to the next cached one or end of file
+        u64 blocks = f.size ? (f.size + bs - 1) / bs : block + 1;
+        u32 count = 1;
+        while (count <= _options.readAhead && block + count < blocks
+            && _blocks.find(BLOCKKEY(id, block + count)) == _blocks.end())
+            ++count;
+        Fetch(f, id, block, count);
+    }
+}
+
+void IoReplay::Fetch(TraceFile & f, u32 id, u64 block, u32 count)
+{
+    u64 offset = block * _options.blockSize;
+    u64 size = (u64)count * _options.blockSize;
+    if (f.size)
+        size = std::min(size, f.size > offset ? f.size - offset : 0);
+    ++_reads;
+    _readBytes += size;
+    if (id != _lastFile || offset != _lastEnd)
+        ++_seeks;
+    _lastFile = id;
+    _lastEnd = offset + size;
+
+    if (f.file && size > 0)
+    {
+        if (!f.file->Seek(offset) || f.file->Read(&_buf[0], (unsigned long)size) != size)
+            throw std::runtime_error("Can't read file to replay on: " + f.name);
+    }
+
+    if (_options.cacheBlocks == 0)
+        return;
+    for (u32 i = 0; i < count; ++i)
+    {
+        // recycle the least recently used block when full
+        BLOCKKEY key(id, block + i);
+        if (_blocks.size() >= _options.cacheBlocks)
+        {
+            _blocks.erase(_lru.back());
+            _lru.pop_back();
+        }
+        _lru.push_front(key);
+        _blocks[key] = _lru.begin();
+    }
+}
+
+bool IoReplay::Lookup(BLOCKKEY const & key)
+{
+    BLOCKMAP::iterator it = _blocks.find(key);
+    if (it == _blocks.end())
+        return false;
+    _lru.splice(_lru.begin(), _lru, it->second);
+    return true;
+}
@@ -0,0 +1,136 @@
+//
+// I/O Access Trace
+// Records every read request made through IFile64 during a run,
+// and replays such a trace through a simulated block cache with
+// read-ahead, against local files or none, so cache & prefetch
+// policies can be compared offline on real access patterns
+// without the images they came from.
+//
+// Trace is text, one line per event, in request order:
+//   "# vmdkparse io trace 1"     header
+//   "O id size name"             file opened, name without folder
+//   "R id offset length"         read request
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __IOTRACE_H
+#define __IOTRACE_H
+
+#include "types.h"
+#include "file64.h"
+#include "thread.h"
+
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+//=============================================================================
+// wraps the IFile64 maker, every file made afterwards is recorded
+class IoRecorder
+{
+public:
+    static void Start(char const * traceFile);
+    static void Stop();     // flushes the trace
+
+private:
+    // forwards to the file made by the wrapped maker, noting down reads
+    class File : public IFile64
+    {
+    public:
+        File(IFile64 * file) : _file(file), _id(0), _pos(0) { }
+        ~File() { delete _file; }
+        bool Open(char const * filename);
+        bool Open(wchar_t const * filename);
+        void Close() { _file->Close(); }
+        bool IsOpen() const { return _file->IsOpen(); }
+        bool Eof() const { return _file->Eof(); }
+        unsigned long Read(void * buf, unsigned long size);
+        bool Seek(s64 pos, u32 moveMethod = 0);
+        s64 Size() const { return _file->Size(); }
+        void NoAutoClose() { _file->NoAutoClose(); }
+
+    private:
+        File(File const &);
+        File & operator = (File const &);
+        void Opened(std::string const & name);
+
+        IFile64 * _file;
+        u32 _id;
+        u64 _pos;
+    };
+
+    static IFile64 * Maker();
+
+    static Mutex s_lock;
+    static std::ofstream s_os;      // guarded by s_lock
+    static u32 s_files;             // ditto
+    static IFile64::MAKER s_wrapped;
+};
+
+//=============================================================================
+// replays a trace through an LRU block cache
+class IoReplay
+{
+public:
+    struct Options
+    {
+        u32 blockSize;      // bytes per cache block
+        u64 cacheBlocks;    // blocks the cache holds, 0 for no cache
+        u32 readAhead;      // blocks read after a missed one, in the same read
+        Options() : blockSize(64 * 1024), cacheBlocks(1024), readAhead(0) { }
+    };
+
+    // files are looked up by name in imageDir, or null to only
+    // simulate, with no reads made
+    IoReplay(char const * traceFile, char const * imageDir, Options const & options);
+    ~IoReplay();
+
+    void Run();
+    void WriteReport(std::ostream & os) const;
+
+private:
+    typedef std::pair<u32, u64> BLOCKKEY;     // file id, block number
+    typedef std::list<BLOCKKEY> BLOCKLIST;
+    typedef std::map<BLOCKKEY, BLOCKLIST::iterator> BLOCKMAP;
+
+    struct TraceFile
+    {
+        std::string name;
+        u64 size;
+        IFile64 * file;     // null if only simulated
+    };
+
+    IoReplay & operator = (IoReplay const &);
+    void OpenFile(u32 id, u64 size, std::string const & name);
+    void Request(u32 id, u64 offset, u64 length);
+    void Fetch(TraceFile & f, u32 id, u64 block, u32 count);
+    bool Lookup(BLOCKKEY const & key);
+
+    std::ifstream _trace;
+    std::string _imageDir;
+    Options _options;
+    std::vector<TraceFile> _files;
+    std::vector<u8> _buf;
+
+    BLOCKLIST _lru;     // most recent in front
+    BLOCKMAP _blocks;
+
+    u64 _requests;
+    u64 _requestBytes;
+    u64 _hits;
+    u64 _misses;
+    u64 _reads;         // reads of backing files
+    u64 _readBytes;
+    u64 _seeks;         // reads not following the previous one
+    u64 _nanos;
+    u32 _lastFile;
+    u64 _lastEnd;
+};
+
+#endif // __IOTRACE_H
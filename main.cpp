@@ -13,10 +13,30 @@
 #include "ntfs.h"
 #include "ntfs_file.h"
 #include "ntfs_tree.h"
+#include "ntfs_list.h"
+#include "ntfs_extract.h"
+#include "ntfs_hash.h"
+#include "ntfs_diff.h"
+#include "ntfs_export.h"
+#include "ntfs_carve.h"
+#include "ntfs_recover.h"
+#include "ntfs_timeline.h"
+#include "stats.h"
+#include "trace.h"
+#include "iotrace.h"
+#include "slowfile.h"
+#include "pathname.h"
 
 #include <stdexcept>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sstream>
+#include <algorithm>
+
+#ifdef _MSC_VER
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 struct Pause
 {
@@ -28,14 +48,303 @@ struct Pause
     }
 };
 
-char const CMD_USAGE[] = "usage: %s vmdkfile {--dump partition# [internal file path] [output file]} | {--snapshot [output file]}\n";
+// stops the I/O recording and writes the stats out however the run
+// ends, failed runs being the ones that most need looking into
+struct RunReport
+{
+    RunReport(bool stats) : _stats(stats) {}
+    ~RunReport()
+    {
+        IoRecorder::Stop();
+        if (_stats)
+            Stats::WriteJson(std::cerr);
+    }
+    bool _stats;
+};
+
+char const CMD_USAGE[] = "usage: %s vmdkfile {--dump partition# [internal file path] [output file]} | {--snapshot [output file] [--format text|tsv|jsonl|binary] [--jobs n]} | {--extract partition# manifest output folder [--jobs n]} | {--tar partition# manifest [--jobs n]} | {--hash partition# [output file] [--jobs n]} | {--owner partition# lcn[,count]...} | {--diff partition# older vmdkfile} | {--export output file} | {--carve partition# [signature file] [--jobs n]} | {--recover partition# [output folder]} | {--timeline partition# [output file] [--format body|csv|jsonl] [--memory MB]} [--cache folder] [--stats] [--trace output file] [--record trace file] [--slow latency us[,MB/s[,jitter us]]]\n"
+    "       %s --replay trace file [image folder] [--block bytes] [--blocks n] [--readahead n] [--slow latency us[,MB/s[,jitter us]]]\n";
+
+// removes "name value" from the arguments, returns value or 0 if not given
+char const * TakeOption(int & argc, char * argv[], char const * name)
+{
+    for (int i = 1; i < argc - 1; ++i)
+    {
+        if (strcmp(argv[i], name) == 0)
+        {
+            char const * value = argv[i + 1];
+            for (int j = i + 2; j < argc; ++j)
+                argv[j - 2] = argv[j];
+            argc -= 2;
+            return value;
+        }
+    }
+    return 0;
+}
+
+// removes a flag from the arguments, returns whether it was given
+bool TakeFlag(int & argc, char * argv[], char const * name)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], name) == 0)
+        {
+            for (int j = i + 1; j < argc; ++j)
+                argv[j - 1] = argv[j];
+            --argc;
+            return true;
+        }
+    }
+    return false;
+}
+
+// tree of a volume, cached in cacheDir per image; a missing one of a snapshot
+// image is patched from its parent image's tree, itself cached the same way
+std::auto_ptr<ntfs::Tree> OpenTree(ntfs::Ntfs & ntfsdisk, disk::Vmdk & vmdisk, int part, char const * cacheDir)
+{
+    u64 imageId = vmdisk.GetIdentity();
+    std::ostringstream ostr;
+    ostr << cacheDir << "/vmdkparse-" << std::hex << ntfsdisk.GetVolumeSerial() << "-" << imageId << "-" << std::dec << part << ".tree";
+    std::string cacheFile(ostr.str());
+
+    disk::Vmdk * parent = vmdisk.GetParent();
+    if (parent && !std::ifstream(cacheFile.c_str()).is_open())
+    {
+        ntfs::Ntfs parentNtfs(*parent, part);
+        if (parentNtfs.GetVolumeSerial() == ntfsdisk.GetVolumeSerial())
+        {
+            std::auto_ptr<ntfs::Tree> base(OpenTree(parentNtfs, *parent, part, cacheDir));
+            return std::auto_ptr<ntfs::Tree>(new ntfs::Tree(ntfsdisk, *base, cacheFile.c_str(), imageId));
+        }
+    }
+    return std::auto_ptr<ntfs::Tree>(new ntfs::Tree(ntfsdisk, cacheFile.c_str(), imageId));
+}
+
+
+
+// partition listings go out in drive letter order: only the listing at the
+// head of the order writes to the stream, later ones spill until their turn
+struct ListOrder
+{
+    ListOrder(std::ostream & os) : os(os), head(0) { }
+
+    std::ostream & os;
+    Mutex lock;
+    Condition done;     // a task finished
+    size_t head;        // index of the task that may write to os, guarded by lock
+
+private:
+    ListOrder & operator = (ListOrder const &);
+};
+
+// lists one NTFS partition through its own open of the image, so partitions
+// are read side by side. the listing is written straight out once it is at
+// the head of the order; until then it goes to a temporary file
+class ListTask : public Task, private std::streambuf
+{
+public:
+    ListTask(char const * vmdkFile, int part, size_t index, char const * cacheDir, ntfs::ListFormat format, ListOrder & order)
+    : _vmdkFile(vmdkFile), _part(part), _index(index), _cacheDir(cacheDir), _format(format), _order(order),
+      _done(false), _direct(false), _spill(0) { }
+    ~ListTask() { if (_spill) fclose(_spill); }
+
+    void Run();
+    bool Done() const { return _done; }     // caller must hold order's lock
+    std::string const & Error() const { return _error; }
+    void WriteSpill();      // spilled listing to the output, once done or at the head
+
+private:
+    ListTask & operator = (ListTask const &);
+    std::streamsize xsputn(char const * s, std::streamsize n);
+    int overflow(int c);
+    bool Write(char const * s, size_t n);
+
+    char const * _vmdkFile;
+    int _part;
+    size_t _index;          // in drive letter order
+    char const * _cacheDir;
+    ntfs::ListFormat _format;
+    ListOrder & _order;
+    bool _done;             // guarded by order's lock
+    bool _direct;           // writing to the output, spill written out
+    FILE * _spill;          // temporary file, null if none
+    std::string _error;     // empty if succeeded
+    std::string _writeError;    // of Write, which fails the stream
+};
+
+void ListTask::Run()
+{
+    try
+    {
+        disk::Vmdk vmdisk(_vmdkFile);
+        ntfs::Ntfs ntfsdisk(vmdisk, _part);
+        ntfsdisk.Test();
 
+        std::auto_ptr<ntfs::Tree> ptree;
+        if (_cacheDir)
+            ptree = OpenTree(ntfsdisk, vmdisk, _part, _cacheDir);
+        else
+            ptree.reset(new ntfs::Tree(ntfsdisk));
+
+        char drive[5] = { 'C', ':', 0 };
+        drive[0] = 'C' + _part;
+        if (drive[0] < 'C' || drive[0] > 'Z')
+            throw std::runtime_error("Drive letter not enough.");
+
+        std::ostream out(this);
+        ntfs::Lister lister(*ptree, out, _format);
+        lister.List(drive);
+        lister.Flush();
+        if (!out)
+            throw std::runtime_error(_writeError);
+    }
+    catch(char const * msg)
+    {
+        _error = msg;
+    }
+    catch(std::exception & err)
+    {
+        _error = err.what();
+    }
+    catch(...)
+    {
+        _error = "Unknown error while listing partition.";
+    }
+
+    ScopedLock lock(_order.lock);
+    _done = true;
+    _order.done.Broadcast();
+}
+
+void ListTask::WriteSpill()
+{
+    if (!_spill)
+        return;
+    std::vector<char> buf(1024 * 1024);
+    rewind(_spill);
+    size_t n;
+    while ((n = fread(&buf[0], 1, buf.size(), _spill)) > 0)
+        _order.os.write(&buf[0], n);
+    bool failed = ferror(_spill) != 0;
+    fclose(_spill);
+    _spill = 0;
+    if (failed)
+        throw std::runtime_error("Can't read temporary file of listing.");
+    if (!_order.os)
+        throw std::runtime_error("Can't write listing.");
+}
+
+std::streamsize ListTask::xsputn(char const * s, std::streamsize n)
+{
+    return Write(s, (size_t)n) ? n : 0;
+}
+
+int ListTask::overflow(int c)
+{
+    if (c == traits_type::eof())
+        return traits_type::not_eof(c);
+    char ch = (char)c;
+    return Write(&ch, 1) ? c : traits_type::eof();
+}
+
+// false with _writeError set if failed
+bool ListTask::Write(char const * s, size_t n)
+{
+    try
+    {
+        if (!_direct)
+        {
+            {
+                ScopedLock lock(_order.lock);
+                _direct = (_order.head == _index);
+            }
+            if (_direct)
+                WriteSpill();   // what came before goes first
+        }
+        if (_direct)
+        {
+            if (!_order.os.write(s, n))
+                throw std::runtime_error("Can't write listing.");
+            return true;
+        }
+
+        if (!_spill && (_spill = tmpfile()) == 0)
+            throw std::runtime_error("Can't create temporary file to list with.");
+        if (fwrite(s, 1, n, _spill) != n)
+            throw std::runtime_error("Can't write temporary file of listing.");
+        return true;
+    }
+    catch(std::exception & err)
+    {
+        _writeError = err.what();
+        return false;
+    }
+}
+
+// owns the volumes of the layers between two images
+struct NtfsLayers : public std::vector<ntfs::Ntfs*>
+{
+    ~NtfsLayers()
+    {
+        for (iterator it = begin(); it != end(); ++it)
+            delete *it;
+    }
+};
+
+// owns the tasks, must outlive the pool running them
+struct ListTasks : public std::vector<ListTask*>
+{
+    ~ListTasks()
+    {
+        for (iterator it = begin(); it != end(); ++it)
+            delete *it;
+    }
+};
 
 int main(int argc, char * argv[])
 {
+    // tree snapshots are kept here across runs, if given
+    char const * cacheDir = TakeOption(argc, argv, "--cache");
+
+    ntfs::ListFormat format = ntfs::eListText;
+    char const * formatName = TakeOption(argc, argv, "--format");
+    char const * jobs = TakeOption(argc, argv, "--jobs");  // default one per hardware thread
+    char const * memory = TakeOption(argc, argv, "--memory");  // MB to sort the timeline in
+    bool stats = TakeFlag(argc, argv, "--stats");   // I/O counters as JSON to stderr at the end
+    Stats::Enable(stats);
+    char const * trace = TakeOption(argc, argv, "--trace");    // timeline written at exit
+    if (trace)
+        Trace::Start(trace);
+    char const * record = TakeOption(argc, argv, "--record");  // every image read request
+    char const * slow = TakeOption(argc, argv, "--slow");      // images read as if from remote storage
+    SlowStorage::Options slowOptions;
+
+    // cache policy to replay a recorded trace with
+    IoReplay::Options replay;
+    char const * replayBlock = TakeOption(argc, argv, "--block");
+    char const * replayBlocks = TakeOption(argc, argv, "--blocks");
+    char const * replayAhead = TakeOption(argc, argv, "--readahead");
+    if (replayBlock)
+        replay.blockSize = atoi(replayBlock);
+    if (replayBlocks)
+        replay.cacheBlocks = atoi(replayBlocks);
+    if (replayAhead)
+        replay.readAhead = atoi(replayAhead);
+    // --format means the timeline's own formats for --timeline
+    ntfs::TimelineFormat timelineFormat = ntfs::eTimelineCsv;
+    bool timeline = (argc >= 3 && strcmp(argv[2], "--timeline") == 0);
+    if ((formatName && !timeline && !ntfs::Lister::ParseFormat(formatName, format))
+        || (formatName && timeline && !ntfs::Timeline::ParseFormat(formatName, timelineFormat))
+        || (memory && atoi(memory) <= 0)
+        || (slow && !SlowStorage::Parse(slow, slowOptions)))
+    {
+        fprintf(stderr, CMD_USAGE, argv[0], argv[0]);
+        return 1;
+    }
+
     if (argc < 3)
     {
-        fprintf(stderr, CMD_USAGE, argv[0]);
+        fprintf(stderr, CMD_USAGE, argv[0], argv[0]);
         return 1;
     }
 
@@ -43,8 +352,22 @@ int main(int argc, char * argv[])
     Pause pause;
 #endif
 
+    RunReport report(stats);
     try
     {
+        if (slow)
+            SlowStorage::Start(slowOptions);
+        if (strcmp(argv[1], "--replay") == 0)
+        {
+            // files of the trace are read from the folder if given, else only simulated
+            IoReplay replayer(argv[2], (argc >= 4) ? argv[3] : 0, replay);
+            replayer.Run();
+            replayer.WriteReport(std::cout);
+            return 0;
+        }
+
+        if (record)
+            IoRecorder::Start(record);
         disk::Vmdk vmdisk(argv[1]);
         vmdisk.Test();
 
@@ -53,7 +376,7 @@ int main(int argc, char * argv[])
             std::ofstream ofs;
             if (argc >= 4)
             {
-                ofs.open(argv[3]);
+                ofs.open(argv[3], format == ntfs::eListBinary ? std::ios_base::binary : std::ios_base::out);
                 if (!ofs.is_open())
                     throw std::runtime_error("Can't open output file.");
             }
@@ -75,8 +398,9 @@ int main(int argc, char * argv[])
             }
 
             // dump all NTFS partitions'
+            ListOrder order((argc >= 4) ? ofs : std::cout);
+            ListTasks tasks;
             char part = 0;
-            char drive[5] = { 'C', ':', 0 };
             disk::Partitions::iterator it = vmdisk.BeginPartition();
             for (; it != vmdisk.EndPartition(); ++it, ++part)
             {
@@ -96,21 +420,31 @@ int main(int argc, char * argv[])
                     bootOut.write(&buf[0], sizeof(buf));
                 }
 
-                // dumps files/folders listing
+                // files/folders listing is done by the pool
                 if (it->type == 0x7) // is NTFS
+                    tasks.push_back(new ListTask(argv[1], part, tasks.size(), cacheDir, format, order));
+            }
+
+            if (!tasks.empty())
+            {
+                unsigned threads = jobs ? atoi(jobs) : Thread::HardwareConcurrency();
+                ThreadPool pool(std::max(1U, std::min<unsigned>(threads, tasks.size())));
+                for (size_t i = 0; i < tasks.size(); ++i)
+                    pool.Submit(tasks[i]);
+
+                // each in drive order takes its turn at the head, the spill
+                // of one that finished before its turn is written out then
+                for (size_t i = 0; i < tasks.size(); ++i)
                 {
-                    ntfs::Ntfs ntfsdisk(vmdisk, part);
-                    ntfsdisk.Test();
-                    ntfs::Tree tree(ntfsdisk);
-
-                    drive[0] = 'C' + part;
-                    if (drive[0] < 'C' || drive[0] > 'Z')
-                        throw std::runtime_error("Drive letter not enough.");
-
-                    if (argc >= 4)
-                        tree.Print(drive, ofs);
-                    else
-                        tree.Print(drive);
+                    {
+                        ScopedLock scoped(order.lock);
+                        order.head = i;
+                        while (!tasks[i]->Done())
+                            order.done.Wait(order.lock);
+                    }
+                    if (!tasks[i]->Error().empty())
+                        throw std::runtime_error(tasks[i]->Error());
+                    tasks[i]->WriteSpill();
                 }
             }
         }
@@ -122,24 +456,312 @@ int main(int argc, char * argv[])
                 part = atoi(argv[3]);
             ntfs::Ntfs ntfsdisk(vmdisk, part);
             ntfsdisk.Test();
-            ntfs::Tree tree(ntfsdisk);
-            ntfs::File file(tree);
+
+            // decompress upcoming units of compressed files on all cores
+            // path is looked up through folder indexes, no need for the whole tree
+            ThreadPool pool;
+            ntfs::File file(ntfsdisk);
+            file.SetReadAhead(&pool, 2 * pool.Size());
 
             file.Open((argc >= 5) ? argv[4] : "/WINDOWS/system32/notepad.exe");
 
-            char buf[512];
+            TraceSpan span("dump file", "extract");
+
+            // only data ranges are written, holes are seeked over and stay
+            // unallocated in the output where its file system can do so
+            ntfs::File::RANGES ranges;
+            file.GetDataRanges(ranges);
+            std::vector<char> buf(1024 * 1024);
             u64 size = file.Size();
-            unsigned long reads;
             std::ofstream ofs(((argc >= 6) ? argv[5] : "dump.bin"), std::ios_base::binary);
-            while (!file.Eof())
+            for (size_t k = 0; k < ranges.size(); ++k)
+            {
+                file.Seek(ranges[k].first);
+                ofs.seekp(ranges[k].first);
+                for (u64 left = ranges[k].second; left > 0; )
+                {
+                    unsigned long reads = file.Read(&buf[0], (unsigned long)std::min<u64>(left, buf.size()));
+                    if (reads == 0)
+                        throw std::runtime_error("Short read of file to dump.");
+                    ofs.write(&buf[0], reads);
+                    left -= reads;
+                }
+            }
+
+            // trailing hole still counts in size
+            if (size > 0 && (ranges.empty() || ranges.back().first + ranges.back().second < size))
+            {
+                ofs.seekp(size - 1);
+                ofs.put(0);
+            }
+            if (!ofs.good())
+                throw std::runtime_error("Can't write output file.");
+        }
+        else if ((strcmp(argv[2], "--extract") == 0 && argc >= 6) || (strcmp(argv[2], "--tar") == 0 && argc >= 5))
+        {
+            // extract files listed in manifest, a path or wildcard pattern per line,
+            // into a folder or as a tar stream to stdout
+            bool tar = (strcmp(argv[2], "--tar") == 0);
+            int part = atoi(argv[3]);
+            ntfs::Ntfs ntfsdisk(vmdisk, part);
+            ntfsdisk.Test();
+
+            std::auto_ptr<ntfs::Tree> ptree;
+            if (cacheDir)
+                ptree = OpenTree(ntfsdisk, vmdisk, part, cacheDir);
+            else
+                ptree.reset(new ntfs::Tree(ntfsdisk));
+
+            std::ifstream manifest(argv[4]);
+            if (!manifest.is_open())
+                throw std::runtime_error("Can't open manifest file.");
+
+            ntfs::Extractor extractor(ntfsdisk, *ptree, tar ? "" : argv[5]);
+            std::string line;
+            while (std::getline(manifest, line))
+            {
+                if (!line.empty() && *line.rbegin() == '\r')
+                    line.resize(line.size() - 1);
+                if (line.empty() || line[0] == '#')
+                    continue;
+                if (extractor.Add(line.c_str()) == 0)
+                    std::cerr << "Nothing matches " << line << std::endl;
+            }
+
+            ThreadPool pool(jobs ? atoi(jobs) : 0);
+            if (tar)
+            {
+#ifdef _MSC_VER
+                _setmode(_fileno(stdout), _O_BINARY);
+#endif
+                extractor.WriteTar(std::cout, &pool);
+            }
+            else
+            {
+                extractor.Run(pool);
+            }
+            std::cerr << extractor.Count() << " streams, " << extractor.BytesWritten() << " bytes extracted." << std::endl;
+        }
+        else if (strcmp(argv[2], "--hash") == 0 && argc >= 4)
+        {
+            // hash manifest of every file stream
+            int part = atoi(argv[3]);
+            ntfs::Ntfs ntfsdisk(vmdisk, part);
+            ntfsdisk.Test();
+
+            std::auto_ptr<ntfs::Tree> ptree;
+            if (cacheDir)
+                ptree = OpenTree(ntfsdisk, vmdisk, part, cacheDir);
+            else
+                ptree.reset(new ntfs::Tree(ntfsdisk));
+
+            std::ofstream ofs;
+            if (argc >= 5)
+            {
+                ofs.open(argv[4]);
+                if (!ofs.is_open())
+                    throw std::runtime_error("Can't open output file.");
+            }
+
+            ntfs::Hasher hasher(ntfsdisk, *ptree);
+            ThreadPool pool(jobs ? atoi(jobs) : 0);
+            hasher.Run(pool);
+            hasher.Write((argc >= 5) ? ofs : std::cout);
+            std::cerr << hasher.Count() << " streams, " << hasher.BytesHashed() << " bytes hashed." << std::endl;
+        }
+        else if (strcmp(argv[2], "--owner") == 0 && argc >= 5)
+        {
+            // streams owning the given clusters
+            int part = atoi(argv[3]);
+            ntfs::Ntfs ntfsdisk(vmdisk, part);
+            ntfsdisk.Test();
+
+            std::auto_ptr<ntfs::Tree> ptree;
+            if (cacheDir)
+                ptree = OpenTree(ntfsdisk, vmdisk, part, cacheDir);
+            else
+                ptree.reset(new ntfs::Tree(ntfsdisk));
+
+            ntfs::ClusterMap::RANGES ranges;
+            for (int i = 4; i < argc; ++i)
+            {
+                unsigned long long lcn = 0, count = 1;
+                if (sscanf(argv[i], "%llu,%llu", &lcn, &count) < 1 || count == 0)
+                {
+                    fprintf(stderr, CMD_USAGE, argv[0], argv[0]);
+                    return 1;
+                }
+                ranges.push_back(std::make_pair((u64)lcn, (u64)count));
+            }
+
+            ntfs::ClusterMap::HITS hits;
+            ptree->GetClusterMap().Find(ranges, hits);
+
+            // lcn, clusters, byte offset in stream, MFT index, path; unowned ranges say so
+            ntfs::NodeStore const & store = ptree->GetStore();
+            u64 clusterSize = (u64)ntfsdisk.GetBytesPerSector() * ntfsdisk.GetSectorsPerCluster();
+            size_t h = 0;
+            for (u32 i = 0; i < ranges.size(); ++i)
+            {
+                if (h == hits.size() || hits[h].query != i)
+                    std::cout << ranges[i].first << '\t' << ranges[i].second << "\t-\t-\t(not in any file)\n";
+                for (; h < hits.size() && hits[h].query == i; ++h)
+                {
+                    ntfs::ClusterMap::Hit const & hit = hits[h];
+                    std::cout << hit.lcn << '\t' << hit.count << '\t' << hit.vcn * clusterSize << '\t'
+                        << store[hit.node].mftRef << '\t' << ToUtf8(store.Path(hit.node, hit.stream)) << '\n';
+                }
+            }
+            std::cout.flush();
+        }
+        else if (strcmp(argv[2], "--diff") == 0 && argc >= 5)
+        {
+            // files changed since an older image of the same disk
+            int part = atoi(argv[3]);
+            ntfs::Ntfs ntfsdisk(vmdisk, part);
+            ntfsdisk.Test();
+            disk::Vmdk olderDisk(argv[4]);
+            ntfs::Ntfs olderNtfs(olderDisk, part);
+            olderNtfs.Test();
+            if (olderNtfs.GetVolumeSerial() != ntfsdisk.GetVolumeSerial())
+                throw std::runtime_error("Not the same volume in both images.");
+
+            std::auto_ptr<ntfs::Tree> older;
+            if (cacheDir)
+                older = OpenTree(olderNtfs, olderDisk, part, cacheDir);
+            else
+                older.reset(new ntfs::Tree(olderNtfs));
+
+            // if older is up the chain, only the records in grains of the layers
+            // on top of it can differ, the rest need not be read nor compared
+            ntfs::Ntfs * layer = &ntfsdisk;
+            std::vector<ntfs::Ntfs*> layers;
+            NtfsLayers owned;
+            disk::Vmdk * d = &vmdisk;
+            for (; d && (olderDisk.GetCid().empty() || d->GetCid() != olderDisk.GetCid()); d = d->GetParent())
+            {
+                if (d != &vmdisk)
+                {
+                    owned.push_back(new ntfs::Ntfs(*d, part));
+                    layer = owned.back();
+                }
+                layers.push_back(layer);
+            }
+
+            std::vector<bool> changed;
+            std::auto_ptr<ntfs::Tree> newer;
+            if (d)
             {
-                reads = file.Read(buf, (unsigned long)std::min<u64>(sizeof(buf), size));
-                ofs.write(buf, reads);
+                if (layers.empty())
+                    changed.assign((size_t)(ntfsdisk.GetMftSize() / ntfsdisk.GetFileRecordSize()), false);  // same image
+                else
+                    ntfs::Tree::FindChangedRecords(layers, changed);
+                if (cacheDir)
+                    newer = OpenTree(ntfsdisk, vmdisk, part, cacheDir);
+                else
+                    newer.reset(new ntfs::Tree(ntfsdisk, *older, changed));
             }
+            else
+            {
+                std::cerr << "Older image is not a parent, comparing every record." << std::endl;
+                if (cacheDir)
+                    newer = OpenTree(ntfsdisk, vmdisk, part, cacheDir);
+                else
+                    newer.reset(new ntfs::Tree(ntfsdisk));
+            }
+
+            ntfs::TreeDiff diff(*older, *newer);
+            if (!changed.empty())
+                diff.Restrict(changed);
+            diff.Run();
+            diff.Write(std::cout);
+            std::cerr << diff.Changes().size() << " changes, " << diff.Compared() << " records compared." << std::endl;
+        }
+        else if (strcmp(argv[2], "--export") == 0 && argc >= 4)
+        {
+            // raw disk image, free NTFS clusters left as holes
+            std::ofstream ofs(argv[3], std::ios_base::binary | std::ios_base::trunc);
+            if (!ofs.is_open())
+                throw std::runtime_error("Can't open output file.");
+            ntfs::ImageExporter exporter(vmdisk);
+            exporter.Run(ofs);
+            std::cerr << exporter.BytesWritten() << " bytes written, " << exporter.BytesFree() << " bytes free, "
+                << exporter.BytesZero() << " bytes zero." << std::endl;
+        }
+        else if (strcmp(argv[2], "--carve") == 0 && argc >= 4)
+        {
+            // known file signatures in free clusters
+            int part = atoi(argv[3]);
+            ntfs::Ntfs ntfsdisk(vmdisk, part);
+            ntfsdisk.Test();
+
+            ntfs::Carver carver(ntfsdisk);
+            if (argc >= 5)
+            {
+                std::ifstream ifs(argv[4]);
+                if (!ifs.is_open())
+                    throw std::runtime_error("Can't open signature file.");
+                carver.LoadSignatures(ifs);
+            }
+            else
+            {
+                carver.AddDefaultSignatures();
+            }
+
+            ThreadPool pool(jobs ? atoi(jobs) : 0);
+            carver.Run(pool);
+            carver.Write(std::cout);
+            std::cerr << carver.Count() << " hits, " << carver.BytesScanned() << " bytes scanned." << std::endl;
+        }
+        else if (strcmp(argv[2], "--recover") == 0 && argc >= 4)
+        {
+            // deleted files still in unused MFT records, extracted if folder given
+            int part = atoi(argv[3]);
+            ntfs::Ntfs ntfsdisk(vmdisk, part);
+            ntfsdisk.Test();
+
+            // never cached, snapshots hold no deleted nodes
+            ntfs::Tree tree(ntfsdisk, false, true);
+            ntfs::Recovery recovery(ntfsdisk, tree);
+            recovery.Run();
+            recovery.Write(std::cout);
+            std::cerr << recovery.Count() << " deleted streams." << std::endl;
+            if (argc >= 5)
+            {
+                u32 written = recovery.Extract(argv[4]);
+                for (size_t i = 0; i < recovery.Skipped().size(); ++i)
+                    std::cerr << recovery.Skipped()[i] << std::endl;
+                std::cerr << written << " streams, " << recovery.BytesWritten() << " bytes extracted." << std::endl;
+            }
+        }
+        else if (timeline && argc >= 4)
+        {
+            // MACB times of every file & folder in time order
+            int part = atoi(argv[3]);
+            ntfs::Ntfs ntfsdisk(vmdisk, part);
+            ntfsdisk.Test();
+
+            std::auto_ptr<ntfs::Tree> ptree;
+            if (cacheDir)
+                ptree = OpenTree(ntfsdisk, vmdisk, part, cacheDir);
+            else
+                ptree.reset(new ntfs::Tree(ntfsdisk));
+
+            std::ofstream ofs;
+            if (argc >= 5)
+            {
+                ofs.open(argv[4], std::ios_base::binary);
+                if (!ofs.is_open())
+                    throw std::runtime_error("Can't open output file.");
+            }
+
+            ntfs::Timeline tl(*ptree, timelineFormat, memory ? (u64)atoi(memory) * 1024 * 1024 : ntfs::Timeline::DEFAULT_MEMORY);
+            tl.Write((argc >= 5) ? ofs : std::cout);
+            std::cerr << tl.Count() << " events, " << tl.Spilled() << " sorted runs spilled." << std::endl;
         }
         else
         {
-            fprintf(stderr, CMD_USAGE, argv[0]);
+            fprintf(stderr, CMD_USAGE, argv[0], argv[0]);
             return 1;
         }
         return 0;
@@ -0,0 +1,110 @@
+//
+// Memory Mapped File
+// Read-only mapping of an entire file into memory. Both Win32
+// & POSIX definition are conditionally preprocessed depends
+// on compiler platforms.
+//
+// Based on the _MSC_VER symbol, if defined means Win32,
+// otherwise Linux.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "mapfile.h"
+
+MappedFile::MappedFile() : _data(0), _size(0), _h(0) { }
+MappedFile::~MappedFile() { Close(); }
+
+// if using Microsoft Visual Studio compiler
+// We can safely assume Win32 API exists
+#ifdef _MSC_VER
+
+#include <windows.h>
+
+//=============================================================================
+// for Win32 file mapping
+bool MappedFile::Open(char const * filename)
+{
+    Close();
+    HANDLE hFile = ::CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER li;
+    if (!::GetFileSizeEx(hFile, &li) || li.QuadPart == 0)
+    {
+        ::CloseHandle(hFile);
+        return false;
+    }
+
+    // the mapping keeps the file open by itself
+    _h = ::CreateFileMappingA(hFile, 0, PAGE_READONLY, 0, 0, 0);
+    ::CloseHandle(hFile);
+    if (_h == 0)
+        return false;
+    _data = ::MapViewOfFile(_h, FILE_MAP_READ, 0, 0, 0);
+    if (_data == 0)
+    {
+        ::CloseHandle(_h);
+        _h = 0;
+        return false;
+    }
+    _size = li.QuadPart;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (_data)
+        ::UnmapViewOfFile(_data);
+    if (_h)
+        ::CloseHandle(_h);
+    _data = 0;
+    _h = 0;
+    _size = 0;
+}
+
+#else
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+//=============================================================================
+// for POSIX file mapping
+bool MappedFile::Open(char const * filename)
+{
+    Close();
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    // the mapping keeps the file open by itself
+    void * p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    _data = p;
+    _size = st.st_size;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (_data)
+        munmap(_data, _size);
+    _data = 0;
+    _size = 0;
+}
+
+#endif // _MSC_VER
@@ -0,0 +1,41 @@
+//
+// Memory Mapped File
+// Read-only mapping of an entire file into memory. Both Win32
+// & POSIX definition are conditionally preprocessed depends
+// on compiler platforms.
+//
+// Based on the _MSC_VER symbol, if defined means Win32,
+// otherwise Linux.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __MAPFILE_H
+#define __MAPFILE_H
+
+#include "types.h"
+
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool Open(char const * filename);   // false if missing, empty or can't be mapped
+    void Close();
+    bool IsOpen() const { return _data != 0; }
+    void const * Data() const { return _data; }
+    u64 Size() const { return _size; }
+
+private:
+    MappedFile(MappedFile const &);                 // not copyable
+    MappedFile & operator = (MappedFile const &);   // not assignable
+
+    void * _data;
+    u64 _size;
+    void * _h;      // Win32 file mapping handle
+};
+
+#endif // __MAPFILE_H
@@ -0,0 +1,121 @@
+//
+// Multi-Pattern Matcher
+// Aho-Corasick automaton over a set of byte patterns.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "matcher.h"
+
+#include <deque>
+#include <stdexcept>
+
+u32 const PatternMatcher::NPOS;
+
+PatternMatcher::PatternMatcher() : _maxLength(0), _built(false)
+{
+    NewState();     // root
+}
+
+u32 PatternMatcher::NewState()
+{
+    _next.resize(_next.size() + 256, NPOS);
+    _match.push_back(NPOS);
+    _output.push_back(NPOS);
+    return _match.size() - 1;
+}
+
+u32 PatternMatcher::Add(std::string const & pattern)
+{
+    if (_built)
+        throw std::runtime_error("Patterns can't be added once built.");
+    if (pattern.empty())
+        throw std::runtime_error("Empty pattern.");
+
+    // trie of the patterns first, Build() turns it into the automaton
+    u32 state = 0;
+    for (size_t i = 0; i < pattern.size(); ++i)
+    {
+        u8 c = (u8)pattern[i];
+        if (_next[state * 256 + c] == NPOS)
+        {
+            u32 s = NewState();
+            _next[state * 256 + c] = s;
+        }
+        state = _next[state * 256 + c];
+    }
+
+    u32 id = _patterns.size();
+    if (_match[state] == NPOS)
+        _match[state] = id;     // duplicates hit as the first of them
+    _patterns.push_back(pattern);
+    if (pattern.size() > _maxLength)
+        _maxLength = pattern.size();
+    return id;
+}
+
+void PatternMatcher::Build()
+{
+    if (_built)
+        return;
+
+    // breadth first, a state's failure is done before those of its children;
+    // missing transitions take the failure's, so no failure links are kept
+    std::vector<u32> fail(_match.size(), 0);
+    std::deque<u32> queue;
+    for (u32 c = 0; c < 256; ++c)
+    {
+        u32 & s = _next[c];
+        if (s == NPOS)
+        {
+            s = 0;
+        }
+        else
+        {
+            fail[s] = 0;
+            queue.push_back(s);
+        }
+    }
+    while (!queue.empty())
+    {
+        u32 state = queue.front();
+        queue.pop_front();
+        u32 f = fail[state];
+        _output[state] = (_match[f] != NPOS) ? f : _output[f];
+        for (u32 c = 0; c < 256; ++c)
+        {
+            u32 & s = _next[state * 256 + c];
+            if (s == NPOS)
+            {
+                s = _next[f * 256 + c];
+            }
+            else
+            {
+                fail[s] = _next[f * 256 + c];
+                queue.push_back(s);
+            }
+        }
+    }
+    _built = true;
+}
+
+u32 PatternMatcher::Scan(u8 const * data, size_t size, HITS & hits, u32 state) const
+{
+    if (!_built)
+        throw std::runtime_error("Matcher used before built.");
+    u32 const * next = &_next[0];
+    for (size_t i = 0; i < size; ++i)
+    {
+        state = next[state * 256 + data[i]];
+        if (_match[state] == NPOS && _output[state] == NPOS)
+            continue;
+        for (u32 s = (_match[state] != NPOS) ? state : _output[state]; s != NPOS; s = _output[s])
+        {
+            u32 id = _match[s];
+            hits.push_back(std::make_pair((u64)(i + 1) - _patterns[id].size(), id));
+        }
+    }
+    return state;
+}
@@ -0,0 +1,55 @@
+//
+// Multi-Pattern Matcher
+// Aho-Corasick automaton over a set of byte patterns, compiled into
+// a full transition table, so scanning is a single table lookup per
+// byte no matter how many patterns there are. A scan can be resumed
+// across buffers by passing the state on.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __MATCHER_H
+#define __MATCHER_H
+
+#include "types.h"
+
+#include <string>
+#include <vector>
+
+class PatternMatcher
+{
+public:
+    static u32 const NPOS = ~0U;
+
+    // (offset of the first byte in the scanned buffer, pattern id)
+    typedef std::vector<std::pair<u64, u32> > HITS;
+
+    PatternMatcher();
+
+    // patterns are numbered in the order added; Build() after the last one
+    u32 Add(std::string const & pattern);
+    void Build();
+
+    u32 Count() const { return _patterns.size(); }
+    std::string const & Pattern(u32 id) const { return _patterns[id]; }
+    u32 MaxLength() const { return _maxLength; }
+
+    // appends hits ending in the buffer, from the given state (0 to start afresh)
+    // and returns the state to resume from; offsets are relative to the buffer,
+    // a hit begun in an earlier buffer wraps around below zero
+    u32 Scan(u8 const * data, size_t size, HITS & hits, u32 state = 0) const;
+
+private:
+    u32 NewState();
+
+    std::vector<std::string> _patterns;
+    std::vector<u32> _next;     // state * 256 + byte, the goto & failure functions in one
+    std::vector<u32> _match;    // pattern ending at the state, NPOS if none
+    std::vector<u32> _output;   // next state down the failure chain with a match, NPOS if none
+    u32 _maxLength;
+    bool _built;
+};
+
+#endif // __MATCHER_H
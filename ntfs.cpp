@@ -12,11 +12,13 @@
 #include "types.h"
 #include "ntfs.h"
 #include "ntfs_attr.h"
+#include "stats.h"
 
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <stdexcept>
+#include <algorithm>
 
 using namespace ntfs;
 
@@ -53,6 +55,8 @@ void Ntfs::Init()
 
     if ((_bytesPerFileRecord % _bootb.BytesPerSector) != 0)
         throw std::runtime_error("MFT size must be divisable by sector size.");
+
+    InitUpCase();
 }
 
 //=============================================================================
@@ -203,6 +207,46 @@ void Ntfs::InitMft()
     } // if attr list available
 }
 
+//=============================================================================
+void Ntfs::InitUpCase()
+{
+    // default to ASCII only folding, in case $UpCase is unreadable
+    _upcase.resize(0x10000);
+    for (u32 c = 0; c < _upcase.size(); ++c)
+        _upcase[c] = (c >= 'a' && c <= 'z') ? (u16)(c - 'a' + 'A') : (u16)c;
+
+    // $UpCase is always record #10, an unnamed non-resident $DATA of 128K
+    std::vector<u8> buf(_bytesPerFileRecord);
+    FILE_RECORD_HEADER * phdr = (FILE_RECORD_HEADER*)&buf[0];
+    ReadFileRecord(10, phdr);
+    if (buf[0] != 'F' || buf[1] != 'I' || buf[2] != 'L' || buf[3] != 'E' || !(phdr->Flags & 0x01))
+        return;
+    ATTRIBUTE * pattr = FindAttribute(phdr, eAttributeData, 0);
+    if (pattr == 0 || !pattr->Nonresident)
+        return;
+
+    AttributeData attr;
+    attr.Init((u8*)pattr, pattr->Length);
+    if (attr._realSize != _upcase.size() * sizeof(u16))
+        return;
+    DataRun dataRun;
+    dataRun.Init(&attr._data[0], attr._data.size(), attr._startVcn);
+
+    u32 clusterSize = _bootb.BytesPerSector * _bootb.SectorsPerCluster;
+    std::vector<u8> table((attr._realSize + clusterSize - 1) / clusterSize * clusterSize);
+    for (u64 vcn = 0; vcn * clusterSize < table.size(); )
+    {
+        u64 contiguous;
+        u64 lcn = dataRun.Vcn2Lcn(vcn, contiguous);
+        u32 n = (u32)std::min<u64>(contiguous, table.size() / clusterSize - vcn);
+        if (lcn == 0)
+            return;     // sparse $UpCase makes no sense
+        ReadLCN(lcn, n, &table[(size_t)(vcn * clusterSize)]);
+        vcn += n;
+    }
+    memcpy(&_upcase[0], &table[0], _upcase.size() * sizeof(u16));
+}
+
 //=============================================================================
 bool Ntfs::ApplyUpdateSequence(void * buf, u32 /*bufSize*/)
 {
@@ -243,6 +287,10 @@ bool Ntfs::ApplyUpdateSequence(void * buf, u32 /*bufSize*/)
 //=============================================================================
 void Ntfs::ReadLCN(u64 lcn, u32 count, void * buf)
 {
+    u64 clusterSize = _bootb.BytesPerSector * _bootb.SectorsPerCluster;
+    StatScope stat(eStatReadLcn);
+    stat.Position(lcn * clusterSize, count * clusterSize);
+    stat.SetBytes(count * clusterSize);
     if (!_disk.ReadSectorN(lcn * _bootb.SectorsPerCluster, count * _bootb.SectorsPerCluster, buf, _partitionNum))
         throw std::runtime_error("Error reading LCN cluster.");
 }
@@ -267,11 +315,14 @@ ATTRIBUTE * Ntfs::FindAttribute(FILE_RECORD_HEADER * phdr, ATTRIBUTE_TYPE type,
 }
 
 //=============================================================================
-void Ntfs::ReadFileRecord(u64 index, void * phdr)
+bool Ntfs::ReadFileRecord(u64 index, void * phdr)
 {
     if (_pMftDataRun.get() == 0 || _pMftDataRun->_list.empty())
         throw std::runtime_error("Requesting data from $MFT before parsing $MFT info.");
     index = index & MFT_MASK;
+    StatScope stat(eStatMftRecord);
+    stat.Position(index * _bytesPerFileRecord, _bytesPerFileRecord);
+    stat.SetBytes(_bytesPerFileRecord);
     u32 clusters = _bootb.ClustersPerFileRecord;
     if (clusters & 0x80) clusters = 1;
     std::vector<u8> p(_bootb.BytesPerSector * _bootb.SectorsPerCluster * clusters);
@@ -280,6 +331,38 @@ void Ntfs::ReadFileRecord(u64 index, void * phdr)
     s32 m = (_bootb.SectorsPerCluster * _bootb.BytesPerSector / _bytesPerFileRecord) - 1;
     u32 n = m > 0 ? (index & m) : 0;
     memcpy(phdr, &p[0] + n * _bytesPerFileRecord, _bytesPerFileRecord);
-    ApplyUpdateSequence(phdr, _bytesPerFileRecord);
+    return ApplyUpdateSequence(phdr, _bytesPerFileRecord);
+}
+
+void Ntfs::MarkOwnedRecords(std::vector<bool> & owned)
+{
+    if (_pMftDataRun.get() == 0 || _pMftDataRun->_list.empty())
+        throw std::runtime_error("Requesting data from $MFT before parsing $MFT info.");
+    u64 records = std::min<u64>(_mftSize / _bytesPerFileRecord, owned.size());
+    u32 clusterSize = _bootb.BytesPerSector * _bootb.SectorsPerCluster;
+    u64 clusters = (records * _bytesPerFileRecord + clusterSize - 1) / clusterSize;
+
+    // owned sectors of each run, to the records they hold part of
+    disk::SectorRanges ranges;
+    for (u64 vcn = 0; vcn < clusters; )
+    {
+        u64 contiguous;
+        u64 lcn = _pMftDataRun->Vcn2Lcn(vcn, contiguous);
+        u64 n = std::min<u64>(contiguous, clusters - vcn);
+        if (lcn != 0)
+        {
+            u64 sector = lcn * _bootb.SectorsPerCluster;
+            _disk.GetOwnSectors(sector, n * _bootb.SectorsPerCluster, ranges, _partitionNum);
+            for (size_t k = 0; k < ranges.size(); ++k)
+            {
+                u64 begin = vcn * clusterSize + (ranges[k].first - sector) * _bootb.BytesPerSector;
+                u64 end = begin + ranges[k].second * _bootb.BytesPerSector;
+                u64 last = std::min<u64>((end - 1) / _bytesPerFileRecord + 1, records);
+                for (u64 i = begin / _bytesPerFileRecord; i < last; ++i)
+                    owned[(size_t)i] = true;
+            }
+        }
+        vcn += n;
+    }
 }
 
@@ -37,7 +37,10 @@ namespace ntfs
         Ntfs(disk::IDiskRead & disk, int partitionNum=0);
 
         bool ApplyUpdateSequence(void * buf, u32 bufSize);
-        void ReadFileRecord(u64 index, void * phdr);
+        bool ReadFileRecord(u64 index, void * phdr);    // false if torn, i.e. update sequence mismatch
+        // sets owned[i] of records with any sector held by the image itself, rather
+        // than read through to a parent image; a pass over $MFT's runs
+        void MarkOwnedRecords(std::vector<bool> & owned);
         void ReadLCN(u64 lcn, u32 count, void * buf);
         u32 GetFileRecordSize() const { return _bytesPerFileRecord; }
         u64 GetMftSize() const { return _mftSize; }
@@ -46,11 +49,19 @@ namespace ntfs
         u64 GetMftEndVcn() const { return _mftEndVcn; }
         u16 GetBytesPerSector() const { return _bootb.BytesPerSector; }
         u8 GetSectorsPerCluster() const { return _bootb.SectorsPerCluster; }
+        u64 GetTotalSectors() const { return _bootb.TotalSectors; }
+        u64 GetVolumeSerial() const { return _bootb.VolumeSerialNumber; }
+        s64 GetMftLsn() const { return ((FILE_RECORD_HEADER*)&_mft[0])->Ntfs.Usn; }    // of $MFT's own record
+
+        // volume's $UpCase table, 64K entries for case-insensitive name compare
+        u16 const * GetUpCase() const { return &_upcase[0]; }
+        u16 UpCase(u16 c) const { return _upcase[c]; }
         void Test();
 
     private:
         void InitBoot();
         void InitMft();
+        void InitUpCase();
         void Init();
         ATTRIBUTE * FindAttribute(FILE_RECORD_HEADER * phdr, ATTRIBUTE_TYPE type, u16 const * name);
         //ntfs::Ntfs & operator = (ntfs::Ntfs const &) { return *this; }  // not allow assignment
@@ -67,6 +78,7 @@ namespace ntfs
         u64 _mftAllocatedSize;
         u64 _mftStartVcn;
         u64 _mftEndVcn;
+        std::vector<u16> _upcase;
     };
 
 }
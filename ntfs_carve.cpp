@@ -0,0 +1,209 @@
+//
+// NTFS Carver
+// Scans the free clusters of a volume for known file signatures.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "ntfs_carve.h"
+#include "ntfs_file.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+using namespace ntfs;
+
+namespace
+{
+    u32 const BATCH_SIZE = 4 * 1024 * 1024;     // bytes read at a time per thread
+
+    struct DefaultSignature
+    {
+        char const * name;
+        char const * bytes;
+        u32 size;
+    };
+
+    // file headers, long enough not to hit every other cluster
+    DefaultSignature const DEFAULT_SIGNATURES[] =
+    {
+        { "jpeg",   "\xff\xd8\xff\xe0", 4 },
+        { "jpeg",   "\xff\xd8\xff\xe1", 4 },
+        { "png",    "\x89PNG\r\n\x1a\n", 8 },
+        { "gif",    "GIF87a", 6 },
+        { "gif",    "GIF89a", 6 },
+        { "pdf",    "%PDF-", 5 },
+        { "zip",    "PK\x03\x04", 4 },
+        { "rar",    "Rar!\x1a\x07", 6 },
+        { "7z",     "7z\xbc\xaf\x27\x1c", 6 },
+        { "ole",    "\xd0\xcf\x11\xe0\xa1\xb1\x1a\xe1", 8 },
+        { "sqlite", "SQLite format 3\0", 16 },
+        { "evtx",   "ElfFile\0", 8 },
+        { "pst",    "!BDN", 4 },
+    };
+
+    int HexDigit(char c)
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+}
+
+//=============================================================================
+Carver::Carver(ntfs::Ntfs & ntfs)
+: _ntfs(ntfs), _clusterSize((u32)ntfs.GetBytesPerSector() * ntfs.GetSectorsPerCluster()),
+  _bytesScanned(0)
+{
+}
+
+void Carver::AddSignature(std::string const & name, std::string const & bytes)
+{
+    _matcher.Add(bytes);
+    _names.push_back(name);
+}
+
+void Carver::AddDefaultSignatures()
+{
+    for (size_t i = 0; i < sizeof(DEFAULT_SIGNATURES) / sizeof(DEFAULT_SIGNATURES[0]); ++i)
+    {
+        DefaultSignature const & s = DEFAULT_SIGNATURES[i];
+        AddSignature(s.name, std::string(s.bytes, s.size));
+    }
+}
+
+void Carver::LoadSignatures(std::istream & is)
+{
+    std::string line;
+    while (std::getline(is, line))
+    {
+        line = line.substr(0, line.find('#'));
+        std::istringstream istr(line);
+        std::string name, hex;
+        if (!(istr >> name))
+            continue;
+        if (!(istr >> hex) || hex.size() % 2 != 0)
+            throw std::runtime_error("Bad signature line: " + line);
+
+        std::string bytes;
+        for (size_t i = 0; i < hex.size(); i += 2)
+        {
+            int hi = HexDigit(hex[i]);
+            int lo = HexDigit(hex[i + 1]);
+            if (hi < 0 || lo < 0)
+                throw std::runtime_error("Bad signature line: " + line);
+            bytes.push_back((char)(hi * 16 + lo));
+        }
+        AddSignature(name, bytes);
+    }
+}
+
+void Carver::Run(ThreadPool & pool)
+{
+    if (_names.empty())
+        throw std::runtime_error("No signatures to carve for.");
+    _matcher.Build();
+    _hits.clear();
+    _bytesScanned = 0;
+    CollectBatches();
+
+    Start(pool, _batches.size());
+    Wait();
+    std::sort(_hits.begin(), _hits.end());
+}
+
+void Carver::Write(std::ostream & os) const
+{
+    for (size_t i = 0; i < _hits.size(); ++i)
+    {
+        Hit const & h = _hits[i];
+        os << h.offset / _clusterSize << '\t' << h.offset % _clusterSize << '\t'
+            << h.offset << '\t' << _names[h.signature] << '\n';
+    }
+    os.flush();
+}
+
+//=============================================================================
+void Carver::CollectBatches()
+{
+    TraceSpan span("collect free clusters", "carve");
+    std::vector<u8> bitmap;
+    u64 clusters = ReadClusterBitmap(_ntfs, bitmap);
+    u64 batchClusters = std::max<u64>(1, BATCH_SIZE / _clusterSize);
+    u64 extra = (_matcher.MaxLength() + _clusterSize - 2) / _clusterSize;    // for MaxLength() - 1 bytes
+
+    _batches.clear();
+    u64 c = 0;
+    while (c < clusters)
+    {
+        // next free run
+        u64 end = ClusterRunEnd(bitmap, c, clusters);
+        if (IsClusterInUse(bitmap, c))
+        {
+            c = end;
+            continue;
+        }
+
+        // cut at multiples of the batch size
+        for (u64 lcn = c; lcn < end; )
+        {
+            u64 batchEnd = std::min(end, (lcn / batchClusters + 1) * batchClusters);
+            Batch b;
+            b.lcn = lcn;
+            b.count = (u32)(batchEnd - lcn);
+            b.extra = (u32)std::min(extra, end - batchEnd);
+            _batches.push_back(b);
+            lcn = batchEnd;
+        }
+        c = end;
+    }
+}
+
+void Carver::Scan(Batch const & batch, std::vector<u8> & buf, PatternMatcher::HITS & found, std::vector<Hit> & hits)
+{
+    TraceSpan span("carve batch", "carve", batch.lcn);
+    u64 clusters = batch.count + batch.extra;
+    buf.resize((size_t)(clusters * _clusterSize));
+    _ntfs.ReadLCN(batch.lcn, (u32)clusters, &buf[0]);
+
+    // hits starting in the extra clusters are the next batch's
+    found.clear();
+    _matcher.Scan(&buf[0], buf.size(), found);
+    u64 limit = (u64)batch.count * _clusterSize;
+    for (size_t i = 0; i < found.size(); ++i)
+    {
+        if (found[i].first >= limit)
+            continue;
+        Hit h;
+        h.offset = batch.lcn * _clusterSize + found[i].first;
+        h.signature = found[i].second;
+        hits.push_back(h);
+    }
+}
+
+void Carver::Work()
+{
+    // own buffer & hits, the matcher & batches are only read
+    std::vector<u8> buf;
+    PatternMatcher::HITS found;
+    std::vector<Hit> hits;
+    u64 bytes = 0;
+    size_t batch;
+    while (Take(batch))
+    {
+        Scan(_batches[batch], buf, found, hits);
+        bytes += (u64)_batches[batch].count * _clusterSize;
+    }
+
+    ScopedLock lock(_lock);
+    _hits.insert(_hits.end(), hits.begin(), hits.end());
+    _bytesScanned += bytes;
+}
@@ -0,0 +1,89 @@
+//
+// NTFS Carver
+// Scans the free clusters of a volume for known file signatures,
+// e.g. headers of files deleted since.
+//
+// Free cluster ranges come from $Bitmap, cut into batches aligned
+// to the batch size in LCNs, which the pool threads read in one go
+// each and run through a single Aho-Corasick matcher for all the
+// signatures. A batch reads past its end as far as the longest
+// signature, while the free range goes on, so no hit across two
+// batches is missed.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __NTFS_CARVE_H
+#define __NTFS_CARVE_H
+
+#include "types.h"
+#include "ntfs.h"
+#include "thread.h"
+#include "matcher.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace ntfs
+{
+    class Carver : private WorkQueue
+    {
+    public:
+        Carver(ntfs::Ntfs & ntfs);
+
+        // signatures must all be added before Run()
+        void AddSignature(std::string const & name, std::string const & bytes);
+        void AddDefaultSignatures();
+
+        // a signature per line, "name hex-bytes", '#' starts a comment
+        void LoadSignatures(std::istream & is);
+
+        void Run(ThreadPool & pool);
+
+        // a line per hit in volume order:
+        // "lcn<TAB>offset in cluster<TAB>offset in volume<TAB>signature"
+        void Write(std::ostream & os) const;
+
+        size_t Count() const { return _hits.size(); }
+        u64 BytesScanned() const { return _bytesScanned; }
+
+    private:
+        struct Batch
+        {
+            u64 lcn;
+            u32 count;
+            u32 extra;      // clusters read after, which the free range goes on to
+        };
+
+        struct Hit
+        {
+            u64 offset;     // in volume
+            u32 signature;
+            bool operator < (Hit const & other) const
+            {
+                return offset < other.offset || (offset == other.offset && signature < other.signature);
+            }
+        };
+
+        Carver & operator = (Carver const &);   // not assignable
+        void CollectBatches();
+        void Scan(Batch const & batch, std::vector<u8> & buf, PatternMatcher::HITS & found, std::vector<Hit> & hits);
+        void Work();    // per pool thread, scans batches
+
+        ntfs::Ntfs & _ntfs;
+        u32 _clusterSize;
+        std::vector<std::string> _names;
+        PatternMatcher _matcher;
+        std::vector<Hit> _hits;
+        u64 _bytesScanned;
+
+        // shared by the workers, _hits & _bytesScanned guarded by _lock while they run
+        std::vector<Batch> _batches;
+        Mutex _lock;
+    };
+}
+
+#endif // __NTFS_CARVE_H
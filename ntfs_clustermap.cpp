@@ -0,0 +1,123 @@
+//
+// NTFS Cluster Map
+// Reverse of the data runs: which file stream, and where in it,
+// owns a given LCN.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "ntfs_clustermap.h"
+
+#include <algorithm>
+
+using namespace ntfs;
+
+//=============================================================================
+void ClusterMap::Build(NodeStore const & store)
+{
+    _extents.clear();
+    _maxEnd.clear();
+    _leaves = 0;
+    for (u32 i = 0; i < store.Size(); ++i)
+    {
+        NodeRecord const & n = store[i];
+        for (u32 k = n.firstStream; k < n.firstStream + n.streamCount; ++k)
+        {
+            StreamRecord const & s = store.GetStream(k);
+            if (!s.nonResident)
+                continue;
+            RunRecord const * r = store.RunsBegin(s);
+            u64 vcn = s.location;
+            for (u32 j = 0; j < s.runCount; vcn += r[j].count, ++j)
+            {
+                if (r[j].lcn == 0 || r[j].count == 0)
+                    continue;   // sparse
+                Extent e;
+                e.lcn = r[j].lcn;
+                e.count = r[j].count;
+                e.vcn = vcn;
+                e.node = i;
+                e.stream = k;
+                _extents.push_back(e);
+            }
+        }
+    }
+    std::stable_sort(_extents.begin(), _extents.end());
+
+    if (_extents.empty())
+        return;
+
+    // leaves bottom row, each parent the max of its two children
+    size_t blocks = (_extents.size() + BLOCK - 1) / BLOCK;
+    for (_leaves = 1; _leaves < blocks; _leaves <<= 1)
+        ;
+    _maxEnd.assign(2 * _leaves - 1, 0);
+    for (size_t i = 0; i < _extents.size(); ++i)
+    {
+        u64 & m = _maxEnd[_leaves - 1 + i / BLOCK];
+        m = std::max(m, _extents[i].lcn + _extents[i].count);
+    }
+    for (size_t i = _leaves - 1; i-- > 0; )
+        _maxEnd[i] = std::max(_maxEnd[2 * i + 1], _maxEnd[2 * i + 2]);
+}
+
+void ClusterMap::Find(u64 lcn, u64 count, HITS & hits, u32 query) const
+{
+    if (_extents.empty() || count == 0)
+        return;
+
+    // only extents starting before the range's end can reach into it
+    Extent e;
+    e.lcn = lcn + count;
+    size_t limit = std::lower_bound(_extents.begin(), _extents.end(), e) - _extents.begin();
+    if (limit > 0)
+        Collect(0, 0, _leaves, limit, lcn, count, hits, query);
+}
+
+void ClusterMap::Find(RANGES const & ranges, HITS & hits) const
+{
+    for (u32 i = 0; i < ranges.size(); ++i)
+        Find(ranges[i].first, ranges[i].second, hits, i);
+}
+
+u64 ClusterMap::MemoryUsage() const
+{
+    return _extents.capacity() * sizeof(Extent) + _maxEnd.capacity() * sizeof(u64);
+}
+
+//=============================================================================
+void ClusterMap::Collect(size_t node, size_t first, size_t last, size_t limit,
+                         u64 lcn, u64 count, HITS & hits, u32 query) const
+{
+    // node covers blocks [first, last), none of whose extents may end past lcn
+    if (first * BLOCK >= limit || _maxEnd[node] <= lcn)
+        return;
+    if (last - first > 1)
+    {
+        size_t mid = (first + last) / 2;
+        Collect(2 * node + 1, first, mid, limit, lcn, count, hits, query);
+        Collect(2 * node + 2, mid, last, limit, lcn, count, hits, query);
+        return;
+    }
+
+    u64 end = lcn + count;
+    size_t stop = std::min(limit, (first + 1) * BLOCK);
+    for (size_t i = first * BLOCK; i < stop; ++i)
+    {
+        Extent const & e = _extents[i];
+        u64 eEnd = e.lcn + e.count;
+        if (eEnd <= lcn)
+            continue;
+        u64 start = std::max(lcn, e.lcn);
+        Hit h;
+        h.query = query;
+        h.node = e.node;
+        h.stream = e.stream;
+        h.lcn = start;
+        h.count = std::min(end, eEnd) - start;
+        h.vcn = e.vcn + (start - e.lcn);
+        hits.push_back(h);
+    }
+}
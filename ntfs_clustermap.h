@@ -0,0 +1,78 @@
+//
+// NTFS Cluster Map
+// Reverse of the data runs: which file stream, and where in it,
+// owns a given LCN. Every run of every $DATA stream of a store is
+// kept as one extent, sorted by LCN, under a tree holding the
+// furthest end of the extents below each of its nodes. A cluster or
+// a range of them is looked up in O((k + 1) log n) for the k extents
+// found, however long the extents are or however much they overlap
+// (cross-linked clusters on a damaged volume).
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __NTFS_CLUSTERMAP_H
+#define __NTFS_CLUSTERMAP_H
+
+#include "types.h"
+#include "ntfs_store.h"
+
+#include <vector>
+
+namespace ntfs
+{
+    class ClusterMap
+    {
+    public:
+        // clusters of a stream found in a range, clipped to it
+        struct Hit
+        {
+            u32 query;      // index of the range in the batch
+            u32 node;       // node index in store
+            u32 stream;     // stream index in store
+            u64 lcn;
+            u64 count;
+            u64 vcn;        // of lcn in the stream
+        };
+        typedef std::vector<std::pair<u64, u64> > RANGES;   // lcn, count
+        typedef std::vector<Hit> HITS;
+
+        ClusterMap() : _leaves(0) { }
+        explicit ClusterMap(NodeStore const & store) : _leaves(0) { Build(store); }
+        void Build(NodeStore const & store);
+
+        // owners of range appended to hits, by lcn
+        void Find(u64 lcn, u64 count, HITS & hits, u32 query = 0) const;
+
+        // owners of every range, by range then lcn
+        void Find(RANGES const & ranges, HITS & hits) const;
+
+        u64 Size() const { return _extents.size(); }
+        u64 MemoryUsage() const;
+
+    private:
+        struct Extent
+        {
+            u64 lcn;
+            u64 count;
+            u64 vcn;
+            u32 node;
+            u32 stream;
+
+            bool operator < (Extent const & other) const { return lcn < other.lcn; }
+        };
+
+        static size_t const BLOCK = 16;     // extents under a leaf of the tree
+
+        void Collect(size_t node, size_t first, size_t last, size_t limit,
+                     u64 lcn, u64 count, HITS & hits, u32 query) const;
+
+        std::vector<Extent> _extents;   // by lcn
+        std::vector<u64> _maxEnd;       // implicit tree, node i has 2i+1 & 2i+2, leaves are blocks
+        size_t _leaves;                 // power of 2
+    };
+}
+
+#endif // __NTFS_CLUSTERMAP_H
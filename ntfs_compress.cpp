@@ -12,6 +12,8 @@
 //
 
 #include "ntfs_compress.h"
+#include "stats.h"
+#include "trace.h"
 
 namespace
 {
@@ -29,6 +31,65 @@ namespace
         NTFS_SB_SIZE        =   0x1000,     // maximum (NTFS constant) block size = 4096
         NTFS_SB_IS_COMPRESSED   =   0x8000,
     };
+
+    // back reference dynamic size reasoning:
+    // given the block size is fixed maximum @ 4096, back ref might need 12 bit,
+    // which left 4 bit for length - allowing maximum length of 19.
+    //
+    // the wastage here is if destination offset is currently @ 123, there's no way
+    // the back ref can be -400 (you can't back ref beyond the big bang).
+    //
+    // the trick here is we can dynamically allocate the correct number of bit
+    // for back ref to make way for more length bit, based on the destination offset.
+    //
+    // the split only changes at powers of 2, so it is tabled once per
+    // destination offset within the sub block, rather than recomputed per token.
+    struct BackRefSplit
+    {
+        u8 lengthShift[NTFS_SB_SIZE];   // bits eaten away from 12bit length for back ref
+        BackRefSplit()
+        {
+            lengthShift[0] = 0;     // back ref as 1st token is invalid anyway
+            for (unsigned offset = 1; offset < NTFS_SB_SIZE; ++offset)
+            {
+                u8 bits = 0;
+                for (unsigned i = offset - 1; i >= 0x10; i >>= 1)  // remember offset is 1 subtracted
+                    ++bits;
+                lengthShift[offset] = bits;
+            }
+        }
+    };
+    BackRefSplit const s_split;
+
+    // copies a back reference of given length & distance.
+    // non-overlapping (or far enough) references are copied 16 or 8 bytes at a time,
+    // which might spill up to 15 bytes after the reference, still within the sub block:
+    // those are either overwritten by the following tokens or zeroed at the sub block end.
+    inline void copy_backref(u8 * dest, u8 const * from, u32 length, u32 distance, u8 const * destSubEnd)
+    {
+        if (distance >= 16 && dest + ((length + 15) & ~15) <= destSubEnd)
+        {
+            // each 16 byte chunk reads only bytes before its own destination
+            for (u32 i = 0; i < length; i += 16)
+                memcpy(dest + i, from + i, 16);
+        }
+        else if (distance >= 8 && dest + ((length + 7) & ~7) <= destSubEnd)
+        {
+            for (u32 i = 0; i < length; i += 8)
+                memcpy(dest + i, from + i, 8);
+        }
+        else if (distance == 1)
+        {
+            // run of a single byte
+            memset(dest, *from, length);
+        }
+        else
+        {
+            // overlapped copy - byte by byte propagates the repeating pattern
+            while (length--)
+                *dest++ = *from++;
+        }
+    }
 }
 
 
@@ -38,25 +99,31 @@ namespace
 // exception is thrown if otherwise - no false returns.
 bool ntfs::decompress(u8 * dest, u32 const destSize, u8 const * src, u32 const srcSize)
 {
+    StatScope stat(eStatDecompress);
+    stat.SetBytes(destSize);
+    TraceSpan span("decompress", "ntfs", srcSize);
+
     // main buffer limits
     u8 const * srcEnd = src + srcSize;
     u8 * destEnd = dest + destSize;
 
     // sub block limits
-    u8 const * srcSub = 0;
     u8 const * srcSubEnd = 0;
     u8 * destSub = 0;
     u8 * destSubEnd = 0;
 
     // processing
     u8 const * pos = src;
-    u8 tag;
-    int token;
 
     // continue processing while we are within buffer range
     // and the header is still non-zero
-    while (pos < srcEnd && dest < destEnd && get_u16(pos))
+    while (pos < srcEnd && dest < destEnd)
     {
+        // a lone trailing byte can't be a full header, only a zero one ends cleanly
+        u16 header = (pos + 1 < srcEnd) ? get_u16(pos) : *pos;
+        if (!header)
+            break;
+
         // initialize pointer for each new subblock processing
         // ** each subblock should be a logical unit of LZ77
         destSub = dest;
@@ -71,8 +138,6 @@ bool ntfs::decompress(u8 * dest, u32 const destSize, u8 const * src, u32 const s
         if (pos + 6 > srcEnd)
             throw std::runtime_error("Insufficient compress data.");
 
-        // initialize pointer for each new source sub block
-
         // From NTFS Document - by Richard Russon & Yuval Fledel
         // each block is preceeded by a 2-byte header:
         //      lower 12 bit is the length
@@ -85,19 +150,16 @@ bool ntfs::decompress(u8 * dest, u32 const destSize, u8 const * src, u32 const s
         //           = total size - 0x3
         //           = (0x500 + 0x2) - 0x3
         //           = 0x4ff
-        srcSub = pos;
-        srcSubEnd = srcSub + (get_u16(pos) & NTFS_SB_SIZE_MASK) + 3;
+        srcSubEnd = pos + (header & NTFS_SB_SIZE_MASK) + 3;
         if (srcSubEnd > srcEnd)
             throw std::runtime_error("Sub-block beyond compress data.");
 
-        // process the current sub block
+        // skip the 2 byte header
+        pos += 2;
 
-        if (!(get_u16(pos) & NTFS_SB_IS_COMPRESSED))
+        if (!(header & NTFS_SB_IS_COMPRESSED))
         {
             // sub block is not compress
-            // skip the 2 byte header
-            pos += 2;
-
             // insist the uncompress sub block is in full size?
             if (srcSubEnd - pos != NTFS_SB_SIZE)
                 throw std::runtime_error("Uncompressed sub-block must be full size.");
@@ -114,16 +176,9 @@ bool ntfs::decompress(u8 * dest, u32 const destSize, u8 const * src, u32 const s
 
         // if we reach here, means sub block is compressed
 
-        // skip the 2 byte header
-        pos += 2;
-
         // process the tag
         while (pos < srcSubEnd)
         {
-            // check if we are still in range
-            if (pos > srcSubEnd || dest > destSubEnd)
-                throw std::runtime_error("Sub-block out of range.");
-
             // the tag byte is a 8 bit flag, each bit denoting whether the
             // subsequent chunk is:
             //      - zero if uncompressed (raw 1 byte) or,
@@ -133,21 +188,26 @@ bool ntfs::decompress(u8 * dest, u32 const destSize, u8 const * src, u32 const s
             //          [bref1,len1][a][b][bref2,len2][c][d][e][f]
             // 2. a tag of 0b00000000 means the following stream are:
             //          [a][b][c][d][e][f][g][h]
+            u8 tag = *pos++;
 
-            // get the tag byte
-            tag = *pos++;
+            // fast path: 8 raw bytes fully within both sub blocks
+            if (tag == 0 && pos + 8 <= srcSubEnd && dest + 8 <= destSubEnd)
+            {
+                memcpy(dest, pos, 8);
+                dest += 8;
+                pos += 8;
+                continue;
+            }
 
             // process each token denoted by the 8bit tag flag
-            for (token = 0; token < 8; ++token, tag >>= 1)
+            for (int token = 0; token < 8 && pos < srcSubEnd; ++token, tag >>= 1)
             {
-                // are we done yet or still in range?
-                if (pos >= srcSubEnd || dest > destSubEnd)
-                   break;
-
                 if ((tag & 0x1) == 0x0)
                 {
                     // token is uncompressed so we just plain copy
                     // and continue next token
+                    if (dest >= destSubEnd)
+                        throw std::runtime_error("Sub-block out of range.");
                     *dest++ = *pos++;
                     continue;
                 }
@@ -157,7 +217,8 @@ bool ntfs::decompress(u8 * dest, u32 const destSize, u8 const * src, u32 const s
                 // how can it refer back if it is the first?
                 if (dest == destSub)
                      throw std::runtime_error("Back ref token must not be the first.");
-
+                if (pos + 2 > srcEnd)
+                    throw std::runtime_error("Insufficient compress data.");
 
                 // if we reach here, means the token is back reference
 
@@ -174,34 +235,20 @@ bool ntfs::decompress(u8 * dest, u32 const destSize, u8 const * src, u32 const s
                 //
                 // With all this savings, the compressed form become:
                 //      "#include <ntfs.h>[17,7]stdio[16,1]"
-
-                // back reference dynamic size reasoning:
-                // given the block size is fixed maximum @ 4096, back ref might need 12 bit,
-                // which left 4 bit for length - allowing maximum length of 19.
-                //
-                // the wastage here is if destination offset is currently @ 123, there's no way
-                // the back ref can be -400 (you can't back ref beyond the big bang).
-                //
-                // the trick here is we can dynamically allocate the correct number of bit
-                // for back ref to make way for more length bit, based on the destination offset.
-
-                unsigned maxLengthBit = 0;
-                for (unsigned i = dest - destSub - 1; // remember offset is 1 subtracted
-                        i >= 0x10;  // remember 12bit max for backref or length, 4bit is the min
-                        i >>= 1)
-                    ++maxLengthBit;
+                u32 offset = (u32)(dest - destSub);
+                u32 lengthBits = (offset < NTFS_SB_SIZE) ? s_split.lengthShift[offset] : 8;
 
                 // get back ref token
                 u16 backRefToken = get_u16(pos);
                 pos += 2;
 
                 // calculate back ref offset, by eating away length bits
-                u8 * destBackRef = dest - (backRefToken >> (12 - maxLengthBit)) - 1;
-                if (destBackRef < destSub)
+                u32 distance = (backRefToken >> (12 - lengthBits)) + 1;
+                if (distance > offset)
                     throw std::runtime_error("Refer too far back.");
 
                 // get the length
-                u16 length = (backRefToken & (0xfff >> maxLengthBit)) + 3;
+                u32 length = (backRefToken & (0xfff >> lengthBits)) + 3;
 
                 // verify that we don't go beyond the buffer
                 if (dest + length > destSubEnd)
@@ -209,8 +256,8 @@ bool ntfs::decompress(u8 * dest, u32 const destSize, u8 const * src, u32 const s
 
                 // now copy the back ref to current destination
                 // it is also possible to have overlapped copy
-                while (length--)
-                    *dest++ = *destBackRef++;
+                copy_backref(dest, dest - distance, length, distance, destSubEnd);
+                dest += length;
 
             } // for each token or for each tag bit
         } // while we haven't finish the sub block, continue next tag
@@ -218,9 +265,8 @@ bool ntfs::decompress(u8 * dest, u32 const destSize, u8 const * src, u32 const s
         // if destination sub block not full length
         if (dest < destSubEnd)
         {
-            int zerobytes = destSubEnd - dest;
-            memset(dest, 0, zerobytes);
-            dest += zerobytes;
+            memset(dest, 0, destSubEnd - dest);
+            dest = destSubEnd;
         }
 
     } // next sub block
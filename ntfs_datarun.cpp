@@ -144,6 +144,14 @@ void DataRun::Append(u8 * buf, u32 size, u64 startVcn)
 
 // returns 0 if Vcn lands on a sparse cluster
 u64 DataRun::Vcn2Lcn(u64 x)
+{
+    u64 contiguous;
+    return Vcn2Lcn(x, contiguous);
+}
+
+// same as above, but also returns the number of clusters (including x)
+// that follow contiguously on disk (or stay sparse) within the same run
+u64 DataRun::Vcn2Lcn(u64 x, u64 & contiguous)
 {
     if (_list.empty())
         throw std::runtime_error("Vcn2Lcn can't operate on empty DataRun.");
@@ -163,6 +171,7 @@ u64 DataRun::Vcn2Lcn(u64 x)
     if (i == _list.size())
         throw std::runtime_error("Vcn2Lcn can't find correct cluster number.");
 
+    contiguous = _list[i].count - vcn;
     return (_list[i].offset == 0) ? 0 : (vcn + _list[i].cumulativeOffset);
 }
 
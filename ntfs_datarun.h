@@ -43,6 +43,7 @@ namespace ntfs
         void Init(u8 * buf, u32 size, u64 baseVcn);
         void Append(u8 * buf, u32 size, u64 startVcn);
         u64 Vcn2Lcn(u64 x);
+        u64 Vcn2Lcn(u64 x, u64 & contiguous);
 
     public:
         u64  _baseVcn;
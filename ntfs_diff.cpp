@@ -0,0 +1,226 @@
+//
+// NTFS Tree Diff
+// Files created, deleted, renamed, resized or modified between two
+// trees of the same volume.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "ntfs_diff.h"
+#include "pathname.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace ntfs;
+
+namespace
+{
+    struct ChangeName
+    {
+        u32 flag;
+        char const * name;
+    };
+    ChangeName const CHANGE_NAMES[] =
+    {
+        { eChangeCreated, "created" },
+        { eChangeDeleted, "deleted" },
+        { eChangeRenamed, "renamed" },
+        { eChangeResized, "resized" },
+        { eChangeModified, "modified" },
+    };
+}
+
+//=============================================================================
+TreeDiff::TreeDiff(ntfs::Tree & older, ntfs::Tree & newer)
+: _older(older.GetStore()), _newer(newer.GetStore()), _compared(0)
+{
+    if (older.IsLazy() || newer.IsLazy())
+        throw std::runtime_error("Diff needs whole trees.");
+}
+
+void TreeDiff::Restrict(std::vector<bool> const & records)
+{
+    _records = records;
+}
+
+void TreeDiff::Run()
+{
+    TraceSpan span("diff trees", "tree");
+    _changes.clear();
+    _compared = 0;
+    if (!_records.empty())
+    {
+        // records nobody wrote to are the same in both, only the others are looked up
+        for (u64 i = 0; i < _records.size(); ++i)
+        {
+            if (_records[(size_t)i])
+                Compare(i, _older.Find(i), _newer.Find(i));
+        }
+        // older nodes past the newer MFT's end are gone
+        u32 o = _older.Size();
+        while (o > 0 && _older[o - 1].mftRef >= _records.size())
+            --o;
+        for (; o < _older.Size(); ++o)
+            Compare(_older[o].mftRef, o, NodeStore::NPOS);
+        return;
+    }
+
+    // both stores are in MFT order
+    u32 o = 0, n = 0;
+    while (o < _older.Size() || n < _newer.Size())
+    {
+        if (n == _newer.Size() || (o < _older.Size() && _older[o].mftRef < _newer[n].mftRef))
+        {
+            Compare(_older[o].mftRef, o, NodeStore::NPOS);
+            ++o;
+        }
+        else if (o == _older.Size() || _newer[n].mftRef < _older[o].mftRef)
+        {
+            Compare(_newer[n].mftRef, NodeStore::NPOS, n);
+            ++n;
+        }
+        else
+        {
+            Compare(_older[o].mftRef, o, n);
+            ++o;
+            ++n;
+        }
+    }
+}
+
+void TreeDiff::Write(std::ostream & os) const
+{
+    for (size_t i = 0; i < _changes.size(); ++i)
+    {
+        Change const & c = _changes[i];
+        bool first = true;
+        for (size_t k = 0; k < sizeof(CHANGE_NAMES) / sizeof(CHANGE_NAMES[0]); ++k)
+        {
+            if (!(c.flags & CHANGE_NAMES[k].flag))
+                continue;
+            if (!first)
+                os << ',';
+            os << CHANGE_NAMES[k].name;
+            first = false;
+        }
+        os << '\t' << c.mftRef << '\t';
+        if (c.older != NodeStore::NPOS)
+            os << Size(_older, c.older);
+        else
+            os << '-';
+        os << '\t';
+        if (c.newer != NodeStore::NPOS)
+            os << Size(_newer, c.newer) << '\t' << Path(_newer, c.newer);
+        else
+            os << "-\t" << Path(_older, c.older);
+        if (c.flags & eChangeRenamed)
+            os << '\t' << Path(_older, c.older);
+        os << '\n';
+    }
+    os.flush();
+}
+
+//=============================================================================
+void TreeDiff::Compare(u64 mftRef, u32 older, u32 newer)
+{
+    if (older == NodeStore::NPOS && newer == NodeStore::NPOS)
+        return;     // not in use in either
+    if (newer == NodeStore::NPOS)
+    {
+        Add(mftRef, eChangeDeleted, older, newer);
+        return;
+    }
+    if (older == NodeStore::NPOS)
+    {
+        Add(mftRef, eChangeCreated, older, newer);
+        return;
+    }
+
+    NodeRecord const & o = _older[older];
+    NodeRecord const & n = _newer[newer];
+    if (o.sequence != n.sequence)
+    {
+        // record freed and reused by another file
+        Add(mftRef, eChangeDeleted, older, NodeStore::NPOS);
+        Add(mftRef, eChangeCreated, NodeStore::NPOS, newer);
+        return;
+    }
+    if (o.recordHash == n.recordHash)
+        return;
+
+    ++_compared;
+    u32 flags = 0;
+    if (o.parentRef != n.parentRef || !SameName(o, n))
+        flags |= eChangeRenamed;
+    bool resized = false;
+    bool sameStreams = SameStreams(o, n, resized);
+    if (resized)
+        flags |= eChangeResized;
+    if (flags == 0 || !sameStreams || o.attr != n.attr)
+        flags |= eChangeModified;
+    Add(mftRef, flags, older, newer);
+}
+
+void TreeDiff::Add(u64 mftRef, u32 flags, u32 older, u32 newer)
+{
+    Change c;
+    c.mftRef = mftRef;
+    c.flags = flags;
+    c.older = older;
+    c.newer = newer;
+    _changes.push_back(c);
+}
+
+u64 TreeDiff::Size(ntfs::NodeStore const & store, u32 node) const
+{
+    NodeRecord const & n = store[node];
+    u64 size = 0;
+    for (u32 k = n.firstStream; k < n.firstStream + n.streamCount; ++k)
+        size += store.GetStream(k).realSize;
+    return size;
+}
+
+bool TreeDiff::SameName(ntfs::NodeRecord const & o, ntfs::NodeRecord const & n) const
+{
+    return o.nameLen == n.nameLen
+        && std::equal(_older.Name(o.name), _older.Name(o.name) + o.nameLen, _newer.Name(n.name));
+}
+
+bool TreeDiff::SameStreams(ntfs::NodeRecord const & o, ntfs::NodeRecord const & n, bool & resized) const
+{
+    // streams are in name order in both
+    resized = o.streamCount != n.streamCount;
+    bool same = !resized;
+    for (u32 k = 0; k < o.streamCount && k < n.streamCount; ++k)
+    {
+        StreamRecord const & so = _older.GetStream(o.firstStream + k);
+        StreamRecord const & sn = _newer.GetStream(n.firstStream + k);
+        if (so.nameLen != sn.nameLen
+            || !std::equal(_older.Name(so.name), _older.Name(so.name) + so.nameLen, _newer.Name(sn.name)))
+        {
+            resized = true;
+            return false;
+        }
+        if (so.realSize != sn.realSize)
+            resized = true;
+        if (so.realSize != sn.realSize || so.nonResident != sn.nonResident || so.runCount != sn.runCount)
+        {
+            same = false;
+            continue;
+        }
+        RunRecord const * ro = _older.RunsBegin(so);
+        RunRecord const * rn = _newer.RunsBegin(sn);
+        for (u32 r = 0; r < so.runCount && same; ++r)
+            same = ro[r].lcn == rn[r].lcn && ro[r].count == rn[r].count;
+    }
+    return same;
+}
+
+std::string TreeDiff::Path(ntfs::NodeStore const & store, u32 node) const
+{
+    return ToUtf8(store.Path(node));
+}
@@ -0,0 +1,79 @@
+//
+// NTFS Tree Diff
+// Files created, deleted, renamed, resized or modified between two
+// trees of the same volume, e.g. in an image and one of its parents.
+//
+// Nodes are matched by MFT index & record sequence number, a reused
+// record being a delete and a create. Records whose bytes hash the
+// same are skipped without looking further; and the comparison can
+// be restricted to the records that can differ at all, those held
+// in grains of the layers between the two images.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __NTFS_DIFF_H
+#define __NTFS_DIFF_H
+
+#include "ntfs_tree.h"
+
+#include <iostream>
+#include <vector>
+
+namespace ntfs
+{
+    enum ChangeFlags
+    {
+        eChangeCreated  = 0x01,
+        eChangeDeleted  = 0x02,
+        eChangeRenamed  = 0x04,     // name or parent folder
+        eChangeResized  = 0x08,     // size of a stream, or streams added or removed
+        eChangeModified = 0x10,     // anything else in the record: times, attributes, runs
+    };
+
+    class TreeDiff
+    {
+    public:
+        struct Change
+        {
+            u64 mftRef;
+            u32 flags;      // ChangeFlags
+            u32 older;      // node index in older store, NPOS if created
+            u32 newer;      // node index in newer store, NPOS if deleted
+        };
+        typedef std::vector<Change> CHANGES;
+
+        TreeDiff(ntfs::Tree & older, ntfs::Tree & newer);
+
+        // only compares MFT records flagged, as from Tree::FindChangedRecords()
+        void Restrict(std::vector<bool> const & records);
+
+        void Run();
+
+        // one change per line, in MFT order:
+        // changes, MFT index, older size, newer size, path[, older path if renamed]
+        void Write(std::ostream & os) const;
+
+        CHANGES const & Changes() const { return _changes; }
+        u64 Compared() const { return _compared; }     // records whose hashes differ
+
+    private:
+        TreeDiff & operator = (TreeDiff const &);
+        void Compare(u64 mftRef, u32 older, u32 newer);
+        void Add(u64 mftRef, u32 flags, u32 older, u32 newer);
+        u64 Size(ntfs::NodeStore const & store, u32 node) const;
+        bool SameName(ntfs::NodeRecord const & o, ntfs::NodeRecord const & n) const;
+        bool SameStreams(ntfs::NodeRecord const & o, ntfs::NodeRecord const & n, bool & resized) const;
+        std::string Path(ntfs::NodeStore const & store, u32 node) const;
+
+        ntfs::NodeStore const & _older;
+        ntfs::NodeStore const & _newer;
+        std::vector<bool> _records;     // empty if not restricted
+        CHANGES _changes;
+        u64 _compared;
+    };
+}
+
+#endif // __NTFS_DIFF_H
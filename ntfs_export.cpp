@@ -0,0 +1,138 @@
+//
+// NTFS Aware Image Export
+// Writes a disk out as a flat raw image, leaving free clusters
+// of NTFS volumes as holes.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "ntfs_export.h"
+#include "ntfs_file.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace ntfs;
+
+namespace
+{
+    u32 const COPY_SECTORS = 2048;      // 1MB per read & write
+    u8 const NTFS_PARTITION_TYPE = 0x7;
+
+    bool IsZero(u8 const * p, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i)
+            if (p[i])
+                return false;
+        return true;
+    }
+}
+
+//=============================================================================
+ImageExporter::ImageExporter(disk::Vmdk & vmdisk)
+: _vmdisk(vmdisk), _buf(COPY_SECTORS * SECTOR_SIZE), _written(0), _free(0), _zero(0), _end(0)
+{
+}
+
+void ImageExporter::Run(std::ostream & os)
+{
+    _written = _free = _zero = _end = 0;
+    LoadVolumes();
+
+    // whatever lies between the volumes' cluster areas goes as is
+    u64 sectors = _vmdisk.GetSectors();
+    u64 pos = 0;
+    for (size_t i = 0; i < _volumes.size(); ++i)
+    {
+        Volume const & v = _volumes[i];
+        if (v.first < pos || v.first + v.clusters * v.sectorsPerCluster > sectors)
+            throw std::runtime_error("NTFS volumes overlap or are past the disk end.");
+        Copy(os, pos, v.first - pos);
+        CopyVolume(os, v);
+        pos = v.first + v.clusters * v.sectorsPerCluster;
+    }
+    Copy(os, pos, sectors - pos);
+
+    // a hole at the end still counts to the size
+    if (_end < sectors * SECTOR_SIZE)
+    {
+        os.seekp(sectors * SECTOR_SIZE - 1);
+        os.put(0);
+    }
+    os.flush();
+    if (!os)
+        throw std::runtime_error("Can't write exported image.");
+}
+
+//=============================================================================
+void ImageExporter::LoadVolumes()
+{
+    TraceSpan span("load bitmaps", "export");
+    _volumes.clear();
+    unsigned part = 0;
+    disk::Partitions::iterator it = _vmdisk.BeginPartition();
+    for (; it != _vmdisk.EndPartition(); ++it, ++part)
+    {
+        if (it->type != NTFS_PARTITION_TYPE)
+            continue;
+
+        ntfs::Ntfs ntfsdisk(_vmdisk, part);
+        u32 clusterSize = (u32)ntfsdisk.GetBytesPerSector() * ntfsdisk.GetSectorsPerCluster();
+        if (clusterSize == 0 || clusterSize % SECTOR_SIZE != 0)
+            throw std::runtime_error("NTFS cluster size is not in whole sectors.");
+
+        Volume v;
+        v.first = it->firstSectorLBA;
+        v.sectorsPerCluster = clusterSize / SECTOR_SIZE;
+        v.clusters = ReadClusterBitmap(ntfsdisk, v.bitmap);
+        _volumes.push_back(v);
+    }
+    std::sort(_volumes.begin(), _volumes.end());
+}
+
+void ImageExporter::CopyVolume(std::ostream & os, Volume const & v)
+{
+    TraceSpan span("export volume", "export", v.clusters);
+    u64 c = 0;
+    while (c < v.clusters)
+    {
+        // runs of free & in use clusters
+        bool used = IsClusterInUse(v.bitmap, c);
+        u64 end = ClusterRunEnd(v.bitmap, c, v.clusters);
+
+        if (used)
+            Copy(os, v.first + c * v.sectorsPerCluster, (end - c) * v.sectorsPerCluster);
+        else
+            _free += (end - c) * v.sectorsPerCluster * SECTOR_SIZE;
+        c = end;
+    }
+}
+
+void ImageExporter::Copy(std::ostream & os, u64 sector, u64 count)
+{
+    while (count > 0)
+    {
+        u32 n = (u32)std::min<u64>(count, COPY_SECTORS);
+        size_t bytes = (size_t)n * SECTOR_SIZE;
+        if (!_vmdisk.RawSectorN(sector, n, &_buf[0]))
+            throw std::runtime_error("Can't read disk sectors to export.");
+        if (IsZero(&_buf[0], bytes))
+        {
+            _zero += bytes;
+        }
+        else
+        {
+            os.seekp(sector * SECTOR_SIZE);
+            os.write((char const *)&_buf[0], bytes);
+            if (!os)
+                throw std::runtime_error("Can't write exported image.");
+            _written += bytes;
+            _end = (sector + n) * SECTOR_SIZE;
+        }
+        sector += n;
+        count -= n;
+    }
+}
@@ -0,0 +1,65 @@
+//
+// NTFS Aware Image Export
+// Writes a disk out as a flat raw image, where the clusters of NTFS
+// volumes that their $Bitmap marks free are left as holes, as are
+// sectors reading all zeroes. Everything outside the volumes' cluster
+// areas (MBR, EBRs, gaps, boot sector backups, other partitions) is
+// copied as is, so the image boots & mounts like the original.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __NTFS_EXPORT_H
+#define __NTFS_EXPORT_H
+
+#include "vmdk.h"
+#include "ntfs.h"
+
+#include <iostream>
+#include <vector>
+
+namespace ntfs
+{
+    class ImageExporter
+    {
+    public:
+        ImageExporter(disk::Vmdk & vmdisk);
+
+        // os must be a seekable binary stream, whose skipped
+        // parts read as zeroes, e.g. a new file
+        void Run(std::ostream & os);
+
+        u64 BytesWritten() const { return _written; }
+        u64 BytesFree() const { return _free; }     // clusters not in use, not read
+        u64 BytesZero() const { return _zero; }     // read but all zeroes
+
+    private:
+        // cluster area of an NTFS volume, in disk sectors
+        struct Volume
+        {
+            u64 first;
+            u64 clusters;
+            u32 sectorsPerCluster;
+            std::vector<u8> bitmap;     // bit per cluster, set if in use
+
+            bool operator < (Volume const & other) const { return first < other.first; }
+        };
+
+        ImageExporter & operator = (ImageExporter const &);
+        void LoadVolumes();
+        void CopyVolume(std::ostream & os, Volume const & v);
+        void Copy(std::ostream & os, u64 sector, u64 count);
+
+        disk::Vmdk & _vmdisk;
+        std::vector<Volume> _volumes;
+        std::vector<u8> _buf;
+        u64 _written;
+        u64 _free;
+        u64 _zero;
+        u64 _end;       // past the last byte written
+    };
+}
+
+#endif // __NTFS_EXPORT_H
@@ -0,0 +1,487 @@
+//
+// NTFS Extractor
+// Extracts many files at once, as given by paths or wildcard
+// patterns resolved against one ntfs::Tree.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "ntfs_extract.h"
+#include "ntfs_file.h"
+#include "pathname.h"
+#include "utf8.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+using namespace ntfs;
+
+namespace
+{
+    u32 const MAX_BATCH_CLUSTERS = 1024;        // clusters read in one go
+    u32 const MAX_GAP_CLUSTERS = 16;            // cheaper to read through than to seek over
+    u64 const MAX_INFLIGHT = 64 * 1024 * 1024;  // bytes read but not written yet
+    size_t const TAR_BUFFER_SIZE = 1024 * 1024;
+
+    // orders items by their node's MFT record
+    struct ByMftRef
+    {
+        ByMftRef(NodeStore const & store, std::vector<Extractor::Item> const & items) : _store(store), _items(items) { }
+        bool operator () (u32 a, u32 b) const { return _store[_items[a].node].mftRef < _store[_items[b].node].mftRef; }
+        NodeStore const & _store;
+        std::vector<Extractor::Item> const & _items;
+    };
+
+    bool IsWildcard(std::basic_string<u16> const & name)
+    {
+        return name.find('*') != std::basic_string<u16>::npos || name.find('?') != std::basic_string<u16>::npos;
+    }
+}
+
+//=============================================================================
+Extractor::Extractor(ntfs::Ntfs & ntfs, ntfs::Tree & tree, char const * outDir)
+: _ntfs(ntfs), _tree(tree), _store(tree.GetStore()), _outDir(outDir), _inflight(0), _pending(0), _bytesWritten(0)
+{
+    if (tree.IsLazy())
+        throw std::runtime_error("Extraction needs the whole tree.");
+    _clusterSize = _ntfs.GetBytesPerSector() * _ntfs.GetSectorsPerCluster();
+    while (!_outDir.empty() && (*_outDir.rbegin() == '/' || *_outDir.rbegin() == '\\'))
+        _outDir.resize(_outDir.size() - 1);
+}
+
+Extractor::~Extractor()
+{
+}
+
+u32 Extractor::Add(char const * pattern)
+{
+    std::string u8pattern(pattern);
+    if (utf8::find_invalid(u8pattern.begin(), u8pattern.end()) != u8pattern.end())
+        throw std::runtime_error("Invalid utf8 pattern.");
+    std::basic_string<u16> u16pattern;
+    utf8::utf8to16(u8pattern.begin(), u8pattern.end(), std::back_inserter(u16pattern));
+
+    // stream name goes after ':' of the last path name
+    std::basic_string<u16> stream;
+    size_t sep = 0;
+    for (size_t i = 0; i < u16pattern.size(); ++i)
+    {
+        if (u16pattern[i] == '\\' || u16pattern[i] == '/')
+            sep = i;
+    }
+    size_t colon = u16pattern.find(':', sep);
+    if (colon != std::basic_string<u16>::npos)
+    {
+        stream = u16pattern.substr(colon + 1);
+        u16pattern.resize(colon);
+    }
+
+    std::vector<std::basic_string<u16> > names;
+    size_t begin = 0;
+    for (size_t i = 0; i <= u16pattern.size(); ++i)
+    {
+        if (i == u16pattern.size() || u16pattern[i] == '\\' || u16pattern[i] == '/')
+        {
+            if (i > begin)
+                names.push_back(u16pattern.substr(begin, i - begin));
+            begin = i + 1;
+        }
+    }
+
+    u32 added = 0;
+    u32 root = _store.Find(5);
+    if (!names.empty() && root != NodeStore::NPOS)
+        Match(root, names, 0, std::string(), std::string(), stream, added);
+    return added;
+}
+
+void Extractor::Match(u32 folder, std::vector<std::basic_string<u16> > const & names, size_t k,
+    std::string const & path, std::string const & file, std::basic_string<u16> const & stream, u32 & added)
+{
+    std::basic_string<u16> const & name = names[k];
+    bool last = (k + 1 == names.size());
+
+    std::vector<u32> matches;
+    if (!IsWildcard(name))
+    {
+        u32 i = _store.Lookup(folder, name.data(), name.size());
+        if (i != NodeStore::NPOS)
+            matches.push_back(i);
+    }
+    else
+    {
+        NodeRecord const & f = _store[folder];
+        for (u32 const * it = _store.ChildrenBegin(f); it != _store.ChildrenEnd(f); ++it)
+        {
+            NodeRecord const & n = _store[*it];
+            if (Glob(name.data(), name.size(), _store.Name(n.name), n.nameLen))
+                matches.push_back(*it);
+        }
+    }
+
+    // wildcards in the last name match files only, the others folders only
+    for (size_t i = 0; i < matches.size(); ++i)
+    {
+        NodeRecord const & n = _store[matches[i]];
+        if (n.IsDir() == last)
+            continue;
+        std::string childPath(path);
+        childPath.push_back('/');
+        AppendUtf8(childPath, _store.Name(n.name), n.nameLen);
+        std::string childFile(file);
+        childFile.push_back('/');
+        AppendSafeName(childFile, _store.Name(n.name), n.nameLen);
+        if (last)
+            AddStream(matches[i], childPath, childFile, stream, added);
+        else
+            Match(matches[i], names, k + 1, childPath, childFile, stream, added);
+    }
+}
+
+bool Extractor::Glob(u16 const * pattern, u32 plen, u16 const * name, u32 nlen) const
+{
+    // backtracks to the last '*' only, which is enough without character classes
+    u32 i = 0, j = 0;
+    u32 star = NodeStore::NPOS, mark = 0;
+    while (j < nlen)
+    {
+        if (i < plen && (pattern[i] == '?' || _ntfs.UpCase(pattern[i]) == _ntfs.UpCase(name[j])))
+        {
+            ++i;
+            ++j;
+        }
+        else if (i < plen && pattern[i] == '*')
+        {
+            star = i++;
+            mark = j;
+        }
+        else if (star != NodeStore::NPOS)
+        {
+            i = star + 1;
+            j = ++mark;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (i < plen && pattern[i] == '*')
+        ++i;
+    return i == plen;
+}
+
+void Extractor::AddStream(u32 node, std::string const & path, std::string const & file,
+    std::basic_string<u16> const & stream, u32 & added)
+{
+    u32 match = _tree.FindStream(_store, node, stream.data(), stream.size());
+    if (match == NodeStore::NPOS || !_streams.insert(match).second)
+        return;
+
+    Item item;
+    item.node = node;
+    item.stream = match;
+    item.path = path;
+    item.file = file;
+    StreamRecord const & s = _store.GetStream(match);
+    if (s.nameLen > 0)
+    {
+        item.path.push_back(':');
+        AppendUtf8(item.path, _store.Name(s.name), s.nameLen);
+        item.file.push_back(':');
+        AppendSafeName(item.file, _store.Name(s.name), s.nameLen);
+    }
+    _items.push_back(item);
+    ++added;
+}
+
+//=============================================================================
+void Extractor::Run(ThreadPool & pool)
+{
+    std::vector<Extent> extents;
+    std::vector<u32> others;
+    Plan(extents, others);
+    MakeDir(_outDir);
+
+    try
+    {
+        Sweep(extents, pool);
+    }
+    catch(...)
+    {
+        WaitIdle(0);    // batches refer to us
+        throw;
+    }
+    WaitIdle(0);
+    if (!_error.empty())
+        throw std::runtime_error(_error);
+
+    ReadOthers(others, pool);
+}
+
+void Extractor::Plan(std::vector<Extent> & extents, std::vector<u32> & others) const
+{
+    for (u32 i = 0; i < _items.size(); ++i)
+    {
+        StreamRecord const & s = _store.GetStream(_items[i].stream);
+        if (s.realSize == 0)
+            continue;   // nothing to read, just the output file
+        if (!s.nonResident || s.compressed)
+        {
+            others.push_back(i);
+            continue;
+        }
+
+        // clusters past the end of stream are never read,
+        // neither are sparse ones, which are left as holes of output
+        u64 clusters = (s.realSize + _clusterSize - 1) / _clusterSize;
+        u64 vcn = s.location;
+        RunRecord const * r = _store.RunsBegin(s);
+        for (u32 k = 0; k < s.runCount && vcn < clusters; vcn += r[k].count, ++k)
+        {
+            if (r[k].lcn == 0)
+                continue;
+            u64 count = std::min(r[k].count, clusters - vcn);
+            for (u64 done = 0; done < count; )
+            {
+                Extent e;
+                e.lcn = r[k].lcn + done;
+                e.vcn = vcn + done;
+                e.count = (u32)std::min<u64>(count - done, MAX_BATCH_CLUSTERS);
+                e.item = i;
+                extents.push_back(e);
+                done += e.count;
+            }
+        }
+    }
+    std::sort(extents.begin(), extents.end());
+
+    // resident ones are read in MFT order
+    std::sort(others.begin(), others.end(), ByMftRef(_store, _items));
+}
+
+void Extractor::Sweep(std::vector<Extent> const & extents, ThreadPool & pool)
+{
+    // outputs are made up front at their full size, so runs can be written
+    // in any order, sparse parts are left as holes
+    for (u32 i = 0; i < _items.size(); ++i)
+    {
+        StreamRecord const & s = _store.GetStream(_items[i].stream);
+        CreateOutput(_items[i], s.nonResident ? s.realSize : 0);
+    }
+
+    size_t i = 0;
+    while (i < extents.size())
+    {
+        // one read covers following extents as long as they are close enough
+        std::auto_ptr<Batch> batch(new Batch(*this));
+        batch->_firstLcn = extents[i].lcn;
+        u64 end = extents[i].lcn + extents[i].count;
+        batch->_extents.push_back(extents[i]);
+        for (++i; i < extents.size(); ++i)
+        {
+            Extent const & e = extents[i];
+            u64 newEnd = std::max(end, e.lcn + e.count);
+            if (e.lcn > end + MAX_GAP_CLUSTERS || newEnd - batch->_firstLcn > MAX_BATCH_CLUSTERS)
+                break;
+            end = newEnd;
+            batch->_extents.push_back(e);
+        }
+
+        u32 clusters = (u32)(end - batch->_firstLcn);
+        WaitIdle(MAX_INFLIGHT - (u64)clusters * _clusterSize);
+        batch->_data.resize((size_t)clusters * _clusterSize);
+        {
+            TraceSpan span("read batch", "extract", batch->_firstLcn);
+            _ntfs.ReadLCN(batch->_firstLcn, clusters, &batch->_data[0]);
+        }
+
+        {
+            ScopedLock lock(_lock);
+            _inflight += batch->_data.size();
+            ++_pending;
+        }
+        pool.Submit(batch.release());
+    }
+}
+
+void Extractor::ReadOthers(std::vector<u32> const & others, ThreadPool & pool)
+{
+    ntfs::File file(_tree);
+    file.SetReadAhead(&pool, 2 * pool.Size());
+
+    std::vector<u8> buf(MAX_BATCH_CLUSTERS * _clusterSize);
+    ntfs::File::RANGES ranges;
+    for (size_t i = 0; i < others.size(); ++i)
+    {
+        Item const & item = _items[others[i]];
+        TraceSpan span("extract file", "extract", item.node);
+        if (!file.Open(item.path.c_str()))
+            throw std::runtime_error("Can't open file to extract: " + item.path);
+
+        // holes of compressed streams are left in the output too
+        file.GetDataRanges(ranges);
+        for (size_t k = 0; k < ranges.size(); ++k)
+        {
+            file.Seek(ranges[k].first);
+            u64 offset = ranges[k].first;
+            for (u64 left = ranges[k].second; left > 0; )
+            {
+                unsigned long reads = file.Read(&buf[0], (unsigned long)std::min<u64>(left, buf.size()));
+                if (reads == 0)
+                    throw std::runtime_error("Short read of file to extract: " + item.path);
+                WriteOutput(item, offset, &buf[0], reads);
+                offset += reads;
+                left -= reads;
+                _bytesWritten += reads;
+            }
+        }
+        file.Close();
+    }
+}
+
+void Extractor::WriteTar(std::ostream & os, ThreadPool * pool)
+{
+    TarWriter tar(os);
+    ntfs::File file(_tree);
+    file.SetReadAhead(pool, pool ? 2 * pool->Size() : 0);
+
+    std::vector<u8> buf(TAR_BUFFER_SIZE);
+    TarWriter::RANGES ranges;
+    for (size_t i = 0; i < _items.size(); ++i)
+    {
+        Item const & item = _items[i];
+        StreamRecord const & s = _store.GetStream(item.stream);
+        std::string name(item.path, 1);     // relative to archive root
+        TraceSpan span("tar file", "extract", item.node);
+
+        ranges.clear();
+        if (s.realSize > 0)
+        {
+            if (!file.Open(item.path.c_str()))
+                throw std::runtime_error("Can't open file to extract: " + item.path);
+            file.GetDataRanges(ranges);
+        }
+        // sparse entries only for files with holes, times before 1970 as 0
+        u64 data = 0;
+        for (size_t k = 0; k < ranges.size(); ++k)
+            data += ranges[k].second;
+        s64 mtime = UnixTime(_store.InfoTimes(_store[item.node]).written);
+        if (mtime < 0)
+            mtime = 0;
+        if (data == s.realSize)
+            tar.BeginFile(name, s.realSize, (u64)mtime);
+        else
+            tar.BeginSparseFile(name, s.realSize, ranges, (u64)mtime);
+
+        if (s.realSize > 0)
+        {
+            for (size_t k = 0; k < ranges.size(); ++k)
+            {
+                file.Seek(ranges[k].first);
+                for (u64 left = ranges[k].second; left > 0; )
+                {
+                    unsigned long reads = file.Read(&buf[0], (unsigned long)std::min<u64>(left, buf.size()));
+                    if (reads == 0)
+                        throw std::runtime_error("Short read of file to extract: " + item.path);
+                    tar.Write(&buf[0], reads);
+                    left -= reads;
+                }
+            }
+            file.Close();
+        }
+        tar.EndFile();
+        _bytesWritten += s.realSize;
+    }
+    tar.Finish();
+}
+
+void Extractor::Batch::Run()
+{
+    std::string error;
+    u64 bytes = 0;
+    try
+    {
+        TraceSpan span("write batch", "extract", _firstLcn);
+        for (size_t i = 0; i < _extents.size(); ++i)
+        {
+            Extent const & e = _extents[i];
+            Item const & item = _owner._items[e.item];
+            u64 size = _owner._store.GetStream(item.stream).realSize;
+            u64 offset = e.vcn * _owner._clusterSize;
+            u64 length = std::min<u64>((u64)e.count * _owner._clusterSize, size - offset);
+            _owner.WriteOutput(item, offset, &_data[(size_t)((e.lcn - _firstLcn) * _owner._clusterSize)], length);
+            bytes += length;
+        }
+    }
+    catch(std::exception & err)
+    {
+        error = err.what();
+    }
+    _owner.Finished(this, error, bytes);
+}
+
+void Extractor::Finished(Batch * batch, std::string const & error, u64 bytes)
+{
+    u64 size = batch->_data.size();
+    delete batch;
+
+    ScopedLock lock(_lock);
+    _inflight -= size;
+    --_pending;
+    _bytesWritten += bytes;
+    if (_error.empty())
+        _error = error;
+    _batchDone.Broadcast();
+}
+
+void Extractor::WaitIdle(u64 maxInflight)
+{
+    ScopedLock lock(_lock);
+    while (_pending > 0 && _inflight > maxInflight)
+        _batchDone.Wait(_lock);
+}
+
+//=============================================================================
+void Extractor::CreateOutput(Item const & item, u64 size)
+{
+    // make the folders on the way, once each
+    std::string path(_outDir);
+    path.append(item.file);
+    for (size_t i = _outDir.size() + 1; i < path.size(); ++i)
+    {
+        if (path[i] != '/')
+            continue;
+        std::string dir(path, 0, i);
+        if (_dirs.insert(dir).second && !MakeDir(dir))
+            throw std::runtime_error("Can't create output folder.");
+    }
+
+    std::ofstream ofs(path.c_str(), std::ios_base::binary | std::ios_base::trunc);
+    if (!ofs.is_open())
+        throw std::runtime_error("Can't create output file.");
+    if (size > 0)
+    {
+        ofs.seekp(size - 1);
+        ofs.put(0);
+    }
+    if (!ofs.good())
+        throw std::runtime_error("Can't write output file.");
+}
+
+void Extractor::WriteOutput(Item const & item, u64 offset, void const * data, u64 size)
+{
+    // each write opens its own handle, writes of a file never overlap
+    std::string path(_outDir);
+    path.append(item.file);
+    std::fstream fs(path.c_str(), std::ios_base::binary | std::ios_base::in | std::ios_base::out);
+    if (!fs.is_open())
+        throw std::runtime_error("Can't open output file.");
+    fs.seekp(offset);
+    fs.write((char const *)data, size);
+    if (!fs.good())
+        throw std::runtime_error("Can't write output file.");
+}
@@ -0,0 +1,130 @@
+//
+// NTFS Extractor
+// Extracts many files at once, as given by paths or wildcard
+// patterns resolved against one ntfs::Tree.
+//
+// Rather than reading file after file, the clusters of every
+// (uncompressed, non-resident) stream are planned together and
+// read in a single sweep in ascending LCN order, coalescing
+// neighbouring runs, while a thread pool writes them out to
+// their files. Resident & compressed streams are read through
+// ntfs::File after the sweep.
+//
+// Or the streams are written as one tar stream, e.g. to stdout,
+// read through ntfs::File with sparse ranges left out.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __NTFS_EXTRACT_H
+#define __NTFS_EXTRACT_H
+
+#include "types.h"
+#include "ntfs.h"
+#include "ntfs_tree.h"
+#include "thread.h"
+#include "tar.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+namespace ntfs
+{
+    class Extractor
+    {
+    public:
+        // files are written under outDir by their paths in the volume,
+        // a named stream's file is suffixed with ":name". names are made
+        // safe to create first, see AppendSafeName()
+        Extractor(ntfs::Ntfs & ntfs, ntfs::Tree & tree, char const * outDir);
+        ~Extractor();
+
+        // adds streams matching "path[:stream]" from root folder, names in path
+        // may have * and ? wildcards, matched case-insensitively like NTFS does.
+        // a stream matched more than once is extracted once.
+        // returns number of streams newly added
+        u32 Add(char const * pattern);
+
+        // extracts every added stream, pool does the writing
+        void Run(ThreadPool & pool);
+
+        // writes every added stream into a tar stream instead, outDir unused.
+        // pool decompresses ahead if given
+        void WriteTar(std::ostream & os, ThreadPool * pool);
+
+        u32 Count() const { return _items.size(); }
+        u64 BytesWritten() const { return _bytesWritten; }
+
+        // a stream to extract
+        struct Item
+        {
+            u32 node;           // index in tree's store
+            u32 stream;         // stream index in tree's store
+            std::string path;   // UTF-8, '/' separated from root
+            std::string file;   // same, each name made safe, under outDir
+        };
+
+    private:
+        // clusters of an item's stream, at vcn of the stream
+        struct Extent
+        {
+            u64 lcn;
+            u64 vcn;
+            u32 count;
+            u32 item;
+            bool operator < (Extent const & e) const { return lcn < e.lcn; }
+        };
+
+        // clusters read in one go, written out to their files on the pool
+        class Batch : public Task
+        {
+        public:
+            Batch(Extractor & owner) : _owner(owner), _firstLcn(0) { }
+            void Run();
+
+            Extractor & _owner;
+            u64 _firstLcn;
+            std::vector<u8> _data;
+            std::vector<Extent> _extents;
+        private:
+            Batch & operator = (Batch const &);
+        };
+
+        Extractor & operator = (Extractor const &);     // not assignable
+        void Match(u32 folder, std::vector<std::basic_string<u16> > const & names, size_t k,
+            std::string const & path, std::string const & file, std::basic_string<u16> const & stream, u32 & added);
+        bool Glob(u16 const * pattern, u32 plen, u16 const * name, u32 nlen) const;
+        void AddStream(u32 node, std::string const & path, std::string const & file,
+            std::basic_string<u16> const & stream, u32 & added);
+        void Plan(std::vector<Extent> & extents, std::vector<u32> & others) const;
+        void Sweep(std::vector<Extent> const & extents, ThreadPool & pool);
+        void ReadOthers(std::vector<u32> const & others, ThreadPool & pool);
+        void CreateOutput(Item const & item, u64 size);
+        void WriteOutput(Item const & item, u64 offset, void const * data, u64 size);
+        void Finished(Batch * batch, std::string const & error, u64 bytes);
+        void WaitIdle(u64 maxInflight);
+
+        ntfs::Ntfs & _ntfs;
+        ntfs::Tree & _tree;
+        ntfs::NodeStore const & _store;
+        std::string _outDir;
+        u32 _clusterSize;
+
+        std::vector<Item> _items;
+        std::set<u32> _streams;     // streams added so far
+        std::set<std::string> _dirs;    // output folders made so far
+
+        // batches on the pool
+        Mutex _lock;
+        Condition _batchDone;
+        u64 _inflight;      // bytes of batches not written yet, guarded by _lock
+        u32 _pending;       // ditto, number of batches
+        u64 _bytesWritten;  // ditto
+        std::string _error; // ditto, 1st write error
+    };
+}
+
+#endif // __NTFS_EXTRACT_H
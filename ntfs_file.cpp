@@ -1,8 +1,12 @@
 //
 // NTFS File
-// Base on the result of ntfs::Tree, provides generic 64bit file
-// reading interfaces with Win32-like path target, and reads
-// the file content from the NTFS file system.
+// Base on the result of ntfs::Tree, or the on-disk $I30 indexes if
+// there is no tree, provides generic 64bit file reading interfaces
+// with Win32-like path target, and reads the file content from
+// the NTFS file system.
+//
+// Compressed streams can optionally be read in pipelined mode, where
+// upcoming compression units are fetched & decompressed on a thread pool.
 //
 // Author: Derek Saw
 //
@@ -11,19 +15,40 @@
 
 #include "ntfs_file.h"
 #include "ntfs_compress.h"
+#include "stats.h"
 #include "stringtok.h"
 #include "utf8.h"
 #include <string>
 
 using namespace ntfs;
 
+namespace
+{
+    // default budget for decompressed compression units (64 units of 64k)
+    u64 const DEFAULT_CACHE_SIZE = 4 * 1024 * 1024;
+}
+
 //=============================================================================
 File::File(ntfs::Tree & tree)
-: _tree(tree), _ntfs(_tree._ntfs), _pos(~0ULL), _clustersPerGroup(0), _oldClusterNumber(~0ULL)
+: _tree(&tree), _ntfs(tree._ntfs), _index(_ntfs), _pos(~0ULL), _clustersPerGroup(0), _cacheSize(DEFAULT_CACHE_SIZE),
+  _pool(0), _readAhead(0), _oldClusterNumber(~0ULL)
+{
+    _clusterBuf.resize(_ntfs.GetBytesPerSector() * _ntfs.GetSectorsPerCluster());
+}
+
+File::File(ntfs::Ntfs & ntfs)
+: _tree(0), _ntfs(ntfs), _index(_ntfs), _pos(~0ULL), _clustersPerGroup(0), _cacheSize(DEFAULT_CACHE_SIZE),
+  _pool(0), _readAhead(0), _oldClusterNumber(~0ULL)
 {
     _clusterBuf.resize(_ntfs.GetBytesPerSector() * _ntfs.GetSectorsPerCluster());
 }
 
+File::~File()
+{
+    // pool workers might still be referring to us
+    CancelPrefetch();
+}
+
 bool File::Open(char const * filename)
 {
     std::basic_string<u16> utf16Filename;
@@ -44,16 +69,53 @@ bool File::Open(wchar_t const * filename)
 }
 
 bool File::OpenInternal(std::basic_string<u16> const & filename)
+{
+    if (_tree ? OpenTree(filename) : OpenIndex(filename))
+        OpenStream();
+    return IsOpen();
+}
+
+bool File::OpenNode(u32 node, std::basic_string<u16> const & streamName)
+{
+    if (_tree == 0 || _tree->IsLazy())
+        throw std::runtime_error("Opening by node needs the whole tree.");
+    ntfs::NodeStore const & store = _tree->GetStore();
+    if (node >= store.Size() || store[node].IsDir())
+        throw std::runtime_error("Not a file node.");
+    ClearCache();
+    _tree->GetNode(store, node, _node);
+    if (!_tree->GetStream(store, node, streamName, _stream))
+        throw std::runtime_error("Cannot find stream name.");
+    OpenStream();
+    return IsOpen();
+}
+
+void File::OpenStream()
+{
+    _pos = 0;
+    _oldClusterNumber = ~0ULL;
+    if (_stream.compressed)
+    {
+        _clustersPerGroup = 1 << _stream.compressUnitSize;
+        _compressBuf.resize(_ntfs.GetBytesPerSector() * _ntfs.GetSectorsPerCluster() * _clustersPerGroup);
+    }
+
+    //printf("Found size: %llu\n", _stream.realSize);
+}
+
+bool File::OpenTree(std::basic_string<u16> const & filename)
 {
     u16 const s_seps[] = { '\\', '/', 0 };
     typedef std::basic_string<u16> U16STR;
     U16STR token, streamName;
-    u64 folderMft = 5; // start with root (mft=5)
+    u64 folderRef = 5; // start with root (mft=5)
+    u64 fileFolderRef = 0;
+    u32 nodeIndex = 0;
     bool found = false;
 
     StringTok<U16STR> stoken(filename);
     for (token = stoken(s_seps);
-        !token.empty() || folderMft != 0; // OR condition because monkey input might give "/WINDOWS/System32/notepad.exe/wtfinvalid"
+        !token.empty() || folderRef != 0; // OR condition because monkey input might give "/WINDOWS/System32/notepad.exe/wtfinvalid"
         token = stoken(s_seps))
     {
         U16STR::size_type pos = token.find_first_of(':');
@@ -65,28 +127,25 @@ bool File::OpenInternal(std::basic_string<u16> const & filename)
         else
             streamName.clear();
 
-        ntfs::FOLDERS::iterator it = _tree._folders.find(folderMft);
-        if (it == _tree._folders.end())
+        u32 folder = 0;
+        ntfs::NodeStore const * store = folderRef ? _tree->GetFolder(folderRef, folder) : 0;
+        if (store == 0)
             throw std::runtime_error("Can't find MFT entry.");
 
-        // search for node via name
-        found = false;
-        ntfs::NODES::iterator nit = it->second.begin();
-        for (; nit != it->second.end(); ++nit)
+        // search for node via name, case-insensitive as NTFS does
+        u32 index = store->Lookup(folder, token.data(), token.size());
+        found = (index != NodeStore::NPOS);
+        if (found)
         {
-            if (nit->name.compare(token) == 0 || nit->shortname.compare(token) == 0)
+            if ((*store)[index].IsDir())
             {
-                if (nit->isdir)
-                {
-                    folderMft = nit->mftRef;
-                }
-                else
-                {
-                    _node = *nit;
-                    folderMft = 0;
-                }
-                found = true;
-                break;
+                folderRef = (*store)[index].mftRef;
+            }
+            else
+            {
+                fileFolderRef = folderRef;
+                nodeIndex = index;
+                folderRef = 0;
             }
         }
         if (!found)
@@ -96,27 +155,67 @@ bool File::OpenInternal(std::basic_string<u16> const & filename)
     // check for valid stream
     if (found)
     {
-        ntfs::STREAMS::iterator it = _node.streams.find(streamName);
-        if (it == _node.streams.end())
+        // for lazy tree, folder is the most recent one, so still cached
+        u32 folder;
+        ntfs::NodeStore const * store = _tree->GetFolder(fileFolderRef, folder);
+        if (store == 0)
+            throw std::runtime_error("Can't find MFT entry.");
+        ClearCache();
+        _tree->GetNode(*store, nodeIndex, _node);
+        if (!_tree->GetStream(*store, nodeIndex, streamName, _stream))
             throw std::runtime_error("Cannot find stream name.");
-        _stream = it->second;
-        _pos = 0;
-        _oldClusterNumber = ~0ULL;
-        if (_stream.compressed)
-        {
-            _clustersPerGroup = 1 << _stream.compressUnitSize;
-            _clusterBuf.resize(_ntfs.GetBytesPerSector() * _ntfs.GetSectorsPerCluster() * _clustersPerGroup);
-            _compressBuf.resize(_ntfs.GetBytesPerSector() * _ntfs.GetSectorsPerCluster() * _clustersPerGroup);
-            //_posCompress = 0;
-        }
+    }
+    return found;
+}
 
-        //printf("Found size: %llu\n", _stream.realSize);
+bool File::OpenIndex(std::basic_string<u16> const & filename)
+{
+    u16 const s_seps[] = { '\\', '/', 0 };
+    typedef std::basic_string<u16> U16STR;
+
+    // stream name can only be on the last path component
+    U16STR path(filename), streamName;
+    U16STR::size_type sep = path.find_last_of(s_seps);
+    U16STR::size_type pos = path.find_first_of(':', (sep == U16STR::npos) ? 0 : sep + 1);
+    if (pos != U16STR::npos)
+    {
+        streamName = path.substr(pos+1);
+        path.erase(pos);
     }
-    return IsOpen();
+
+    ntfs::FolderElement entry;
+    if (!_index.FindPath(path, entry) || entry.IsDir())
+        throw std::runtime_error("Can't find full path name.");
+
+    ntfs::Node node;
+    std::vector<u8> buf;
+    if (!Tree::ReadNode(_ntfs, entry.mftref, node, buf))
+        throw std::runtime_error("Can't find MFT entry.");
+
+    // stream names are case-insensitive, exact case wins
+    ntfs::STREAMS::iterator it = node.streams.find(streamName);
+    for (ntfs::STREAMS::iterator sit = node.streams.begin(); it == node.streams.end() && sit != node.streams.end(); ++sit)
+    {
+        U16STR const & name = sit->first;
+        U16STR::size_type k = 0;
+        while (k < name.size() && k < streamName.size() && _ntfs.UpCase(name[k]) == _ntfs.UpCase(streamName[k]))
+            ++k;
+        if (k == name.size() && k == streamName.size())
+            it = sit;
+    }
+    if (it == node.streams.end())
+        throw std::runtime_error("Cannot find stream name.");
+
+    ClearCache();
+    _stream = it->second;
+    node.streams.clear();
+    _node = node;
+    return true;
 }
 
 void File::Close()
 {
+    ClearCache();
     _stream.Clear();
     _node.Clear();
 }
@@ -134,6 +233,8 @@ bool File::Eof() const
 unsigned long File::Read(void * buf, unsigned long size)
 {
     Validate();
+    StatScope stat(eStatFileRead);
+    stat.Position(_pos, std::min<u64>(size, _stream.realSize - _pos));
     unsigned long bytesRead = 0;
     if (_stream.nonResident)
     {
@@ -144,74 +245,20 @@ unsigned long File::Read(void * buf, unsigned long size)
             // ie. group size == 16 ==> 64k per compression block
             if (_clustersPerGroup != 16)
                 throw std::runtime_error("Unsupported compression block size");
-            if (_compressBuf.size() != _clusterBuf.size())
-                throw std::runtime_error("Compression buffer not in sync.");
 
-            unsigned long clusterSize = _ntfs.GetBytesPerSector() * _ntfs.GetSectorsPerCluster();
-            unsigned long clusterGroupSize = _clusterBuf.size();
+            unsigned long clusterGroupSize = _compressBuf.size();
 
             while (bytesRead < size && _pos < _stream.realSize)
             {
-                // get cluster group number
+                // get cluster group number and its decompressed content
                 u64 vcgn = _pos / clusterGroupSize;
-                u64 vcnStart = vcgn * _clustersPerGroup;
-
-                // do decompression if we haven't process this cluster group
-                if (vcnStart != _oldClusterNumber)
-                {
-                    // read the correct compressed cluster group (for decompression)
-                    u64 vcnEnd = vcnStart + _clustersPerGroup;
-                    u32 count = 0;
-                    u32 clusterGroupMap = 0;
-                    int flags=0;  // 0=sparse; 1=group compressed; 2=group uncompressed
-                    for (u64 vcn = vcnStart; vcn < vcnEnd; ++vcn, ++count)
-                    {
-                        u64 lcn = _stream.dataRun.Vcn2Lcn(vcn);
-
-                        // clusterGroupMap is a bitmap of 16 cluster (hence 16bit) for taking note of used clusters
-                        // bit of 1 means cluster is in used
-                        // bit of 0 means cluster unused
-                        // if all bits are set, i.e. 16 clusters are fully occupied, then this group is uncompressed
-                        // if no bits are set, i.e. no clusters are used, then this is a sparse group
-                        // else, this group is compressed
-                        clusterGroupMap |= ((lcn == 0) ? 0 : (1 << count));
-
-                        if (vcnStart != _oldClusterNumber)
-                        {
-                            // only cache disk i/o
-                            if (lcn)
-                                _ntfs.ReadLCN(lcn, 1, &_compressBuf[count * clusterSize]);
-                            else
-                                memset(&_compressBuf[count * clusterSize], 0, sizeof(clusterSize));
-                        }
-                    }
-                    flags = ((clusterGroupMap & 0xffff) == 0xffff) ? 2 : (clusterGroupMap==0?0:1);
-
-                    // starts decompression
-                    switch (flags)
-                    {
-                    case 0: // sparse
-                        memset(&_clusterBuf[0], 0, _clusterBuf.size());
-                        break;
-                    case 1: // group compressed
-                        if (!ntfs::decompress(&_clusterBuf[0], _clusterBuf.size(), &_compressBuf[0], _compressBuf.size()))
-                            throw std::runtime_error("Unable to decompress");
-                        break;
-                    case 2: // group uncompressed
-                        memcpy(&_clusterBuf[0], &_compressBuf[0], _clusterBuf.size());
-                        break;
-                    default:
-                        throw std::runtime_error("unknown flag");
-                    }
-
-                    _oldClusterNumber = vcnStart;
-                }
+                u8 const * unit = GetCompressionUnit(vcgn);
 
                 // copies decompressed data to output buffer
                 unsigned long offset = (unsigned long)(_pos % clusterGroupSize);
                 unsigned long len = (unsigned long)std::min<u64>(_stream.realSize - _pos, clusterGroupSize - offset);
-                len = std::min(len, size);
-                memcpy(buf, &_clusterBuf[offset], len);
+                len = std::min(len, size - bytesRead);
+                memcpy(buf, unit + offset, len);
 
                 _pos += len;
                 buf = P_add(buf, len);
@@ -220,31 +267,48 @@ unsigned long File::Read(void * buf, unsigned long size)
         }
         else
         {
-            // uncompress stream
+            // uncompress stream, a run at a time: whole clusters go straight
+            // into the caller's buffer, only a partial first or last cluster
+            // goes through the cluster cache
             unsigned long clusterSize = _clusterBuf.size();
             u8 * pbytes = (u8*) buf;
             while (bytesRead < size && _pos < _stream.realSize)
             {
                 u64 vcn = _pos / clusterSize;
-                u64 lcn = _stream.dataRun.Vcn2Lcn(vcn);
+                u64 contiguous = 0;
+                u64 lcn = _stream.dataRun.Vcn2Lcn(vcn, contiguous);
                 unsigned long bytesOffset = (unsigned long)(_pos % clusterSize);
-                unsigned long len = (unsigned long)std::min<u64>(clusterSize - bytesOffset, _stream.realSize - _pos);
-                len = std::min(len, size);
+                u64 left = std::min<u64>(size - bytesRead, _stream.realSize - _pos);
+                unsigned long len;
 
-                if (lcn > 0 && lcn != _oldClusterNumber)
+                if (lcn == 0)
                 {
-                    // minor caching to avoid re-reading the same cluster over & over again
-                    _ntfs.ReadLCN(lcn, 1, &_clusterBuf[0]);
-                    _oldClusterNumber = lcn;
+                    // unused sparse clusters reached - zeroes the whole run
+                    len = (unsigned long)std::min<u64>(contiguous * clusterSize - bytesOffset, left);
+                    memset(pbytes, 0, len);
                 }
-                else if (lcn == 0)
+                else if (bytesOffset == 0 && left >= clusterSize)
                 {
-                    // unused sparse cluster reached - zeroes the buffer
-                    memset(&_clusterBuf[0], 0, _clusterBuf.size());
-                    _oldClusterNumber = lcn;
+                    u64 count = std::min<u64>(contiguous, left / clusterSize);
+                    _ntfs.ReadLCN(lcn, (u32)count, pbytes);
+                    len = (unsigned long)(count * clusterSize);
+                }
+                else
+                {
+                    if (lcn != _oldClusterNumber)
+                    {
+                        // minor caching to avoid re-reading the same cluster over & over again
+                        _ntfs.ReadLCN(lcn, 1, &_clusterBuf[0]);
+                        _oldClusterNumber = lcn;
+                    }
+                    else
+                    {
+                        Stats::CacheHit(eStatFileRead);
+                    }
+                    len = (unsigned long)std::min<u64>(clusterSize - bytesOffset, left);
+                    memcpy(pbytes, &_clusterBuf[bytesOffset], len);
                 }
 
-                memcpy(pbytes, &_clusterBuf[bytesOffset], len);
                 bytesRead += len;
                 _pos += len;
                 pbytes += len;
@@ -259,6 +323,7 @@ unsigned long File::Read(void * buf, unsigned long size)
         _pos += len;
         bytesRead += len;
     }
+    stat.SetBytes(bytesRead);
     return bytesRead;
 }
 
@@ -291,8 +356,306 @@ s64 File::Size() const
     return _stream.realSize;
 }
 
+void File::GetDataRanges(RANGES & ranges) const
+{
+    Validate();
+    ranges.clear();
+    if (_stream.realSize == 0)
+        return;
+    if (!_stream.nonResident)
+    {
+        ranges.push_back(std::make_pair(0ULL, _stream.realSize));
+        return;
+    }
+
+    u64 clusterSize = _ntfs.GetBytesPerSector() * _ntfs.GetSectorsPerCluster();
+    u64 unit = _stream.compressed ? (1ULL << _stream.compressUnitSize) : 1;
+    u64 vcn = _stream.dataRun._baseVcn;
+    ntfs::DataRun::LIST const & runs = _stream.dataRun._list;
+    for (size_t k = 0; k < runs.size(); vcn += runs[k].count, ++k)
+    {
+        if (runs[k].offset == 0)
+            continue;   // sparse
+        u64 begin = vcn / unit * unit * clusterSize;
+        u64 end = std::min((vcn + runs[k].count + unit - 1) / unit * unit * clusterSize, _stream.realSize);
+        if (begin >= end)
+            break;
+        if (!ranges.empty() && ranges.back().first + ranges.back().second >= begin)
+            ranges.back().second = std::max(ranges.back().second, end - ranges.back().first);
+        else
+            ranges.push_back(std::make_pair(begin, end - begin));
+    }
+}
+
+void File::SetCacheSize(u64 bytes)
+{
+    _cacheSize = bytes;
+
+    // shrink right away, keeping the most recently used unit
+    while (_unitLru.size() > 1 && _unitLru.size() * _compressBuf.size() > _cacheSize)
+    {
+        _unitMap.erase(_unitLru.back().vcgn);
+        _unitLru.pop_back();
+    }
+}
+
+void File::ClearCache()
+{
+    CancelPrefetch();
+    _unitLru.clear();
+    _unitMap.clear();
+}
+
+void File::SetReadAhead(ThreadPool * pool, u32 units)
+{
+    CancelPrefetch();
+    _pool = units ? pool : 0;
+    _readAhead = pool ? units : 0;
+}
+
+//=============================================================================
+// returns the decompressed content of compression unit #vcgn
+// from the LRU cache, reading & decompressing it on a miss.
+// returned pointer is valid until the next call.
+u8 const * File::GetCompressionUnit(u64 vcgn)
+{
+    UNITMAP::iterator it = _unitMap.find(vcgn);
+    if (it != _unitMap.end())
+    {
+        // hit - move to the front of LRU
+        Stats::CacheHit(eStatFileRead);
+        _unitLru.splice(_unitLru.begin(), _unitLru, it->second);
+        SchedulePrefetch(vcgn);
+        return &_unitLru.front().data[0];
+    }
+
+    // miss - recycle the least recently used unit when over budget
+    u64 unitSize = _compressBuf.size();
+    if (!_unitLru.empty() && (_unitLru.size() + 1) * unitSize > _cacheSize)
+    {
+        _unitMap.erase(_unitLru.back().vcgn);
+        _unitLru.splice(_unitLru.begin(), _unitLru, --_unitLru.end());
+    }
+    else
+    {
+        _unitLru.push_front(CacheUnit());
+        _unitLru.front().data.resize(unitSize);
+    }
+
+    CacheUnit & cu = _unitLru.front();
+    try
+    {
+        if (!TakePrefetch(vcgn, cu.data))
+            ReadCompressionUnit(vcgn, &cu.data[0], _compressBuf);
+    }
+    catch (...)
+    {
+        _unitLru.pop_front();
+        throw;
+    }
+    cu.vcgn = vcgn;
+    _unitMap[vcgn] = _unitLru.begin();
+    SchedulePrefetch(vcgn);
+    return &cu.data[0];
+}
+
+//=============================================================================
+// reads compression unit #vcgn and inflates it into buf (unit size).
+// allocated clusters of the unit are read as coalesced runs
+// rather than one cluster at a time.
+// only touches the given buffers, so it is safe to run on pool threads.
+void File::ReadCompressionUnit(u64 vcgn, u8 * buf, std::vector<u8> & compressBuf)
+{
+    u32 clusterSize = _ntfs.GetBytesPerSector() * _ntfs.GetSectorsPerCluster();
+    u64 vcnStart = vcgn * _clustersPerGroup;
+    u64 vcnEnd = vcnStart + _clustersPerGroup;
+
+    // number of clusters in this group that are backed by disk
+    // if all 16 clusters are occupied, then this group is uncompressed
+    // if no clusters are used, then this is a sparse group
+    // else, this group is compressed
+    u32 allocated = 0;
+    u32 count = 0;
+    for (u64 vcn = vcnStart; vcn < vcnEnd; )
+    {
+        u64 contiguous = 0;
+        u64 lcn = _stream.dataRun.Vcn2Lcn(vcn, contiguous);
+        u32 n = (u32)std::min<u64>(contiguous, vcnEnd - vcn);
+        if (lcn)
+        {
+            _ntfs.ReadLCN(lcn, n, &compressBuf[count * clusterSize]);
+            allocated += n;
+        }
+        else
+            memset(&compressBuf[count * clusterSize], 0, n * clusterSize);
+        vcn += n;
+        count += n;
+    }
+
+    if (allocated == 0)
+    {
+        // sparse
+        memset(buf, 0, compressBuf.size());
+    }
+    else if (allocated == _clustersPerGroup)
+    {
+        // group uncompressed
+        memcpy(buf, &compressBuf[0], compressBuf.size());
+    }
+    else
+    {
+        // group compressed
+        if (!ntfs::decompress(buf, compressBuf.size(), &compressBuf[0], compressBuf.size()))
+            throw std::runtime_error("Unable to decompress");
+    }
+}
+
+//=============================================================================
+// pipelined read of compression units
+void File::Prefetch::Run()
+{
+    {
+        ScopedLock lock(_file._prefetchLock);
+        if (_cancelled)
+        {
+            _done = true;
+            _file._prefetchDone.Broadcast();
+            return;
+        }
+    }
+
+    try
+    {
+        _data.resize(_file._compressBuf.size());
+        _compressBuf.resize(_file._compressBuf.size());
+        _file.ReadCompressionUnit(_vcgn, &_data[0], _compressBuf);
+    }
+    catch (std::exception & err)
+    {
+        _error = err.what();
+        if (_error.empty())
+            _error = "Prefetch failed.";
+    }
+
+    // File may delete us as soon as the lock is released
+    ScopedLock lock(_file._prefetchLock);
+    _done = true;
+    _file._prefetchDone.Broadcast();
+}
+
+// queues units following vcgn up to the read ahead window
+void File::SchedulePrefetch(u64 vcgn)
+{
+    if (!_pool || !_readAhead)
+        return;
+
+    u64 unitSize = _compressBuf.size();
+    u64 lastUnit = (_stream.realSize + unitSize - 1) / unitSize;
+    u64 next = _prefetch.empty() ? vcgn + 1 : std::max(vcgn, _prefetch.back()->_vcgn) + 1;
+    for (; next <= vcgn + _readAhead && next < lastUnit; ++next)
+    {
+        if (_unitMap.find(next) != _unitMap.end())
+            continue;
+        Prefetch * p = new Prefetch(*this, next);
+        _prefetch.push_back(p);
+        _pool->Submit(p);
+    }
+}
+
+// hands over the prefetched content of unit #vcgn if it has been queued.
+// queued units before vcgn are dropped; everything is dropped if vcgn
+// is not queued at all (i.e. caller seeked elsewhere).
+bool File::TakePrefetch(u64 vcgn, std::vector<u8> & data)
+{
+    while (!_prefetch.empty() && _prefetch.front()->_vcgn < vcgn)
+        DropPrefetchFront();
+    if (_prefetch.empty())
+        return false;
+    if (_prefetch.front()->_vcgn != vcgn)
+    {
+        CancelPrefetch();
+        return false;
+    }
+
+    Prefetch * p = _prefetch.front();
+    {
+        ScopedLock lock(_prefetchLock);
+        while (!p->_done)
+            _prefetchDone.Wait(_prefetchLock);
+    }
+    _prefetch.pop_front();
+
+    std::string error;
+    error.swap(p->_error);
+    data.swap(p->_data);
+    delete p;
+    if (!error.empty())
+        throw std::runtime_error(error);
+    return true;
+}
+
+void File::DropPrefetchFront()
+{
+    Prefetch * p = _prefetch.front();
+    {
+        ScopedLock lock(_prefetchLock);
+        p->_cancelled = true;
+        while (!p->_done)
+            _prefetchDone.Wait(_prefetchLock);
+    }
+    _prefetch.pop_front();
+    delete p;
+}
+
+void File::CancelPrefetch()
+{
+    {
+        // cancel everything first so queued units are skipped quickly
+        ScopedLock lock(_prefetchLock);
+        for (PREFETCHQUEUE::iterator it = _prefetch.begin(); it != _prefetch.end(); ++it)
+            (*it)->_cancelled = true;
+    }
+    while (!_prefetch.empty())
+        DropPrefetchFront();
+}
+
 void File::Validate() const
 {
     if (!IsOpen())
         throw std::runtime_error("Ntfs file not opened yet.");
 }
+
+//=============================================================================
+u64 ntfs::ReadClusterBitmap(ntfs::Ntfs & ntfs, std::vector<u8> & bitmap)
+{
+    u64 clusterSize = (u64)ntfs.GetBytesPerSector() * ntfs.GetSectorsPerCluster();
+    u64 clusters = ntfs.GetTotalSectors() * ntfs.GetBytesPerSector() / clusterSize;
+
+    ntfs::File file(ntfs);
+    if (!file.Open("/$Bitmap"))
+        throw std::runtime_error("Can't open NTFS $Bitmap.");
+    if ((u64)file.Size() * 8 < clusters)
+        throw std::runtime_error("NTFS $Bitmap is short of the volume size.");
+    bitmap.resize((size_t)((clusters + 7) / 8));
+    if (!bitmap.empty() && file.Read(&bitmap[0], bitmap.size()) != bitmap.size())
+        throw std::runtime_error("Can't read NTFS $Bitmap.");
+    return clusters;
+}
+
+u64 ntfs::ClusterRunEnd(std::vector<u8> const & bitmap, u64 lcn, u64 limit)
+{
+    // whole bytes of the bitmap at a time where they can be
+    bool used = IsClusterInUse(bitmap, lcn);
+    u8 whole = used ? 0xff : 0;
+    u64 end = lcn + 1;
+    while (end < limit)
+    {
+        if ((end & 7) == 0 && end + 8 <= limit && bitmap[(size_t)(end >> 3)] == whole)
+            end += 8;
+        else if (IsClusterInUse(bitmap, end) == used)
+            ++end;
+        else
+            break;
+    }
+    return end;
+}
@@ -1,8 +1,12 @@
 //
 // NTFS File
-// Base on the result of ntfs::Tree, provides generic 64bit file
-// reading interfaces with Win32-like path target, and reads
-// the file content from the NTFS file system.
+// Base on the result of ntfs::Tree, or the on-disk $I30 indexes if
+// there is no tree, provides generic 64bit file reading interfaces
+// with Win32-like path target, and reads the file content from
+// the NTFS file system.
+//
+// Compressed streams can optionally be read in pipelined mode, where
+// upcoming compression units are fetched & decompressed on a thread pool.
 //
 // Author: Derek Saw
 //
@@ -15,9 +19,15 @@
 #include "types.h"
 #include "ntfs.h"
 #include "ntfs_tree.h"
+#include "ntfs_index.h"
 #include "file64.h"
+#include "thread.h"
 
 #include <vector>
+#include <list>
+#include <map>
+#include <deque>
+#include <string>
 
 namespace ntfs
 {
@@ -25,9 +35,12 @@ namespace ntfs
     {
     public:
         File(ntfs::Tree & tree);
+        File(ntfs::Ntfs & ntfs);    // looks up paths through $I30 indexes, no tree needed
+        ~File();
 
         bool Open(char const * filename);
         bool Open(wchar_t const * filename);    // filename have to start with root, e.g. L"\Windows\System32\kernel32.dll"
+        bool OpenNode(u32 node, std::basic_string<u16> const & streamName);    // node of the whole tree's store, no path lookup
         void Close();
         bool IsOpen() const;
         bool Eof() const;
@@ -35,13 +48,68 @@ namespace ntfs
         bool Seek(s64 pos, u32 moveMethod = 0);
         s64 Size() const;
 
+        // (offset, length) of the stream's data, ascending; the rest are holes
+        // of sparse clusters that read as zeroes. a compression unit with any
+        // cluster allocated is data as a whole
+        typedef std::vector<std::pair<u64, u64> > RANGES;
+        void GetDataRanges(RANGES & ranges) const;
+
+        // memory budget for caching decompressed compression units
+        // at least one unit is always kept regardless of the budget
+        void SetCacheSize(u64 bytes);
+
+        // pipelined read mode for compressed streams: up to `units` compression
+        // units following the current one are fetched and decompressed on the
+        // given pool while the caller consumes the current one.
+        // pool must outlive this file; pass null pool to read synchronously.
+        void SetReadAhead(ThreadPool * pool, u32 units);
+
     private:
+        // a decompressed compression unit, keyed by its unit number
+        struct CacheUnit
+        {
+            u64 vcgn;
+            std::vector<u8> data;
+        };
+        typedef std::list<CacheUnit> UNITLIST;
+        typedef std::map<u64, UNITLIST::iterator> UNITMAP;
+
+        // a compression unit being fetched & decompressed on the thread pool
+        class Prefetch : public Task
+        {
+        public:
+            Prefetch(File & file, u64 vcgn) : _file(file), _vcgn(vcgn), _done(false), _cancelled(false) { }
+            void Run();
+
+            File & _file;
+            u64 _vcgn;
+            std::vector<u8> _data;
+            std::vector<u8> _compressBuf;
+            std::string _error;
+            bool _done;         // guarded by File::_prefetchLock
+            bool _cancelled;    // ditto
+        private:
+            Prefetch & operator = (Prefetch const &);
+        };
+        typedef std::deque<Prefetch*> PREFETCHQUEUE;
+
         //ntfs::File & operator = (ntfs::File const &) { return *this; } // not allowed
         void Validate() const;
         bool OpenInternal(std::basic_string<u16> const & filename);
+        void OpenStream();
+        bool OpenTree(std::basic_string<u16> const & filename);
+        bool OpenIndex(std::basic_string<u16> const & filename);
+        u8 const * GetCompressionUnit(u64 vcgn);
+        void ReadCompressionUnit(u64 vcgn, u8 * buf, std::vector<u8> & compressBuf);
+        void ClearCache();
+        void SchedulePrefetch(u64 vcgn);
+        bool TakePrefetch(u64 vcgn, std::vector<u8> & data);
+        void CancelPrefetch();
+        void DropPrefetchFront();
 
-        ntfs::Tree & _tree; // can touch Tree private parts because we are friends
+        ntfs::Tree * _tree; // can touch Tree private parts because we are friends, null if none
         ntfs::Ntfs & _ntfs;
+        ntfs::Index _index; // when there is no tree
         ntfs::Node _node;
         ntfs::Stream _stream;
         u64 _pos;
@@ -50,10 +118,35 @@ namespace ntfs
         u32 _clustersPerGroup;
         std::vector<u8> _compressBuf;
 
+        // LRU of decompressed compression units, most recent in front
+        UNITLIST _unitLru;
+        UNITMAP _unitMap;
+        u64 _cacheSize;
+
+        // pipelined read, in ascending unit order
+        ThreadPool * _pool;
+        u32 _readAhead;
+        PREFETCHQUEUE _prefetch;
+        Mutex _prefetchLock;
+        Condition _prefetchDone;
+
         // for caching
         u64 _oldClusterNumber;
         std::vector<u8> _clusterBuf;
     };
+
+    // volume's $Bitmap, a bit per cluster set if in use, read through
+    // its file; returns the count of clusters of the volume it covers
+    u64 ReadClusterBitmap(ntfs::Ntfs & ntfs, std::vector<u8> & bitmap);
+
+    inline bool IsClusterInUse(std::vector<u8> const & bitmap, u64 lcn)
+    {
+        return (bitmap[(size_t)(lcn >> 3)] >> (lcn & 7)) & 1;
+    }
+
+    // end of the run of clusters from lcn all in use, or all free, like
+    // lcn is; limit at most, which must be within the bitmap
+    u64 ClusterRunEnd(std::vector<u8> const & bitmap, u64 lcn, u64 limit);
 }
 
 #endif  // __NTFS_FILE_H
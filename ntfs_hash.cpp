@@ -0,0 +1,280 @@
+//
+// NTFS Hasher
+// Hashes the content of every file stream of a volume, MD5, SHA-1
+// and SHA-256 at once, for a manifest to match against hash sets.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "ntfs_hash.h"
+#include "ntfs_file.h"
+#include "pathname.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace ntfs;
+
+namespace
+{
+    u64 const FIRST_USER_RECORD = 16;           // records below are metafiles
+    size_t const READ_BUFFER_SIZE = 1024 * 1024;  // per File::Read, whole runs of it a disk read each
+
+    // orders items by the value they read first
+    struct ByKey
+    {
+        ByKey(std::vector<u64> const & keys) : _keys(keys) { }
+        bool operator () (u32 a, u32 b) const { return _keys[a] < _keys[b]; }
+        std::vector<u64> const & _keys;
+    };
+}
+
+//=============================================================================
+Hasher::Hasher(ntfs::Ntfs & ntfs, ntfs::Tree & tree)
+: _ntfs(ntfs), _tree(tree), _store(tree.GetStore()), _bytesHashed(0), _poolBytes(0)
+{
+    if (tree.IsLazy())
+        throw std::runtime_error("Hashing needs the whole tree.");
+}
+
+void Hasher::Run(ThreadPool & pool, u64 folderRef)
+{
+    _items.clear();
+    _bytesHashed = 0;
+    Collect(folderRef);
+
+    // non-resident ones go to the pool by their first cluster,
+    // resident ones are done here meanwhile, by their MFT record
+    std::vector<u64> keys(_items.size());
+    std::vector<u32> resident;
+    _queue.clear();
+    for (u32 i = 0; i < _items.size(); ++i)
+    {
+        StreamRecord const & s = _store.GetStream(_items[i].stream);
+        if (s.nonResident && s.realSize > 0)
+        {
+            keys[i] = FirstLcn(i);
+            _queue.push_back(i);
+        }
+        else
+        {
+            keys[i] = s.location;
+            resident.push_back(i);
+        }
+    }
+    std::stable_sort(_queue.begin(), _queue.end(), ByKey(keys));
+    std::stable_sort(resident.begin(), resident.end(), ByKey(keys));
+
+    _poolBytes = 0;
+    Start(pool, _queue.size());
+    try
+    {
+        HashResident(resident);
+    }
+    catch(std::exception & err)
+    {
+        Stop(err.what());   // workers stop after their current one
+    }
+    Wait();
+    _bytesHashed += _poolBytes;
+}
+
+void Hasher::Write(std::ostream & os) const
+{
+    for (size_t i = 0; i < _items.size(); ++i)
+    {
+        Item const & item = _items[i];
+        os << ToHex(item.md5, sizeof(item.md5)) << '\t'
+            << ToHex(item.sha1, sizeof(item.sha1)) << '\t'
+            << ToHex(item.sha256, sizeof(item.sha256)) << '\t'
+            << _store.GetStream(item.stream).realSize << '\t'
+            << item.path << '\n';
+    }
+    os.flush();
+}
+
+//=============================================================================
+void Hasher::Collect(u64 folderRef)
+{
+    u32 folder = _store.Find(folderRef);
+    if (folder == NodeStore::NPOS || !_store[folder].IsDir())
+        throw std::runtime_error("Can't find folder with the given MFT index.");
+
+    // depth first, each folder's files before its sub-folders
+    std::vector<std::pair<u32, std::string> > stack;
+    stack.push_back(std::make_pair(folder, std::string()));
+    while (!stack.empty())
+    {
+        u32 f = stack.back().first;
+        std::string path;
+        path.swap(stack.back().second);
+        stack.pop_back();
+
+        NodeRecord const & fn = _store[f];
+        size_t subs = stack.size();
+        for (u32 const * it = _store.ChildrenBegin(fn); it != _store.ChildrenEnd(fn); ++it)
+        {
+            NodeRecord const & n = _store[*it];
+            if (n.mftRef < FIRST_USER_RECORD)
+                continue;
+            std::string childPath(path);
+            childPath.push_back('/');
+            AppendUtf8(childPath, _store.Name(n.name), n.nameLen);
+            if (n.IsDir())
+            {
+                stack.push_back(std::make_pair(*it, childPath));
+                continue;
+            }
+
+            for (u32 k = n.firstStream; k < n.firstStream + n.streamCount; ++k)
+            {
+                StreamRecord const & s = _store.GetStream(k);
+                _items.push_back(Item());
+                Item & item = _items.back();
+                item.node = *it;
+                item.stream = k;
+                item.path = childPath;
+                if (s.nameLen > 0)
+                {
+                    item.path.push_back(':');
+                    AppendUtf8(item.path, _store.Name(s.name), s.nameLen);
+                }
+            }
+        }
+
+        // sub-folders come off the stack in order
+        std::reverse(stack.begin() + subs, stack.end());
+    }
+}
+
+u64 Hasher::FirstLcn(u32 item) const
+{
+    StreamRecord const & s = _store.GetStream(_items[item].stream);
+    RunRecord const * r = _store.RunsBegin(s);
+    for (u32 k = 0; k < s.runCount; ++k)
+    {
+        if (r[k].lcn != 0)
+            return r[k].lcn;
+    }
+    return 0;   // all sparse, nothing to read
+}
+
+void Hasher::HashResident(std::vector<u32> const & items)
+{
+    TraceSpan span("hash resident", "extract", items.size());
+    std::vector<u8> buf(_ntfs.GetFileRecordSize());
+    FILE_RECORD_HEADER * phdr = (FILE_RECORD_HEADER*)&buf[0];
+
+    // items are sorted by record, the values of one record are hashed in one read
+    for (size_t i = 0; i < items.size(); )
+    {
+        size_t end = i + 1;
+        u64 record = _store.GetStream(_items[items[i]].stream).location;
+        while (end < items.size() && _store.GetStream(_items[items[end]].stream).location == record)
+            ++end;
+
+        // empty streams have nothing to read
+        size_t left = 0;
+        for (size_t k = i; k < end; ++k)
+        {
+            StreamRecord const & s = _store.GetStream(_items[items[k]].stream);
+            if (s.realSize == 0)
+                Digests().Final(_items[items[k]]);
+            else
+                ++left;
+        }
+
+        if (left > 0)
+        {
+            _ntfs.ReadFileRecord(record, phdr);
+            if (phdr->Ntfs.Type != magic_FILE)
+                throw std::runtime_error("Resident stream record is gone.");
+
+            ATTRIBUTE * pattr = (ATTRIBUTE*)P_add(phdr, phdr->AttributesOffset);
+            ATTRIBUTE * pattrEnd = (ATTRIBUTE*)P_add(&buf[0], buf.size());
+            for (; pattr < pattrEnd && pattr->AttributeType != eAttributeTerminator && left > 0; pattr = P_add(pattr, pattr->Length))
+            {
+                if (pattr->AttributeType != eAttributeData || pattr->Nonresident)
+                    continue;
+                ntfs::AttributeData attr;
+                attr.Init((u8*)pattr, pattr->Length);
+                for (size_t k = i; k < end; ++k)
+                {
+                    Item & item = _items[items[k]];
+                    StreamRecord const & s = _store.GetStream(item.stream);
+                    if (s.realSize == 0 || attr._attrName.size() != s.nameLen
+                        || !std::equal(attr._attrName.begin(), attr._attrName.end(), _store.Name(s.name)))
+                        continue;
+                    Digests d;
+                    if (!attr._data.empty())
+                        d.Update(&attr._data[0], attr._data.size());
+                    d.Final(item);
+                    _bytesHashed += attr._data.size();
+                    --left;
+                }
+            }
+            if (left > 0)
+                throw std::runtime_error("Resident stream data is gone.");
+        }
+        i = end;
+    }
+}
+
+void Hasher::HashFile(ntfs::File & file, std::vector<u8> & buf, Item & item)
+{
+    StreamRecord const & s = _store.GetStream(item.stream);
+    TraceSpan span("hash file", "extract", s.realSize);
+    if (!file.OpenNode(item.node, std::basic_string<u16>(_store.Name(s.name), s.nameLen)))
+        throw std::runtime_error("Can't open file to hash: " + item.path);
+
+    Digests d;
+    u64 size = 0;
+    while (!file.Eof())
+    {
+        unsigned long reads = file.Read(&buf[0], buf.size());
+        if (reads == 0)
+            break;
+        d.Update(&buf[0], reads);
+        size += reads;
+    }
+    file.Close();
+    if (size != s.realSize)
+        throw std::runtime_error("Short read of file to hash: " + item.path);
+    d.Final(item);
+}
+
+void Hasher::Work()
+{
+    // own file & buffer, the tree & volume are only read
+    ntfs::File file(_tree);
+    std::vector<u8> buf(READ_BUFFER_SIZE);
+    u64 bytes = 0;
+    size_t i;
+    while (Take(i))
+    {
+        Item & item = _items[_queue[i]];
+        HashFile(file, buf, item);
+        bytes += _store.GetStream(item.stream).realSize;
+    }
+
+    ScopedLock lock(_lock);
+    _poolBytes += bytes;
+}
+
+//=============================================================================
+void Hasher::Digests::Update(void const * data, size_t size)
+{
+    md5.Update(data, size);
+    sha1.Update(data, size);
+    sha256.Update(data, size);
+}
+
+void Hasher::Digests::Final(Item & item)
+{
+    md5.Final(item.md5);
+    sha1.Final(item.sha1);
+    sha256.Final(item.sha256);
+}
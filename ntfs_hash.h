@@ -0,0 +1,92 @@
+//
+// NTFS Hasher
+// Hashes the content of every file stream of a volume, MD5, SHA-1
+// and SHA-256 at once, for a manifest to match against hash sets.
+//
+// Each stream is read once, all three digests fed from the same
+// buffer. Non-resident streams are hashed on a thread pool, taken
+// in ascending LCN order of their first cluster so the reads run
+// mostly forward. Resident streams are hashed straight from their
+// MFT records, each record read once for all the values it holds.
+//
+// NTFS metafiles (records below 16, so $Extend too) are left out.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __NTFS_HASH_H
+#define __NTFS_HASH_H
+
+#include "types.h"
+#include "ntfs.h"
+#include "ntfs_tree.h"
+#include "thread.h"
+#include "hash.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace ntfs
+{
+    class Hasher : private WorkQueue
+    {
+    public:
+        Hasher(ntfs::Ntfs & ntfs, ntfs::Tree & tree);
+
+        // hashes every stream of the files under the given folder
+        void Run(ThreadPool & pool, u64 folderRef = 5);
+
+        // a line per stream in path order:
+        // "md5<TAB>sha1<TAB>sha256<TAB>size<TAB>path[:stream]",
+        // hex digests & UTF-8 path, '/' separated from root
+        void Write(std::ostream & os) const;
+
+        u32 Count() const { return _items.size(); }
+        u64 BytesHashed() const { return _bytesHashed; }
+
+    private:
+        // a stream to hash, and its digests once done
+        struct Item
+        {
+            u32 node;           // index in tree's store
+            u32 stream;         // stream index in tree's store
+            std::string path;
+            u8 md5[Md5::DIGEST_SIZE];
+            u8 sha1[Sha1::DIGEST_SIZE];
+            u8 sha256[Sha256::DIGEST_SIZE];
+        };
+
+        // all three at once
+        struct Digests
+        {
+            Md5 md5;
+            Sha1 sha1;
+            Sha256 sha256;
+            void Update(void const * data, size_t size);
+            void Final(Item & item);
+        };
+
+        Hasher & operator = (Hasher const &);   // not assignable
+        void Collect(u64 folderRef);
+        void HashResident(std::vector<u32> const & items);
+        void HashFile(ntfs::File & file, std::vector<u8> & buf, Item & item);
+        u64 FirstLcn(u32 item) const;
+        void Work();    // per pool thread, hashes non-resident streams of _queue
+
+        ntfs::Ntfs & _ntfs;
+        ntfs::Tree & _tree;
+        ntfs::NodeStore const & _store;
+        std::vector<Item> _items;
+        u64 _bytesHashed;
+
+        // non-resident items in reading order, shared by the workers
+        std::vector<u32> _queue;
+        Mutex _lock;
+        u64 _poolBytes;     // bytes hashed by workers, guarded by _lock
+    };
+}
+
+#endif // __NTFS_HASH_H
@@ -1,8 +1,9 @@
 //
 // NTFS Index
-// Parses the IndexAllocation attributes and
-// reconstruct the files/folders hierarchy.
-// *Currently unused & buggy.
+// Looks up folder entries through the $I30 directory index,
+// descending the B+ tree of $INDEX_ROOT & $INDEX_ALLOCATION
+// in file name collation order, so only the index blocks on
+// the path to the entry are ever read.
 //
 // Author: Derek Saw
 //
@@ -12,8 +13,12 @@
 #include "types.h"
 #include "ntfs_index.h"
 
-#include <map>
-#include <utility>
+#include "stringtok.h"
+
+#include <algorithm>
+#include <set>
+#include <stdexcept>
+#include <string.h>
 
 using namespace ntfs;
 
@@ -54,175 +59,281 @@ char g_attr[] =
 };
 
 
-Index::Index(ntfs::Ntfs & ntfs)
-: _ntfs(ntfs), _mftref(~0ULL)
+namespace
 {
+    // guards against looping index blocks
+    u32 const MAX_INDEX_DEPTH = 64;
+
+    bool IsI30(ATTRIBUTE * pattr)
+    {
+        u16 * name = (u16*)P_add(pattr, pattr->NameOffset);
+        return pattr->NameLength == 4 && name[0] == L'$' && name[1] == L'I' && name[2] == L'3' && name[3] == L'0';
+    }
 }
 
-Index::Index(ntfs::Ntfs & ntfs, u64 mftref)
-: _ntfs(ntfs), _mftref(mftref)
+
+Index::Index(ntfs::Ntfs & ntfs)
+: _ntfs(ntfs), _blocksRead(0), _blockSize(0), _vcnSize(0)
 {
-    Init(_mftref);
 }
 
-void Index::Init(u64 mftref)
+//=============================================================================
+// reads folder record and gets its $I30 index root & allocation
+bool Index::LoadFolder(u64 folderRef)
 {
-
-    std::vector<u8> recbuf(_ntfs.GetFileRecordSize());
-    ntfs::FILE_RECORD_HEADER * precbuf = (ntfs::FILE_RECORD_HEADER*)&recbuf[0];
-
-    _ntfs.ReadFileRecord(mftref, &recbuf[0]);
-    if (precbuf->Ntfs.Type != ntfs::magic_FILE || !(precbuf->Flags & 1))
-        throw std::runtime_error("MFT# is not a valid file or it is unused");
-
-    Clear();
-
-    ntfs::ATTRIBUTE * pattr     = (ntfs::ATTRIBUTE*)P_add(precbuf, precbuf->AttributesOffset);
-    ntfs::ATTRIBUTE * pattrEnd  = (ntfs::ATTRIBUTE*)P_add(&recbuf[0], recbuf.size());
+    _record.resize(_ntfs.GetFileRecordSize());
+    ntfs::FILE_RECORD_HEADER * phdr = (ntfs::FILE_RECORD_HEADER*)&_record[0];
+    _ntfs.ReadFileRecord(folderRef, phdr);
+    if (phdr->Ntfs.Type != ntfs::magic_FILE || (phdr->Flags & 0x3) != 0x3)
+        return false;   // not in used or not a folder
+    if ((folderRef >> MFT_MASK_BITS) != 0 && (folderRef >> MFT_MASK_BITS) != phdr->SequenceNumber)
+        return false;   // stale reference, record reused since
+
+    _root.clear();
+    _alloc.Clear();
+    std::vector<u8> list;
+
+    ntfs::ATTRIBUTE * pattr     = (ntfs::ATTRIBUTE*)P_add(phdr, phdr->AttributesOffset);
+    ntfs::ATTRIBUTE * pattrEnd  = (ntfs::ATTRIBUTE*)P_add(&_record[0], _record.size());
     for (; pattr < pattrEnd && pattr->AttributeType != eAttributeTerminator; pattr = P_add(pattr, pattr->Length))
     {
-        switch (pattr->AttributeType)
+        if (pattr->AttributeType == eAttributeIndexRoot && IsI30(pattr))
         {
-        case eAttributeIndexAllocation:
-            AddFileList(pattr, pattrEnd);
-            break;
-        case eAttributeData:
-            AddDataStream(pattr, pattrEnd);
-            break;
-        default:
-            break;
+            ntfs::AttributeData attr;
+            attr.Init((u8*)pattr, pattr->Length);
+            _root.swap(attr._data);
+        }
+        else if (pattr->AttributeType == eAttributeIndexAllocation && IsI30(pattr))
+        {
+            ntfs::AttributeData attr;
+            attr.Init((u8*)pattr, pattr->Length);
+            _alloc.Init(&attr._data[0], attr._data.size(), attr._startVcn);
+        }
+        else if (pattr->AttributeType == eAttributeAttributeList)
+        {
+            ntfs::AttributeList attr;
+            attr.Init((u8*)pattr, pattr->Length);
+            if (attr._nonResident)
+                throw std::runtime_error("Still don't know how to do non resident attr list.");
+            list.swap(attr._data);
+        }
+    }
+
+    // huge folders have their allocation extents in other records
+    if (_alloc.Empty() && !list.empty())
+    {
+        std::vector<u8> buf(_ntfs.GetFileRecordSize());
+        ntfs::FILE_RECORD_HEADER * pext = (ntfs::FILE_RECORD_HEADER*)&buf[0];
+        ATTRIBUTE_LIST * pListEntry = (ATTRIBUTE_LIST*)&list[0];
+        ATTRIBUTE_LIST * pListEntryEnd = P_add(pListEntry, list.size());
+        for (; pListEntry < pListEntryEnd && pListEntry->Length > 0;
+                pListEntry = P_add(pListEntry, pListEntry->Length))
+        {
+            if (pListEntry->AttributeType != eAttributeIndexAllocation)
+                continue;
+
+            _ntfs.ReadFileRecord(pListEntry->FileReferenceNumber, pext);
+            if (pext->Ntfs.Type != ntfs::magic_FILE || !(pext->Flags & 0x01))
+                continue;
+
+            pattr = (ntfs::ATTRIBUTE*)P_add(pext, pext->AttributesOffset);
+            pattrEnd = (ntfs::ATTRIBUTE*)P_add(&buf[0], buf.size());
+            for (; pattr < pattrEnd && pattr->AttributeType != eAttributeTerminator; pattr = P_add(pattr, pattr->Length))
+            {
+                if (pattr->AttributeType != eAttributeIndexAllocation || !IsI30(pattr))
+                    continue;
+                ntfs::AttributeData attr;
+                attr.Init((u8*)pattr, pattr->Length);
+                if (attr._attrId != pListEntry->AttributeNumber)
+                    continue;
+                if (_alloc.Empty())
+                    _alloc.Init(&attr._data[0], attr._data.size(), attr._startVcn);
+                else
+                    _alloc.Append(&attr._data[0], attr._data.size(), attr._startVcn);
+            }
         }
     }
 
+    if (_root.size() < sizeof(INDEX_ROOT))
+        throw std::runtime_error("Folder without $I30 index root.");
+
+    // index VCNs count clusters, or sectors if blocks are smaller than a cluster
+    INDEX_ROOT * proot = (INDEX_ROOT*)&_root[0];
+    u32 clusterSize = _ntfs.GetBytesPerSector() * _ntfs.GetSectorsPerCluster();
+    _blockSize = proot->BytesPerIndexBlock;
+    _vcnSize = (_blockSize >= clusterSize) ? clusterSize : _ntfs.GetBytesPerSector();
+    return true;
 }
 
 //=============================================================================
-// obtain the filelist from IndexAllocation block with name $I30
-// no idea whether this block could appear twice.
-void Index::AddFileList(ATTRIBUTE * pattr, ATTRIBUTE * /*pattrEnd*/)
+// reads and fixes up a single index block of current folder
+void Index::ReadBlock(u64 vcn)
 {
-    // this is the attr where all the files belongs to this dir is listed
-    if (pattr->AttributeType != eAttributeIndexAllocation)
-        throw std::runtime_error("Non index alloc block passed.");
+    if (_alloc.Empty())
+        throw std::runtime_error("Index block referenced without $INDEX_ALLOCATION.");
 
-    // check for attribute name L"$I30" - do nothing if it is not
-    u16 * name = (u16*)P_add(pattr, pattr->NameOffset);
-    if (pattr->NameLength != 4 || name[0] != L'$' || name[1] != L'I' || name[2] != L'3' || name[3] != L'0')
-        return;
+    u32 clusterSize = _ntfs.GetBytesPerSector() * _ntfs.GetSectorsPerCluster();
+    u64 offset = vcn * _vcnSize;
+    u64 first = offset / clusterSize;
+    u32 within = (u32)(offset % clusterSize);
+    u32 count = (within + _blockSize + clusterSize - 1) / clusterSize;
+    _clusters.resize(count * clusterSize);
 
-    // gets the attribute's data
-    ntfs::AttributeData attr;
-    attr.Init((u8*)pattr, pattr->Length);
-    std::vector<u8> indexAlloc; // accumulated buffer for index_block data
+    for (u32 i = 0; i < count; )
+    {
+        u64 contiguous;
+        u64 lcn = _alloc.Vcn2Lcn(first + i, contiguous);
+        u32 n = (u32)std::min<u64>(contiguous, count - i);
+        if (lcn == 0)
+            throw std::runtime_error("Index block is sparse.");
+        _ntfs.ReadLCN(lcn, n, &_clusters[i * clusterSize]);
+        i += n;
+    }
+    ++_blocksRead;
 
+    _block.assign(_clusters.begin() + within, _clusters.begin() + within + _blockSize);
+    if (!ApplyUpdateSequence(&_block[0], _block.size()))
+        throw std::runtime_error("Can't apply fixup for index block.");
+}
 
-    if (attr._nonResident)
+//=============================================================================
+// $I30 file name collation: upcased code units, shorter name first on a tie
+int Index::Collate(u16 const * a, u32 alen, u16 const * b, u32 blen) const
+{
+    u32 n = std::min(alen, blen);
+    for (u32 i = 0; i < n; ++i)
     {
-        // will be in external cluster (outside of MFT) if non-resident
-
-        // the attr's data is datarun - parse the datarun
-        ntfs::DataRun dr;
-        dr.Init(&attr._data[0], attr._data.size(), attr._startVcn);
+        u16 ua = _ntfs.UpCase(a[i]);
+        u16 ub = _ntfs.UpCase(b[i]);
+        if (ua != ub)
+            return ua < ub ? -1 : 1;
+    }
+    return alen == blen ? 0 : (alen < blen ? -1 : 1);
+}
 
-        // alloc buffers
-        std::vector<u8> buf(_ntfs.GetBytesPerSector() * _ntfs.GetSectorsPerCluster());  // temporary reading buffer
-        indexAlloc.reserve(buf.size());
+//=============================================================================
+bool Index::Find(u64 folderRef, u16 const * name, u32 len, FolderElement & entry)
+{
+    if (!LoadFolder(folderRef))
+        return false;
 
-        // reads and populate indexAlloc
-        u64 startLcn;
-        for (ntfs::DataRun::LIST::iterator it = dr._list.begin(); it != dr._list.end(); ++it)
+    INDEX_ROOT * proot = (INDEX_ROOT*)&_root[0];
+    ntfs::DIRECTORY_INDEX * pindex = &proot->DirectoryIndex;
+    void * pbufEnd = P_add(&_root[0], _root.size());
+    for (u32 depth = 0; depth < MAX_INDEX_DEPTH; ++depth)
+    {
+        // entries are sorted, stop at the first one collating after name
+        ntfs::DIRECTORY_ENTRY * pentry = (ntfs::DIRECTORY_ENTRY*)P_add(pindex, pindex->EntriesOffset);
+        void * pend = std::min(P_add((void*)pindex, pindex->IndexBlockLength), pbufEnd);
+        u64 vcn = ~0ULL;
+        for (; P_add(pentry, 16) <= pend && pentry->Length >= 16; pentry = P_add(pentry, pentry->Length))
         {
-            startLcn = it->offset;
-            for (u64 x = 0; x < it->count; ++x)
+            if (P_add(pentry, pentry->Length) > pend)
+                throw std::runtime_error("Index entry out of range.");
+
+            if (!(pentry->Flags & 0x02))
             {
-                if (startLcn == 0)  // unallocated cluster of sparse file
-                    memset(&buf[0], 0, buf.size());
-                else
-                    _ntfs.ReadLCN(startLcn + x, 1, &buf[0]);
-                indexAlloc.insert(indexAlloc.end(), buf.begin(), buf.end());
+                if ((void*)(pentry->FName.Name + pentry->FName.NameLength) > P_add(pentry, pentry->Length))
+                    throw std::runtime_error("Out of range name reading.");
+                int cmp = Collate(name, len, pentry->FName.Name, pentry->FName.NameLength);
+                if (cmp > 0)
+                    continue;
+                if (cmp == 0)
+                {
+                    entry.mftref = pentry->FileReferenceNumber;
+                    entry.attr = pentry->FName.FileAttributes;
+                    entry.nameType = pentry->FName.NameType;
+                    entry.name.assign(pentry->FName.Name, pentry->FName.Name + pentry->FName.NameLength);
+                    return true;
+                }
             }
+
+            // name sorts before this entry: look in its sub-node, if any
+            if (pentry->Flags & 0x01)
+                vcn = *(u64*)P_add(pentry, pentry->Length - 8);
+            break;
         }
-    }
-    else
-    {
-        // the data itself is the indexalloc data
-        indexAlloc.assign(attr._data.begin(), attr._data.end());
-    }
+        if (vcn == ~0ULL)
+            return false;
 
-    // apply fixup
-    if (!ApplyUpdateSequence(&indexAlloc[0], indexAlloc.size()))
-        throw std::runtime_error("Can't apply fixup for ntfs Folder.");
-    dump("index_alloc.bin", &indexAlloc[0], indexAlloc.size());
+        ReadBlock(vcn);
+        pindex = &((ntfs::INDEX_BLOCK_HEADER*)&_block[0])->DirectoryIndex;
+        pbufEnd = P_add(&_block[0], _block.size());
+    }
+    throw std::runtime_error("Index tree too deep.");
+}
 
-    // iterate through each file entry
-    ntfs::INDEX_BLOCK_HEADER * pibh = (ntfs::INDEX_BLOCK_HEADER*)&indexAlloc[0];
-    ntfs::DIRECTORY_INDEX * pindex = &pibh->DirectoryIndex;
+//=============================================================================
+void Index::ListEntries(ntfs::DIRECTORY_INDEX * pindex, void * pbufEnd, std::vector<FolderElement> & entries, std::vector<u64> & vcns)
+{
     ntfs::DIRECTORY_ENTRY * pentry = (ntfs::DIRECTORY_ENTRY*)P_add(pindex, pindex->EntriesOffset);
-    FILEHASH::iterator it;
-    for (;pentry < (void*)P_add(&indexAlloc[0], indexAlloc.size()) && pentry->AttributeLength > 0; pentry = P_add(pentry, pentry->Length))
+    void * pend = std::min(P_add((void*)pindex, pindex->IndexBlockLength), pbufEnd);
+    for (; P_add(pentry, 16) <= pend && pentry->Length >= 16; pentry = P_add(pentry, pentry->Length))
     {
-        // skipped reserved files
-        if ((pentry->FileReferenceNumber & MFT_MASK) < 16)
-            continue;
+        if (P_add(pentry, pentry->Length) > pend)
+            throw std::runtime_error("Index entry out of range.");
 
-        // adds file to filelist container
-        it = _files.find(pentry->FileReferenceNumber);
-        if (it == _files.end())
-        {
-            FolderElement fe;
-            fe.attr = pentry->FName.FileAttributes;
-            fe.mftref = pentry->FileReferenceNumber;
-            if (pentry->FName.NameType & 0x2) fe.shortname.assign(pentry->FName.Name, pentry->FName.Name + pentry->FName.NameLength);
-            if (pentry->FName.NameType & 0x1) fe.name.assign(pentry->FName.Name, pentry->FName.Name + pentry->FName.NameLength);
-            _files.insert(std::make_pair(pentry->FileReferenceNumber, fe));
-        }
-        else
-        {
-            if (it->second.attr != pentry->FName.FileAttributes) throw std::runtime_error("Attribute not same.");
-            if (it->second.mftref != pentry->FileReferenceNumber) throw std::runtime_error("MFT ref not same.");
-            if (pentry->FName.NameType & 0x2) it->second.shortname.assign(pentry->FName.Name, pentry->FName.Name + pentry->FName.NameLength);
-            if (pentry->FName.NameType & 0x1) it->second.name.assign(pentry->FName.Name, pentry->FName.Name + pentry->FName.NameLength);
-        }
+        if (pentry->Flags & 0x01)
+            vcns.push_back(*(u64*)P_add(pentry, pentry->Length - 8));
+        if (pentry->Flags & 0x02)
+            break;
 
-        //printf("\nf:%x", pentry->Flags);
-        //printf(" L:%-3u(%x)", pentry->Length, pentry->Length);
-        //printf(" aL:%-3u(%x)", pentry->AttributeLength, pentry->AttributeLength);
-        //printf(" #:%-5I64u", pentry->FileReferenceNumber & MFT_MASK);
-        //printf(" p:%-5I64u", pentry->FName.DirectoryFileReferenceNumber & MFT_MASK);
-        //printf(" %c", (pentry->FName.FileAttributes & 0x10000000) ? 'D' : ' ');
-        //printf(" [%x %.*S]", pentry->FName.NameType, pentry->FName.NameLength, pentry->FName.Name);
-        //printf("\n");
+        if ((void*)(pentry->FName.Name + pentry->FName.NameLength) > P_add(pentry, pentry->Length))
+            throw std::runtime_error("Out of range name reading.");
+        FolderElement fe;
+        fe.mftref = pentry->FileReferenceNumber;
+        fe.attr = pentry->FName.FileAttributes;
+        fe.nameType = pentry->FName.NameType;
+        fe.name.assign(pentry->FName.Name, pentry->FName.Name + pentry->FName.NameLength);
+        entries.push_back(fe);
     }
 }
 
 //=============================================================================
-void Index::AddDataStream(ATTRIBUTE * pattr, ATTRIBUTE * /*pattrEnd*/)
+bool Index::List(u64 folderRef, std::vector<FolderElement> & entries)
 {
-    if (pattr->AttributeType != eAttributeData)
-        throw std::runtime_error("Non data block passed.");
-
-    ntfs::AttributeData attr;
-    attr.Init((u8*)pattr, pattr->Length);
-
-    STREAMHASH::iterator it;
-    it = _streams.find(attr._attrName);
-    if (it == _streams.end())
+    entries.clear();
+    if (!LoadFolder(folderRef))
+        return false;
+
+    // breadth first through every sub-node, each block visited at most once
+    std::vector<u64> vcns;
+    std::set<u64> visited;
+    INDEX_ROOT * proot = (INDEX_ROOT*)&_root[0];
+    ListEntries(&proot->DirectoryIndex, P_add(&_root[0], _root.size()), entries, vcns);
+    for (size_t i = 0; i < vcns.size(); ++i)
     {
-        StreamElement se;
-        if (attr._attrName.empty())
-            se.name.push_back(L'?');
-        else
-            se.name = attr._attrName;
-        se.nonresident = attr._nonResident;
-        se.realsize = attr._nonResident ? attr._realSize : attr._attrLen;
-        se.data.swap(attr._data);
-        _streams.insert(std::make_pair(se.name, se));
+        if (!visited.insert(vcns[i]).second)
+            throw std::runtime_error("Index block referenced twice.");
+        ReadBlock(vcns[i]);
+        ntfs::INDEX_BLOCK_HEADER * pibh = (ntfs::INDEX_BLOCK_HEADER*)&_block[0];
+        ListEntries(&pibh->DirectoryIndex, P_add(&_block[0], _block.size()), entries, vcns);
     }
-    else
+    return true;
+}
+
+//=============================================================================
+bool Index::FindPath(std::basic_string<u16> const & path, FolderElement & entry)
+{
+    u16 const s_seps[] = { '\\', '/', 0 };
+    typedef std::basic_string<u16> U16STR;
+
+    // start with root (mft=5)
+    entry.mftref = 5;
+    entry.attr = eFileAttributeDirectory;
+    entry.nameType = 3;
+    entry.name.clear();
+
+    StringTok<U16STR> stoken(path);
+    for (U16STR token = stoken(s_seps); !token.empty(); token = stoken(s_seps))
     {
-        // does it allow duplicate stream name?
-        throw std::runtime_error("Duplicate stream name found.");
+        if (!entry.IsDir())
+            return false;
+        u64 folderRef = entry.mftref;
+        if (!Find(folderRef, token.data(), token.size(), entry))
+            return false;
     }
+    return true;
 }
 
 //=============================================================================
@@ -264,10 +375,3 @@ bool Index::ApplyUpdateSequence(void * buf, u32 /*bufSize*/)
     return false;
 }
 
-//=============================================================================
-void Index::Clear()
-{
-    _files.clear();
-    _streams.clear();
-    _mftref = ~0ULL;
-}
@@ -1,8 +1,9 @@
 //
 // NTFS Index
-// Parses the IndexAllocation attributes and
-// reconstruct the files/folders hierarchy.
-// *Currently unused & buggy.
+// Looks up folder entries through the $I30 directory index,
+// descending the B+ tree of $INDEX_ROOT & $INDEX_ALLOCATION
+// in file name collation order, so only the index blocks on
+// the path to the entry are ever read.
 //
 // Author: Derek Saw
 //
@@ -15,66 +16,63 @@
 #include "ntfs.h"
 
 #include <string>
-#include <map>
 #include <vector>
 
 namespace ntfs
 {
     u32 const eFileAttributeDirectory = 0x10000000;
 
+    // a folder entry as found in $I30, attributes & sizes in
+    // the index are only refreshed lazily by NTFS
     struct FolderElement
     {
-        u64 mftref;
-        u32 attr;   // this is a rough file attribute - might not be up to date
-        std::basic_string<u16> shortname;
+        u64 mftref;     // including sequence number in upper 16 bits
+        u32 attr;       // this is a rough file attribute - might not be up to date
+        u8 nameType;    // 0 = POSIX, 1 = Win32, 2 = DOS, 3 = Win32 & DOS
         std::basic_string<u16> name;
-    };
 
-    struct StreamElement
-    {
-        std::basic_string<u16> name;
-        std::vector<u8> data;   // either datarun (non-resident) or the actual data (resident)
-        u64 realsize;
-        u8 nonresident;
+        bool IsDir() const { return (attr & eFileAttributeDirectory) != 0; }
     };
 
     class Index
     {
     public:
-        typedef std::map<u64, FolderElement> FILEHASH;      // hash by mft ref number
-        typedef std::map<std::basic_string<u16>, StreamElement> STREAMHASH;     // hash by data stream name
-
         Index(ntfs::Ntfs & ntfs);
-        Index(ntfs::Ntfs & ntfs, u64 mftref);
-        void Init(u64 mftref);
-        void Clear();
-
-        // files list - only available when entry is a folder
-        // otherwise it is empty... unless something weird happens?
-        u32 FilesCount() const { return _files.size(); }
-        FILEHASH::iterator FilesBegin() { return _files.begin(); }
-        FILEHASH::iterator FilesEnd() { return _files.end(); }
-        FILEHASH & Files() { return _files; }
-
-        // data streams - only available when entry is a file
-        // must have at least a nameless data stream
-        u32 StreamsCount() const { return _streams.size(); }
-        STREAMHASH::iterator StreamsBegin() { return _streams.begin(); }
-        STREAMHASH::iterator StreamsEnd() { return _streams.end(); }
-        STREAMHASH & Streams() { return _streams; }
+
+        // case-insensitive lookup of name in folder's $I30 index,
+        // returns false if there is no such entry
+        bool Find(u64 folderRef, u16 const * name, u32 len, FolderElement & entry);
+
+        // resolves a path of '\' or '/' separated names from root folder (mft=5),
+        // stream name suffix (":name") is not handled here
+        bool FindPath(std::basic_string<u16> const & path, FolderElement & entry);
+
+        // every entry of folder's $I30 index, in no particular order
+        bool List(u64 folderRef, std::vector<FolderElement> & entries);
+
+        // number of index blocks read so far
+        u64 BlocksRead() const { return _blocksRead; }
 
     private:
         //Index & operator = (Index const &) { return *this; }    // assignment not allowed
 
-        void AddFileList(ATTRIBUTE * pattr, ATTRIBUTE * pattrEnd);
-        void AddDataStream(ATTRIBUTE * pattr, ATTRIBUTE * pattrEnd);
+        bool LoadFolder(u64 folderRef);
+        void ReadBlock(u64 vcn);
+        void ListEntries(ntfs::DIRECTORY_INDEX * pindex, void * pbufEnd, std::vector<FolderElement> & entries, std::vector<u64> & vcns);
+        int Collate(u16 const * a, u32 alen, u16 const * b, u32 blen) const;
         bool ApplyUpdateSequence(void * buf, u32 bufSize);
 
         ntfs::Ntfs & _ntfs;
-        u64 _mftref;
+        u64 _blocksRead;
 
-        FILEHASH _files;
-        STREAMHASH _streams;
+        // current folder's index
+        std::vector<u8> _record;
+        std::vector<u8> _root;      // $INDEX_ROOT value
+        ntfs::DataRun _alloc;       // $INDEX_ALLOCATION data run
+        u32 _blockSize;
+        u32 _vcnSize;               // bytes per index VCN
+        std::vector<u8> _block;
+        std::vector<u8> _clusters;
     };
 }
 
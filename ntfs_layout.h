@@ -115,10 +115,10 @@ namespace ntfs
     } FILE_RECORD_HEADER, *PFILE_RECORD_HEADER; //0x30
 
     typedef struct STANDARD_INFORMATION {
-        u64 CreationTime;
-        u64 ChangeTime;
-        u64 LastWriteTime;
-        u64 LastAccessTime;
+        u64 CreationTime;       // 0x00
+        u64 LastWriteTime;      // 0x08 // data last written
+        u64 ChangeTime;         // 0x10 // MFT record last changed
+        u64 LastAccessTime;     // 0x18
         u32 FileAttributes;
         u32 AlignmentOrReservedOrUnknown[3];
         u32 QuotaId; // NTFS 3.0 only
@@ -197,8 +197,8 @@ namespace ntfs
     typedef struct FILENAME_ATTRIBUTE {
         u64 DirectoryFileReferenceNumber;   // 0x0
         u64 CreationTime;                   // 0x08 // Saved when filename last changed
-        u64 ChangeTime;                     // 0x10 // ditto
-        u64 LastWriteTime;                  // 0x18 // ditto
+        u64 LastWriteTime;                  // 0x10 // ditto
+        u64 ChangeTime;                     // 0x18 // ditto
         u64 LastAccessTime;                 // 0x20 // ditto
         u64 AllocatedSize;                  // 0x28 // ditto
         u64 DataSize;                       // 0x30 // ditto
@@ -0,0 +1,346 @@
+//
+// NTFS Lister
+// Streams the files/folders hierarchy of a Tree out, walking it
+// with an explicit stack & a single reused path buffer, and
+// writing through a large output buffer with no per-line flush.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "ntfs_list.h"
+#include "ntfs_tree.h"
+#include "utf8.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string.h>
+
+using namespace ntfs;
+
+namespace
+{
+    size_t const LIST_BUFFER_SIZE = 1024 * 1024;
+    u32 const LIST_BINARY_VERSION = 1;
+
+    // entry type in binary listing
+    enum EntryType
+    {
+        eEntryEnd       = 0,
+        eEntryFolder    = 1,
+        eEntryStream    = 2,
+    };
+
+    char const HEX_DIGITS[] = "0123456789abcdef";
+}
+
+//=============================================================================
+Lister::Lister(ntfs::Tree & tree, std::ostream & os, ListFormat format)
+: _tree(tree), _os(os), _format(format), _buf(LIST_BUFFER_SIZE), _pos(0)
+{
+}
+
+Lister::~Lister()
+{
+    Flush();
+}
+
+bool Lister::ParseFormat(char const * name, ListFormat & format)
+{
+    if (strcmp(name, "text") == 0)
+        format = eListText;
+    else if (strcmp(name, "tsv") == 0)
+        format = eListTsv;
+    else if (strcmp(name, "jsonl") == 0)
+        format = eListJsonl;
+    else if (strcmp(name, "binary") == 0)
+        format = eListBinary;
+    else
+        return false;
+    return true;
+}
+
+void Lister::List(char const * prefixDir, u64 folderRef)
+{
+    if (_format == eListBinary)
+    {
+        u8 hdr[16] = { 'N', 'T', 'F', 'S', 'L', 'I', 'S', 'T' };
+        for (int i = 0; i < 4; ++i)
+            hdr[8 + i] = (u8)(LIST_BINARY_VERSION >> (8 * i));
+        Put((char const *)hdr, sizeof(hdr));
+    }
+
+    _path.assign(prefixDir);
+    _prev.clear();
+    _stack.clear();
+    _names.clear();
+
+    // depth first, each folder's files before its sub-folders
+    ListFolder(folderRef);
+    while (!_stack.empty())
+    {
+        Pending p = _stack.back();
+        _stack.pop_back();
+        _path.resize(p.parentLen);
+        _path.push_back('\\');
+        _path.append(_names, p.name, std::string::npos);
+        _names.resize(p.name);  // always the last pushed name
+        ListFolder(p.mftRef);
+    }
+
+    if (_format == eListBinary)
+        Put((char)eEntryEnd);
+}
+
+void Lister::Flush()
+{
+    if (_pos > 0)
+        _os.write(&_buf[0], _pos);
+    _pos = 0;
+}
+
+void Lister::ListFolder(u64 mftRef)
+{
+    u32 folder;
+    ntfs::NodeStore const * store = _tree.GetFolder(mftRef, folder);
+    if (store == 0)
+        throw std::runtime_error("Can't find folder with the given MFT index.");
+    ntfs::NodeRecord const & f = (*store)[folder];
+
+    PutFolder(mftRef);
+
+    u32 const * it;
+    for (it = store->ChildrenBegin(f); it != store->ChildrenEnd(f); ++it)
+    {
+        ntfs::NodeRecord const & n = (*store)[*it];
+        if (n.IsDir())
+            continue;
+        for (u32 i = n.firstStream; i < n.firstStream + n.streamCount; ++i)
+            PutStream(*store, n, i);
+    }
+
+    // sub-folders are pushed last to first, so they come off the stack in order.
+    // names are noted down, lazy store may be gone once another folder is loaded
+    size_t len = _path.size();
+    for (it = store->ChildrenEnd(f); it != store->ChildrenBegin(f); )
+    {
+        ntfs::NodeRecord const & n = (*store)[*--it];
+        if (!n.IsDir())
+            continue;
+        Pending p;
+        p.mftRef = n.mftRef;
+        p.parentLen = len;
+        p.name = _names.size();
+        AppendUtf8(_names, store->Name(n.name), n.nameLen);
+        _stack.push_back(p);
+    }
+}
+
+void Lister::PutFolder(u64 mftRef)
+{
+    // drive only prefix gets its root backslash
+    bool root = _path.length() < 3 && (_path.empty() || *_path.rbegin() != '\\');
+    if (root)
+        _path.push_back('\\');
+
+    if (_format == eListText)
+    {
+        Put(_path.data(), _path.size());
+        Put('\n');
+    }
+    else
+    {
+        PutEntry(eEntryFolder, mftRef, 0, _path.size(), 0, 0);
+    }
+
+    if (root)
+        _path.resize(_path.size() - 1);
+}
+
+void Lister::PutStream(ntfs::NodeStore const & store, ntfs::NodeRecord const & n, u32 stream)
+{
+    ntfs::StreamRecord const & s = store.GetStream(stream);
+    _stream.clear();
+    AppendUtf8(_stream, store.Name(s.name), s.nameLen);
+
+    size_t len = _path.size();
+    _path.push_back('\\');
+    AppendUtf8(_path, store.Name(n.name), n.nameLen);
+
+    if (_format == eListText)
+    {
+        Put('\t');
+        Put(_path.data() + len + 1, _path.size() - len - 1);
+        if (!_stream.empty())
+        {
+            Put(':');
+            Put(_stream.data(), _stream.size());
+        }
+        Put('\t');
+        PutNumber(s.realSize);
+        Put('\n');
+    }
+    else
+    {
+        PutEntry(eEntryStream, n.mftRef, s.realSize, _path.size(), _stream.data(), _stream.size());
+    }
+
+    _path.resize(len);
+}
+
+void Lister::PutEntry(u8 type, u64 mftRef, u64 size, size_t pathLen, char const * stream, size_t streamLen)
+{
+    char const * path = _path.data();
+    switch (_format)
+    {
+    case eListTsv:
+        Put(type == eEntryFolder ? 'd' : 'f');
+        Put('\t');
+        PutNumber(mftRef);
+        Put('\t');
+        if (type != eEntryFolder)
+            PutNumber(size);
+        Put('\t');
+        PutEscaped(path, pathLen);
+        if (streamLen > 0)
+        {
+            Put(':');
+            PutEscaped(stream, streamLen);
+        }
+        Put('\n');
+        break;
+
+    case eListJsonl:
+        if (type == eEntryFolder)
+            Put("{\"type\":\"dir\",\"mft\":");
+        else
+            Put("{\"type\":\"file\",\"mft\":");
+        PutNumber(mftRef);
+        Put(",\"path\":\"");
+        PutEscaped(path, pathLen);
+        if (type != eEntryFolder)
+        {
+            Put("\",\"stream\":\"");
+            PutEscaped(stream, streamLen);
+            Put("\",\"size\":");
+            PutNumber(size);
+            Put("}\n");
+        }
+        else
+        {
+            Put("\"}\n");
+        }
+        break;
+
+    case eListBinary:
+        {
+            size_t shared = 0;
+            size_t maxShared = std::min(pathLen, _prev.size());
+            while (shared < maxShared && _prev[shared] == path[shared])
+                ++shared;
+            Put((char)type);
+            PutVarint(mftRef);
+            PutVarint(size);
+            PutVarint(shared);
+            PutVarint(pathLen - shared);
+            PutVarint(streamLen);
+            Put(path + shared, pathLen - shared);
+            Put(stream, streamLen);
+            _prev.assign(path, pathLen);
+        }
+        break;
+
+    default:
+        throw std::runtime_error("Unknown listing format.");
+    }
+}
+
+//=============================================================================
+char * Lister::Reserve(size_t n)
+{
+    if (_pos + n > _buf.size())
+    {
+        Flush();
+        if (n > _buf.size())
+            _buf.resize(n);
+    }
+    return &_buf[_pos];
+}
+
+void Lister::Put(char const * s, size_t n)
+{
+    if (n == 0)
+        return;
+    memcpy(Reserve(n), s, n);
+    _pos += n;
+}
+
+void Lister::PutNumber(u64 x)
+{
+    char tmp[20];
+    char * p = tmp + sizeof(tmp);
+    do
+    {
+        *--p = (char)('0' + x % 10);
+        x /= 10;
+    } while (x != 0);
+    Put(p, tmp + sizeof(tmp) - p);
+}
+
+void Lister::PutVarint(u64 x)
+{
+    char * p = Reserve(10);
+    char * q = p;
+    while (x >= 0x80)
+    {
+        *q++ = (char)(x | 0x80);
+        x >>= 7;
+    }
+    *q++ = (char)x;
+    _pos += q - p;
+}
+
+void Lister::PutEscaped(char const * s, size_t n)
+{
+    // worst case 6 bytes per char, \u00XX
+    char * p = Reserve(6 * n);
+    char * q = p;
+    for (size_t i = 0; i < n; ++i)
+    {
+        u8 c = (u8)s[i];
+        if ((_format == eListJsonl && c == '"') || c == '\\')
+        {
+            // backslashes too, the folder separators in paths, so that
+            // a \xHH of TSV is always a control char
+            *q++ = '\\';
+            *q++ = (char)c;
+        }
+        else if (c < 0x20 || (c == 0x7f && _format == eListTsv))
+        {
+            *q++ = '\\';
+            if (_format == eListJsonl)
+            {
+                *q++ = 'u';
+                *q++ = '0';
+                *q++ = '0';
+            }
+            else
+            {
+                *q++ = 'x';
+            }
+            *q++ = HEX_DIGITS[c >> 4];
+            *q++ = HEX_DIGITS[c & 0xf];
+        }
+        else
+        {
+            *q++ = (char)c;
+        }
+    }
+    _pos += q - p;
+}
+
+void Lister::AppendUtf8(std::string & out, u16 const * s, u32 len)
+{
+    utf8::utf16to8(s, s + len, std::back_inserter(out));
+}
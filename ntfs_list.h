@@ -0,0 +1,99 @@
+//
+// NTFS Lister
+// Streams the files/folders hierarchy of a Tree out, walking it
+// with an explicit stack & a single reused path buffer, and
+// writing through a large output buffer with no per-line flush.
+//
+// Output formats:
+//   - text:   folder path line, then "\tname[:stream]\tsize" per
+//             stream of its files (what Tree::Print always gave)
+//   - tsv:    "type\tmft\tsize\tpath[:stream]" per folder ('d')
+//             and file stream ('f'), backslashes (the folder
+//             separators too) as \\ and control chars as \xHH
+//   - jsonl:  one JSON object per folder and file stream
+//   - binary: "NTFSLIST" u32 version u32 0, then per entry
+//             u8 type (1=folder, 2=file stream) and the LEB128
+//             varints mft, size, shared, suffix, streamLen,
+//             followed by suffix & stream name bytes; the path
+//             is the 1st shared bytes of previous entry's path
+//             plus suffix. a 0 type byte ends the listing.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __NTFS_LIST_H
+#define __NTFS_LIST_H
+
+#include "types.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace ntfs
+{
+    class Tree;
+    class NodeStore;
+    struct NodeRecord;
+
+    enum ListFormat
+    {
+        eListText,
+        eListTsv,
+        eListJsonl,
+        eListBinary,
+    };
+
+    class Lister
+    {
+    public:
+        Lister(ntfs::Tree & tree, std::ostream & os, ListFormat format = eListText);
+        ~Lister();
+
+        // lists folder and everything below it, pathed under prefixDir (UTF-8)
+        void List(char const * prefixDir, u64 folderRef = 5);
+        void Flush();
+
+        // "text", "tsv", "jsonl" or "binary"
+        static bool ParseFormat(char const * name, ListFormat & format);
+
+    private:
+        // a sub-folder still to be listed, name kept in _names
+        struct Pending
+        {
+            u64 mftRef;
+            size_t parentLen;   // length of parent's path
+            size_t name;        // offset of name in _names
+        };
+
+        void ListFolder(u64 mftRef);
+        void PutFolder(u64 mftRef);
+        void PutStream(ntfs::NodeStore const & store, ntfs::NodeRecord const & n, u32 stream);
+        void PutEntry(u8 type, u64 mftRef, u64 size, size_t pathLen, char const * stream, size_t streamLen);
+
+        char * Reserve(size_t n);
+        void Put(char c) { *Reserve(1) = c; ++_pos; }
+        void Put(char const * s, size_t n);
+        template <size_t N> void Put(char const (&s)[N]) { Put(s, N - 1); }    // literal
+        void PutNumber(u64 x);
+        void PutVarint(u64 x);
+        void PutEscaped(char const * s, size_t n);
+        static void AppendUtf8(std::string & out, u16 const * s, u32 len);
+
+        ntfs::Tree & _tree;
+        std::ostream & _os;
+        ListFormat _format;
+        std::vector<char> _buf;
+        size_t _pos;
+
+        std::vector<Pending> _stack;
+        std::string _names;     // names of pending sub-folders
+        std::string _path;      // path of current folder, then of current file
+        std::string _stream;    // current stream name
+        std::string _prev;      // previous entry's path, for binary
+    };
+}
+
+#endif // __NTFS_LIST_H
@@ -0,0 +1,199 @@
+//
+// NTFS Recovery
+// Lists, and extracts, the deleted files of a recovering ntfs::Tree.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "ntfs_recover.h"
+#include "ntfs_file.h"
+#include "pathname.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace ntfs;
+
+namespace
+{
+    size_t const COPY_BUFFER_SIZE = 1024 * 1024;
+
+    char const * const STATUS_NAMES[] = { "intact", "partial", "overwritten" };
+}
+
+//=============================================================================
+Recovery::Recovery(ntfs::Ntfs & ntfs, ntfs::Tree & tree)
+: _ntfs(ntfs), _tree(tree), _bytesWritten(0)
+{
+}
+
+void Recovery::Run()
+{
+    TraceSpan span("recover", "recover");
+    std::vector<u8> bitmap;
+    u64 clusters = ReadClusterBitmap(_ntfs, bitmap);
+
+    _items.clear();
+    NodeStore const & store = _tree.GetStore();
+    for (u32 i = 0; i < store.Size(); ++i)
+    {
+        NodeRecord const & n = store[i];
+        if (!n.IsDeleted())
+            continue;
+
+        Item item;
+        item.node = i;
+        item.stream = NodeStore::NPOS;
+        item.clusters = item.reallocated = 0;
+        item.status = eIntact;
+        if (n.streamCount == 0)
+            _items.push_back(item);
+        for (u32 k = n.firstStream; k < n.firstStream + n.streamCount; ++k)
+        {
+            StreamRecord const & s = store.GetStream(k);
+            item.stream = k;
+            item.clusters = item.reallocated = 0;
+            if (s.nonResident)
+            {
+                RunRecord const * r = store.RunsBegin(s);
+                for (u32 j = 0; j < s.runCount; ++j)
+                {
+                    if (r[j].lcn == 0)
+                        continue;   // sparse
+                    item.clusters += r[j].count;
+                    item.reallocated += CountInUse(bitmap, clusters, r[j].lcn, r[j].count);
+                }
+            }
+            item.status = (item.reallocated == 0) ? eIntact
+                : (item.reallocated < item.clusters) ? ePartial : eOverwritten;
+            _items.push_back(item);
+        }
+    }
+}
+
+void Recovery::Write(std::ostream & os) const
+{
+    NodeStore const & store = _tree.GetStore();
+    for (size_t i = 0; i < _items.size(); ++i)
+    {
+        Item const & item = _items[i];
+        os << STATUS_NAMES[item.status] << '\t' << store[item.node].mftRef << '\t';
+        if (item.stream == NodeStore::NPOS)
+            os << '-';
+        else
+            os << store.GetStream(item.stream).realSize;
+        os << '\t' << item.clusters << '\t' << item.reallocated << '\t' << Path(item) << '\n';
+    }
+    os.flush();
+}
+
+u32 Recovery::Extract(char const * outDir)
+{
+    TraceSpan span("recover extract", "recover");
+    std::string dir(outDir);
+    if (!MakeDir(dir))
+        throw std::runtime_error("Can't create output folder " + dir);
+
+    NodeStore const & store = _tree.GetStore();
+    std::vector<char> buf(COPY_BUFFER_SIZE);
+    u32 written = 0;
+    _bytesWritten = 0;
+    _skipped.clear();
+    for (size_t i = 0; i < _items.size(); ++i)
+    {
+        Item const & item = _items[i];
+        if (item.stream == NodeStore::NPOS || store[item.node].IsDir() || item.status == eOverwritten)
+            continue;
+        StreamRecord const & s = store.GetStream(item.stream);
+
+        // reallocated clusters are read as they are now, the status tells
+        // no output file for a stream that can't be opened, what is left
+        // of a deleted record may not make one any more. an empty stream
+        // has nothing to open, it never counts as open
+        ntfs::File file(_tree);
+        std::string error;
+        try
+        {
+            if (s.realSize > 0 && !file.OpenNode(item.node, std::basic_string<u16>(store.Name(s.name), s.nameLen)))
+                error = "not opened";
+        }
+        catch(std::exception & err)
+        {
+            error = err.what();
+        }
+        if (!error.empty())
+        {
+            _skipped.push_back("Can't open deleted stream to recover: " + Path(item) + " (" + error + ")");
+            continue;
+        }
+        std::string path(dir + "/" + FileName(item));
+        std::ofstream ofs(path.c_str(), std::ios_base::binary | std::ios_base::trunc);
+        if (!ofs.is_open())
+            throw std::runtime_error("Can't create output file " + path);
+        for (u64 left = s.realSize; left > 0; )
+        {
+            unsigned long reads = file.Read(&buf[0], (unsigned long)std::min<u64>(left, buf.size()));
+            if (reads == 0)
+                throw std::runtime_error("Short read of " + path);
+            ofs.write(&buf[0], reads);
+            left -= reads;
+            _bytesWritten += reads;
+        }
+        if (!ofs.good())
+            throw std::runtime_error("Can't write output file " + path);
+        ++written;
+    }
+    return written;
+}
+
+//=============================================================================
+u64 Recovery::CountInUse(std::vector<u8> const & bitmap, u64 clusters, u64 lcn, u64 count) const
+{
+    // clusters past the volume are as good as gone
+    u64 inUse = 0;
+    u64 end = lcn + count;
+    for (u64 c = lcn; c < end; )
+    {
+        if (c >= clusters)
+            return inUse + (end - c);
+        u64 runEnd = ClusterRunEnd(bitmap, c, std::min(end, clusters));
+        if (IsClusterInUse(bitmap, c))
+            inUse += runEnd - c;
+        c = runEnd;
+    }
+    return inUse;
+}
+
+std::string Recovery::Path(Item const & item) const
+{
+    NodeStore const & store = _tree.GetStore();
+    if (item.stream == NodeStore::NPOS)
+        return ToUtf8(store.Path(item.node));
+    return ToUtf8(store.Path(item.node, item.stream));
+}
+
+std::string Recovery::FileName(Item const & item) const
+{
+    // MFT index in front, deleted names need not be unique
+    NodeStore const & store = _tree.GetStore();
+    NodeRecord const & n = store[item.node];
+    std::ostringstream ostr;
+    ostr << n.mftRef << '_';
+    std::string name(ostr.str());
+    if (n.nameLen > 0)
+        AppendSafeName(name, store.Name(n.name), n.nameLen);
+    else
+        AppendSafeName(name, store.Name(n.shortName), n.shortNameLen);
+    StreamRecord const & s = store.GetStream(item.stream);
+    if (s.nameLen > 0)
+    {
+        name.push_back('_');
+        AppendSafeName(name, store.Name(s.name), s.nameLen);
+    }
+    return name;
+}
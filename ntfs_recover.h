@@ -0,0 +1,80 @@
+//
+// NTFS Recovery
+// Lists, and extracts, the deleted files of a recovering ntfs::Tree:
+// those whose MFT records are no longer in use but still intact.
+//
+// A deleted stream's clusters went back to $Bitmap as free, so any
+// of them marked in use again has since been reallocated to another
+// file and no longer holds the deleted data. Resident data lives in
+// the record itself and is always as it was.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __NTFS_RECOVER_H
+#define __NTFS_RECOVER_H
+
+#include "types.h"
+#include "ntfs.h"
+#include "ntfs_tree.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace ntfs
+{
+    class Recovery
+    {
+    public:
+        enum Status
+        {
+            eIntact,        // no cluster reallocated
+            ePartial,       // some clusters reallocated
+            eOverwritten,   // every cluster reallocated
+        };
+
+        // tree must be a recovering one, see ntfs::Tree
+        Recovery(ntfs::Ntfs & ntfs, ntfs::Tree & tree);
+
+        void Run();
+
+        // a line per deleted stream (or folder) in MFT order:
+        // "status<TAB>MFT index<TAB>size<TAB>clusters<TAB>reallocated<TAB>path"
+        void Write(std::ostream & os) const;
+
+        // writes the streams not fully overwritten into folder as
+        // "<MFT index>_<name>[_<stream>]"; returns the count written.
+        // streams that can't be opened are skipped, see Skipped()
+        u32 Extract(char const * outDir);
+
+        size_t Count() const { return _items.size(); }
+        u64 BytesWritten() const { return _bytesWritten; }
+        std::vector<std::string> const & Skipped() const { return _skipped; }  // why, per stream skipped
+
+    private:
+        struct Item
+        {
+            u32 node;
+            u32 stream;         // NPOS for folders & nodes without any
+            u64 clusters;       // allocated, sparse ones not counted
+            u64 reallocated;    // of clusters, in use again
+            Status status;
+        };
+
+        Recovery & operator = (Recovery const &);   // not assignable
+        u64 CountInUse(std::vector<u8> const & bitmap, u64 clusters, u64 lcn, u64 count) const;
+        std::string Path(Item const & item) const;
+        std::string FileName(Item const & item) const;
+
+        ntfs::Ntfs & _ntfs;
+        ntfs::Tree & _tree;
+        std::vector<Item> _items;
+        u64 _bytesWritten;
+        std::vector<std::string> _skipped;
+    };
+}
+
+#endif // __NTFS_RECOVER_H
@@ -0,0 +1,555 @@
+//
+// NTFS Node Store
+// Compact, flat representation of the files/folders hierarchy:
+// fixed size node records, a single UTF-16 name arena addressed
+// by offsets, streams, data runs & timestamps in side tables, and
+// folder children as contiguous ranges of node indices.
+//
+// Children are also hashed by (folder, case-folded name) for both
+// long & DOS names, so path lookup is O(1) per path component.
+//
+// All tables are position independent, so a store can be saved
+// and later used straight from a read-only mapping of the file.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "ntfs_store.h"
+#include "ntfs_tree.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <string.h>
+#include <ostream>
+
+using namespace ntfs;
+
+namespace
+{
+    struct LessMftRef
+    {
+        bool operator () (NodeRecord const & n, u64 mftRef) const { return n.mftRef < mftRef; }
+    };
+
+    template <typename T>
+    T const * Ptr(std::vector<T> const & v) { return v.empty() ? 0 : &v[0]; }
+
+    // saved store starts with this, offsets are from its start & 8 bytes aligned
+    enum StoreSection { eNodes, eStreams, eRuns, eNames, eChildren, eHash, eParent, eTimes, eSectionCount };
+    struct SectionTable
+    {
+        u32 recordSize[eSectionCount];  // layout check
+        u32 reserved;
+        u64 offset[eSectionCount];
+        u64 count[eSectionCount];
+    };
+
+    u64 Align8(u64 x) { return (x + 7) & ~7ULL; }
+}
+
+
+u32 const NodeStore::NPOS;
+
+NodeStore::NodeStore() : _upcase(0)
+{
+    Bind();
+}
+
+void NodeStore::Bind()
+{
+    _pNodes = Ptr(_nodes);
+    _pStreams = Ptr(_streams);
+    _pRuns = Ptr(_runs);
+    _pNames = Ptr(_names);
+    _pChildren = Ptr(_children);
+    _pHash = Ptr(_hash);
+    _pParent = Ptr(_parent);
+    _pTimes = Ptr(_times);
+    _nodeCount = _nodes.size();
+    _streamCount = _streams.size();
+    _runCount = _runs.size();
+    _nameCount = _names.size();
+    _childCount = _children.size();
+    _hashSize = _hash.size();
+    _timeCount = _times.size();
+}
+
+void NodeStore::Clear()
+{
+    _nodes.clear();
+    _streams.clear();
+    _runs.clear();
+    _names.clear();
+    _children.clear();
+    _hash.clear();
+    _parent.clear();
+    _times.clear();
+    Bind();
+}
+
+u32 NodeStore::AddName(std::basic_string<u16> const & name)
+{
+    u32 offset = _names.size();
+    _names.insert(_names.end(), name.begin(), name.end());
+    return offset;
+}
+
+u32 NodeStore::AddName(u16 const * name, u32 len)
+{
+    u32 offset = _names.size();
+    _names.insert(_names.end(), name, name + len);
+    return offset;
+}
+
+u32 NodeStore::AddTimes(TimeRecord const & info, TimeRecord const & name, u16 & flags)
+{
+    // $FILE_NAME times mostly match, only kept when they don't
+    u32 index = _times.size();
+    _times.push_back(info);
+    flags &= ~eNodeNameTimes;
+    if (memcmp(&info, &name, sizeof(TimeRecord)) != 0)
+    {
+        _times.push_back(name);
+        flags |= eNodeNameTimes;
+    }
+    return index;
+}
+
+u32 NodeStore::Add(ntfs::Node const & node)
+{
+    if (!_nodes.empty() && _nodes.back().mftRef >= node.mftRef)
+        throw std::runtime_error("Nodes must be added in ascending MFT order.");
+    if (_nodes.size() >= NPOS || _names.size() + node.name.size() + node.shortname.size() >= NPOS || _times.size() + 2 >= NPOS)
+        throw std::runtime_error("Too much nodes for the node store.");
+
+    NodeRecord n;
+    memset(&n, 0, sizeof(n));
+    n.mftRef = node.mftRef;
+    n.parentRef = node.parentRef;
+    n.attr = node.attr;
+    n.flags = (node.isdir ? eNodeDirectory : 0) | (node.deleted ? eNodeDeleted : 0);
+    n.sequence = node.sequence;
+    n.recordHash = node.recordHash;
+    n.times = AddTimes(node.infoTimes, node.nameTimes, n.flags);
+    n.nameLen = (u16)node.name.size();
+    n.name = AddName(node.name);
+    n.shortNameLen = (u16)node.shortname.size();
+    n.shortName = AddName(node.shortname);
+    n.firstStream = _streams.size();
+    n.streamCount = node.streams.size();
+
+    // streams are kept in the name order of the STREAMS map
+    STREAMS::const_iterator it;
+    for (it = node.streams.begin(); it != node.streams.end(); ++it)
+    {
+        Stream const & s = it->second;
+        StreamRecord sr;
+        memset(&sr, 0, sizeof(sr));
+        sr.realSize = s.realSize;
+        sr.compressSize = s.compressSize;
+        sr.nameLen = (u16)s.name.size();
+        sr.name = AddName(s.name);
+        sr.compressUnitSize = s.compressUnitSize;
+        sr.nonResident = s.nonResident;
+        sr.compressed = s.compressed;
+        sr.firstRun = _runs.size();
+        if (s.nonResident)
+        {
+            // resolve relative offsets into absolute LCNs
+            sr.location = s.dataRun._baseVcn;
+            DataRun::LIST::const_iterator rit;
+            for (rit = s.dataRun._list.begin(); rit != s.dataRun._list.end(); ++rit)
+            {
+                RunRecord r;
+                r.count = rit->count;
+                r.lcn = rit->offset == 0 ? 0 : rit->cumulativeOffset;
+                _runs.push_back(r);
+            }
+            sr.runCount = s.dataRun._list.size();
+        }
+        else
+        {
+            // resident data is re-read from its MFT record on demand
+            sr.location = s.record;
+        }
+        _streams.push_back(sr);
+    }
+
+    _nodes.push_back(n);
+    Bind();
+    return _nodes.size() - 1;
+}
+
+u32 NodeStore::Add(NodeStore const & other, u32 index)
+{
+    NodeRecord const & src = other[index];
+    if (!_nodes.empty() && _nodes.back().mftRef >= src.mftRef)
+        throw std::runtime_error("Nodes must be added in ascending MFT order.");
+    if (_nodes.size() >= NPOS || _names.size() + src.nameLen + src.shortNameLen >= NPOS || _times.size() + 2 >= NPOS)
+        throw std::runtime_error("Too much nodes for the node store.");
+
+    // same record, re-pointed into our own tables; children are left to Link()
+    NodeRecord n = src;
+    n.name = AddName(other.Name(src.name), src.nameLen);
+    n.shortName = AddName(other.Name(src.shortName), src.shortNameLen);
+    n.times = AddTimes(other.InfoTimes(src), other.NameTimes(src), n.flags);
+    n.firstStream = _streams.size();
+    n.firstChild = 0;
+    n.childCount = 0;
+    for (u32 i = 0; i < src.streamCount; ++i)
+    {
+        StreamRecord sr = other.GetStream(src.firstStream + i);
+        RunRecord const * prun = other._pRuns + sr.firstRun;
+        sr.name = AddName(other.Name(sr.name), sr.nameLen);
+        sr.firstRun = _runs.size();
+        _runs.insert(_runs.end(), prun, prun + sr.runCount);
+        _streams.push_back(sr);
+    }
+
+    _nodes.push_back(n);
+    Bind();
+    return _nodes.size() - 1;
+}
+
+void NodeStore::Link(u16 const * upcase)
+{
+    // counting sort of node indices by parent node, keeping MFT order among siblings
+    Bind();
+    std::vector<u32> & parent = _parent;
+    parent.assign(_nodes.size(), NPOS);
+    u32 i;
+    for (i = 0; i < _nodes.size(); ++i)
+    {
+        _nodes[i].firstChild = _nodes[i].childCount = 0;
+        u64 parentRef = _nodes[i].parentRef & MFT_MASK;
+        if (parentRef == _nodes[i].mftRef)    // root
+            continue;
+        parent[i] = Find(parentRef);
+        if (parent[i] == NPOS)
+            continue;
+
+        // the folder's record since reused by another one, orphan too
+        u16 seq = (u16)(_nodes[i].parentRef >> MFT_MASK_BITS);
+        if (seq != 0 && seq != _nodes[parent[i]].sequence)
+            parent[i] = NPOS;
+        else
+            ++_nodes[parent[i]].childCount;
+    }
+
+    u32 offset = 0;
+    for (i = 0; i < _nodes.size(); ++i)
+    {
+        _nodes[i].firstChild = offset;
+        offset += _nodes[i].childCount;
+        _nodes[i].childCount = 0;
+    }
+
+    _children.resize(offset);
+    for (i = 0; i < _nodes.size(); ++i)
+    {
+        if (parent[i] == NPOS)
+            continue;   // orphan, not reachable from root
+        NodeRecord & p = _nodes[parent[i]];
+        _children[p.firstChild + p.childCount++] = i;
+    }
+
+    _upcase = upcase;
+    BuildHash();
+    Bind();
+}
+
+std::basic_string<u16> NodeStore::Path(u32 node) const
+{
+    std::vector<u32> chain;
+    for (u32 i = node; i != NPOS && chain.size() <= _nodeCount; i = _pParent[i])
+        chain.push_back(i);
+
+    std::basic_string<u16> path;
+    NodeRecord const & top = _pNodes[chain.back()];
+    if ((top.parentRef & MFT_MASK) != top.mftRef)
+    {
+        // orphan, under a folder gone or not known
+        path.push_back('?');
+        path.push_back('/');
+        path.append(_pNames + top.name, top.nameLen);
+    }
+    for (size_t i = chain.size() - 1; i-- > 0; )
+    {
+        NodeRecord const & n = _pNodes[chain[i]];
+        path.push_back('/');
+        path.append(_pNames + n.name, n.nameLen);
+    }
+    return path;
+}
+
+std::basic_string<u16> NodeStore::Path(u32 node, u32 stream) const
+{
+    std::basic_string<u16> path(Path(node));
+    StreamRecord const & s = _pStreams[stream];
+    if (s.nameLen > 0)
+        path.append(1, ':').append(_pNames + s.name, s.nameLen);
+    return path;
+}
+
+u32 NodeStore::Hash(u32 folder, u16 const * name, u32 len) const
+{
+    // FNV-1a over folder index & folded name
+    u32 h = 2166136261U;
+    h = (h ^ folder) * 16777619U;
+    for (u32 i = 0; i < len; ++i)
+        h = (h ^ _upcase[name[i]]) * 16777619U;
+    return h;
+}
+
+bool NodeStore::FoldEqual(u16 const * a, u16 const * b, u32 len) const
+{
+    for (u32 i = 0; i < len; ++i)
+        if (a[i] != b[i] && _upcase[a[i]] != _upcase[b[i]])
+            return false;
+    return true;
+}
+
+void NodeStore::InsertHash(u32 hash, u32 node)
+{
+    u32 mask = _hash.size() - 1;
+    u32 i = hash & mask;
+    while (_hash[i].node != NPOS)
+        i = (i + 1) & mask;
+    _hash[i].hash = hash;
+    _hash[i].node = node;
+}
+
+void NodeStore::BuildHash()
+{
+    // keep load factor at most 1/2
+    u32 entries = 0;
+    u32 i;
+    for (i = 0; i < _nodes.size(); ++i)
+        if (_parent[i] != NPOS && !_nodes[i].IsDeleted())
+            entries += _nodes[i].shortNameLen ? 2 : 1;
+    u32 size = 16;
+    while (size < entries * 2)
+        size <<= 1;
+    HashSlot empty = { 0, NPOS };
+    _hash.assign(size, empty);
+
+    // in node order, so duplicates are probed in child order;
+    // deleted ones are not looked up by name, live ones may have taken it
+    for (i = 0; i < _nodes.size(); ++i)
+    {
+        if (_parent[i] == NPOS || _nodes[i].IsDeleted())
+            continue;
+        NodeRecord const & n = _nodes[i];
+        u32 h = Hash(_parent[i], Name(n.name), n.nameLen);
+        InsertHash(h, i);
+        if (n.shortNameLen)
+        {
+            u32 hs = Hash(_parent[i], Name(n.shortName), n.shortNameLen);
+            if (hs != h || n.shortNameLen != n.nameLen || !FoldEqual(Name(n.name), Name(n.shortName), n.nameLen))
+                InsertHash(hs, i);
+        }
+    }
+}
+
+u32 NodeStore::Lookup(u32 folder, u16 const * name, u32 len) const
+{
+    if (_hashSize == 0)
+        return NPOS;
+
+    u32 h = Hash(folder, name, len);
+    u32 mask = _hashSize - 1;
+    u32 folded = NPOS;
+    for (u32 i = h & mask; _pHash[i].node != NPOS; i = (i + 1) & mask)
+    {
+        if (_pHash[i].hash != h || _pParent[_pHash[i].node] != folder)
+            continue;
+
+        NodeRecord const & n = _pNodes[_pHash[i].node];
+        if (n.nameLen == len && FoldEqual(Name(n.name), name, len))
+        {
+            if (std::equal(name, name + len, Name(n.name)))
+                return _pHash[i].node;
+            if (folded == NPOS)
+                folded = _pHash[i].node;
+        }
+        if (n.shortNameLen == len && FoldEqual(Name(n.shortName), name, len))
+        {
+            if (std::equal(name, name + len, Name(n.shortName)))
+                return _pHash[i].node;
+            if (folded == NPOS)
+                folded = _pHash[i].node;
+        }
+    }
+    return folded;
+}
+
+void NodeStore::Save(std::ostream & os) const
+{
+    SectionTable t;
+    memset(&t, 0, sizeof(t));
+    void const * data[eSectionCount] = { _pNodes, _pStreams, _pRuns, _pNames, _pChildren, _pHash, _pParent, _pTimes };
+    t.recordSize[eNodes] = sizeof(NodeRecord);
+    t.recordSize[eStreams] = sizeof(StreamRecord);
+    t.recordSize[eRuns] = sizeof(RunRecord);
+    t.recordSize[eNames] = sizeof(u16);
+    t.recordSize[eChildren] = sizeof(u32);
+    t.recordSize[eHash] = sizeof(HashSlot);
+    t.recordSize[eParent] = sizeof(u32);
+    t.recordSize[eTimes] = sizeof(TimeRecord);
+    t.count[eNodes] = _nodeCount;
+    t.count[eStreams] = _streamCount;
+    t.count[eRuns] = _runCount;
+    t.count[eNames] = _nameCount;
+    t.count[eChildren] = _childCount;
+    t.count[eHash] = _hashSize;
+    t.count[eParent] = _nodeCount;
+    t.count[eTimes] = _timeCount;
+
+    u64 offset = Align8(sizeof(t));
+    int i;
+    for (i = 0; i < eSectionCount; ++i)
+    {
+        t.offset[i] = offset;
+        offset = Align8(offset + t.count[i] * t.recordSize[i]);
+    }
+
+    char const pad[8] = { 0 };
+    os.write((char const *)&t, sizeof(t));
+    os.write(pad, Align8(sizeof(t)) - sizeof(t));
+    for (i = 0; i < eSectionCount; ++i)
+    {
+        u64 bytes = t.count[i] * t.recordSize[i];
+        if (bytes)
+            os.write((char const *)data[i], bytes);
+        os.write(pad, Align8(bytes) - bytes);
+    }
+}
+
+bool NodeStore::Attach(void const * data, u64 size, u16 const * upcase)
+{
+    SectionTable const * t = (SectionTable const *)data;
+    if (((size_t)data & 7) != 0 || size < sizeof(SectionTable))
+        return false;
+    if (t->recordSize[eNodes] != sizeof(NodeRecord) || t->recordSize[eStreams] != sizeof(StreamRecord) ||
+        t->recordSize[eRuns] != sizeof(RunRecord) || t->recordSize[eNames] != sizeof(u16) ||
+        t->recordSize[eChildren] != sizeof(u32) || t->recordSize[eHash] != sizeof(HashSlot) ||
+        t->recordSize[eParent] != sizeof(u32) || t->recordSize[eTimes] != sizeof(TimeRecord))
+        return false;
+    for (int i = 0; i < eSectionCount; ++i)
+    {
+        if ((t->offset[i] & 7) != 0 || t->offset[i] > size || t->count[i] >= NPOS ||
+            t->count[i] * t->recordSize[i] > size - t->offset[i])
+            return false;
+    }
+    if (t->count[eParent] != t->count[eNodes] || (t->count[eHash] & (t->count[eHash] - 1)) != 0)
+        return false;
+
+    Clear();
+    u8 const * base = (u8 const *)data;
+    _pNodes = (NodeRecord const *)(base + t->offset[eNodes]);
+    _pStreams = (StreamRecord const *)(base + t->offset[eStreams]);
+    _pRuns = (RunRecord const *)(base + t->offset[eRuns]);
+    _pNames = (u16 const *)(base + t->offset[eNames]);
+    _pChildren = (u32 const *)(base + t->offset[eChildren]);
+    _pHash = (HashSlot const *)(base + t->offset[eHash]);
+    _pParent = (u32 const *)(base + t->offset[eParent]);
+    _pTimes = (TimeRecord const *)(base + t->offset[eTimes]);
+    _nodeCount = (u32)t->count[eNodes];
+    _streamCount = (u32)t->count[eStreams];
+    _runCount = (u32)t->count[eRuns];
+    _nameCount = (u32)t->count[eNames];
+    _childCount = (u32)t->count[eChildren];
+    _hashSize = (u32)t->count[eHash];
+    _timeCount = (u32)t->count[eTimes];
+    _upcase = upcase;
+    if (!IsConsistent())
+    {
+        Clear();
+        return false;
+    }
+    return true;
+}
+
+bool NodeStore::IsConsistent() const
+{
+    // every index of every table within the table it refers to, in 64 bits
+    // so sums can't wrap; nodes in MFT order for Find()
+    u32 i;
+    for (i = 0; i < _nodeCount; ++i)
+    {
+        NodeRecord const & n = _pNodes[i];
+        if (i > 0 && _pNodes[i - 1].mftRef >= n.mftRef)
+            return false;
+        if ((u64)n.name + n.nameLen > _nameCount || (u64)n.shortName + n.shortNameLen > _nameCount
+            || (u64)n.firstStream + n.streamCount > _streamCount
+            || (u64)n.firstChild + n.childCount > _childCount
+            || (u64)n.times + ((n.flags & eNodeNameTimes) ? 1 : 0) >= _timeCount)
+            return false;
+        if (_pParent[i] != NPOS && _pParent[i] >= _nodeCount)
+            return false;
+    }
+    for (i = 0; i < _streamCount; ++i)
+    {
+        StreamRecord const & s = _pStreams[i];
+        if ((u64)s.name + s.nameLen > _nameCount || (u64)s.firstRun + s.runCount > _runCount)
+            return false;
+    }
+    for (i = 0; i < _childCount; ++i)
+    {
+        if (_pChildren[i] >= _nodeCount)
+            return false;
+    }
+
+    // Lookup() probes till an empty slot, there must be one
+    bool empty = (_hashSize == 0);
+    for (i = 0; i < _hashSize; ++i)
+    {
+        if (_pHash[i].node == NPOS)
+            empty = true;
+        else if (_pHash[i].node >= _nodeCount)
+            return false;
+    }
+    return empty;
+}
+
+u32 NodeStore::Find(u64 mftRef) const
+{
+    NodeRecord const * end = _pNodes + _nodeCount;
+    NodeRecord const * it = std::lower_bound(_pNodes, end, mftRef, LessMftRef());
+    if (it == end || it->mftRef != mftRef)
+        return NPOS;
+    return it - _pNodes;
+}
+
+void NodeStore::GetDataRun(StreamRecord const & s, ntfs::DataRun & dataRun) const
+{
+    dataRun.Clear();
+    dataRun._baseVcn = s.location;
+    dataRun._list.resize(s.runCount);
+
+    // rebuild relative offsets from absolute LCNs, sparse runs stay zero
+    u64 prevLcn = 0;
+    for (u32 i = 0; i < s.runCount; ++i)
+    {
+        RunRecord const & r = _pRuns[s.firstRun + i];
+        DataRunElement & e = dataRun._list[i];
+        e.count = r.count;
+        e.cumulativeOffset = r.lcn ? r.lcn : prevLcn;
+        e.offset = r.lcn ? r.lcn - prevLcn : 0;
+        prevLcn = e.cumulativeOffset;
+    }
+}
+
+u64 NodeStore::MemoryUsage() const
+{
+    return _nodes.capacity() * sizeof(NodeRecord)
+        + _streams.capacity() * sizeof(StreamRecord)
+        + _runs.capacity() * sizeof(RunRecord)
+        + _names.capacity() * sizeof(u16)
+        + _children.capacity() * sizeof(u32)
+        + _hash.capacity() * sizeof(HashSlot)
+        + _parent.capacity() * sizeof(u32)
+        + _times.capacity() * sizeof(TimeRecord);
+}
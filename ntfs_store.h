@@ -0,0 +1,195 @@
+//
+// NTFS Node Store
+// Compact, flat representation of the files/folders hierarchy:
+// fixed size node records, a single UTF-16 name arena addressed
+// by offsets, streams, data runs & timestamps in side tables, and
+// folder children as contiguous ranges of node indices.
+//
+// Children are also hashed by (folder, case-folded name) for both
+// long & DOS names, so path lookup is O(1) per path component.
+//
+// All tables are position independent, so a store can be saved
+// and later used straight from a read-only mapping of the file.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __NTFS_STORE_H
+#define __NTFS_STORE_H
+
+#include "types.h"
+#include "ntfs_datarun.h"
+
+#include <vector>
+#include <string>
+#include <iosfwd>
+
+namespace ntfs
+{
+    struct Node;
+
+    enum NodeFlags
+    {
+        eNodeDirectory  = 0x0001,
+        eNodeDeleted    = 0x0002,   // record no longer in use, recovered from what is left
+        eNodeNameTimes  = 0x0004,   // $FILE_NAME times differ from $STANDARD_INFORMATION's
+    };
+
+    // MACB times of an attribute, in 100ns since 1601 UTC as NTFS keeps
+    // them (0 if unknown), in the order of $STANDARD_INFORMATION
+    struct TimeRecord
+    {
+        u64 created;
+        u64 written;        // data last written
+        u64 changed;        // MFT record last changed
+        u64 accessed;
+    };
+
+    // seconds since 1970 of NTFS time, 0 stays 0
+    inline s64 UnixTime(u64 time)
+    {
+        return time ? (s64)(time / 10000000ULL) - 134774LL * 86400 : 0;
+    }
+
+    // one per file or folder
+    struct NodeRecord
+    {
+        u64 mftRef;         // MFT index of the base record
+        u64 parentRef;      // parent folder's MFT ref, its sequence number in the top 16 bits
+        u32 attr;           // file attributes
+        u32 name;           // offset of long name in name arena
+        u32 shortName;      // offset of DOS name in name arena
+        u16 nameLen;
+        u16 shortNameLen;
+        u32 firstStream;    // index into stream table
+        u32 streamCount;
+        u32 firstChild;     // index into children table (folders only)
+        u32 childCount;
+        u16 flags;          // NodeFlags
+        u16 sequence;       // of the MFT record, so reused records tell apart
+        u32 times;          // index into time table: $STANDARD_INFORMATION's, then $FILE_NAME's if eNodeNameTimes
+        u64 recordHash;     // of the MFT record bytes, equal if unchanged
+
+        bool IsDir() const { return (flags & eNodeDirectory) != 0; }
+        bool IsDeleted() const { return (flags & eNodeDeleted) != 0; }
+    };
+
+    // one per $DATA stream of a node
+    struct StreamRecord
+    {
+        u64 realSize;
+        u64 compressSize;
+        u64 location;       // resident: MFT record holding the value; non-resident: base VCN
+        u32 name;           // offset of stream name in name arena
+        u32 firstRun;       // index into run table
+        u32 runCount;
+        u16 nameLen;
+        u16 compressUnitSize;
+        u8 nonResident;
+        u8 compressed;
+    };
+
+    // one per data run element, lcn = 0 if sparse
+    struct RunRecord
+    {
+        u64 count;
+        u64 lcn;
+    };
+
+    class NodeStore
+    {
+    public:
+        static u32 const NPOS = ~0U;
+
+        NodeStore();
+        void Clear();
+
+        // nodes must be added in ascending MFT order,
+        // then Link() groups them under their parent folders
+        // and hashes their names, folded with the given $UpCase table
+        u32 Add(ntfs::Node const & node);
+        u32 Add(NodeStore const & other, u32 index);    // copy of other's node
+        void Link(u16 const * upcase);
+
+        // writes a linked store out, or uses one written before from memory
+        // that must stay valid (and 8 bytes aligned) as long as the store is used.
+        // one with any index out of its tables' range is not attached
+        void Save(std::ostream & os) const;
+        bool Attach(void const * data, u64 size, u16 const * upcase);
+
+        u32 Size() const { return _nodeCount; }
+        NodeRecord const & operator [] (u32 i) const { return _pNodes[i]; }
+        u32 Find(u64 mftRef) const;
+        u32 Parent(u32 i) const { return _pParent[i]; }     // NPOS for root & orphans
+
+        // '/' separated from the root, "?" in front if not reachable from it
+        std::basic_string<u16> Path(u32 node) const;
+        std::basic_string<u16> Path(u32 node, u32 stream) const;   // ":name" after if named
+
+        // case-insensitive child lookup by long or DOS name, exact case wins
+        // over folded matches among duplicates; returns node index or NPOS.
+        // deleted nodes are left out
+        u32 Lookup(u32 folder, u16 const * name, u32 len) const;
+
+        u32 const * ChildrenBegin(NodeRecord const & n) const { return _pChildren + n.firstChild; }
+        u32 const * ChildrenEnd(NodeRecord const & n) const { return ChildrenBegin(n) + n.childCount; }
+        StreamRecord const & GetStream(u32 i) const { return _pStreams[i]; }
+        RunRecord const * RunsBegin(StreamRecord const & s) const { return _pRuns + s.firstRun; }
+        u16 const * Name(u32 offset) const { return _pNames + offset; }
+        void GetDataRun(StreamRecord const & s, ntfs::DataRun & dataRun) const;
+        TimeRecord const & InfoTimes(NodeRecord const & n) const { return _pTimes[n.times]; }
+        TimeRecord const & NameTimes(NodeRecord const & n) const { return _pTimes[n.times + ((n.flags & eNodeNameTimes) ? 1 : 0)]; }
+
+        // bytes held by the store (not counting an attached mapping)
+        u64 MemoryUsage() const;
+
+    private:
+        // slot of the name hash, node = NPOS if empty
+        struct HashSlot
+        {
+            u32 hash;
+            u32 node;
+        };
+
+        u32 AddName(std::basic_string<u16> const & name);
+        u32 AddName(u16 const * name, u32 len);
+        u32 AddTimes(TimeRecord const & info, TimeRecord const & name, u16 & flags);
+        u32 Hash(u32 folder, u16 const * name, u32 len) const;
+        bool FoldEqual(u16 const * a, u16 const * b, u32 len) const;
+        void BuildHash();
+        void InsertHash(u32 hash, u32 node);
+        void Bind();
+        bool IsConsistent() const;
+
+        std::vector<NodeRecord> _nodes;
+        std::vector<StreamRecord> _streams;
+        std::vector<RunRecord> _runs;
+        std::vector<u16> _names;
+        std::vector<u32> _children;
+        std::vector<HashSlot> _hash;    // open addressing, power of 2 sized
+        std::vector<u32> _parent;       // parent node index of each node
+        std::vector<TimeRecord> _times;
+        u16 const * _upcase;
+
+        // the tables in use, either the vectors above or attached memory
+        NodeRecord const * _pNodes;
+        StreamRecord const * _pStreams;
+        RunRecord const * _pRuns;
+        u16 const * _pNames;
+        u32 const * _pChildren;
+        HashSlot const * _pHash;
+        u32 const * _pParent;
+        TimeRecord const * _pTimes;
+        u32 _nodeCount;     // records in each table in use, parents as many as nodes
+        u32 _streamCount;
+        u32 _runCount;
+        u32 _nameCount;
+        u32 _childCount;
+        u32 _hashSize;
+        u32 _timeCount;
+    };
+}
+
+#endif // __NTFS_STORE_H
@@ -0,0 +1,277 @@
+//
+// NTFS Timeline
+// Orders the MACB times of every file & folder of a Tree into a
+// single timeline, through an external sort.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "ntfs_timeline.h"
+#include "pathname.h"
+#include "trace.h"
+
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+
+using namespace ntfs;
+
+namespace
+{
+    u64 const TICKS_PER_SECOND = 10000000ULL;
+    u64 const TICKS_PER_DAY = 86400ULL * TICKS_PER_SECOND;
+    s64 const DAYS_1601_TO_1970 = 134774;
+
+    char const MACB_LETTERS[] = "macb";
+    char const * const SOURCE_NAMES[] = { "SI", "FN" };
+
+    // "YYYY-MM-DD hh:mm:ss.fffffff" UTC of NTFS time
+    void FormatTime(u64 time, char * out)
+    {
+        // civil date of days since 1970, proleptic Gregorian
+        s64 z = (s64)(time / TICKS_PER_DAY) - DAYS_1601_TO_1970 + 719468;
+        u64 ticks = time % TICKS_PER_DAY;
+        s64 era = (z >= 0 ? z : z - 146096) / 146097;
+        s64 doe = z - era * 146097;
+        s64 yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        s64 doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        s64 mp = (5 * doy + 2) / 153;
+        s64 day = doy - (153 * mp + 2) / 5 + 1;
+        s64 month = mp < 10 ? mp + 3 : mp - 9;
+        s64 year = yoe + era * 400 + (month <= 2 ? 1 : 0);
+
+        u64 secs = ticks / TICKS_PER_SECOND;
+        sprintf(out, "%04d-%02d-%02d %02d:%02d:%02d.%07d", (int)year, (int)month, (int)day,
+            (int)(secs / 3600), (int)(secs / 60 % 60), (int)(secs % 60), (int)(ticks % TICKS_PER_SECOND));
+    }
+
+    void AppendNumber(std::string & out, s64 x)
+    {
+        char buf[24];
+        sprintf(buf, "%lld", (long long)x);
+        out += buf;
+    }
+
+    void AppendCsv(std::string & out, std::string const & s)
+    {
+        out.push_back('"');
+        for (size_t i = 0; i < s.size(); ++i)
+        {
+            if (s[i] == '"')
+                out.push_back('"');
+            out.push_back(s[i]);
+        }
+        out.push_back('"');
+    }
+
+    void AppendJson(std::string & out, std::string const & s)
+    {
+        static char const HEX_DIGITS[] = "0123456789abcdef";
+        out.push_back('"');
+        for (size_t i = 0; i < s.size(); ++i)
+        {
+            u8 c = (u8)s[i];
+            if (c == '"' || c == '\\')
+            {
+                out.push_back('\\');
+                out.push_back((char)c);
+            }
+            else if (c < 0x20)
+            {
+                out += "\\u00";
+                out.push_back(HEX_DIGITS[c >> 4]);
+                out.push_back(HEX_DIGITS[c & 0xf]);
+            }
+            else
+            {
+                out.push_back((char)c);
+            }
+        }
+        out.push_back('"');
+    }
+}
+
+u64 const Timeline::DEFAULT_MEMORY;
+
+//=============================================================================
+Timeline::Timeline(ntfs::Tree & tree, TimelineFormat format, u64 memoryBudget)
+: _tree(tree), _format(format), _memoryBudget(memoryBudget), _count(0), _spilled(0)
+{
+    if (tree.IsLazy())
+        throw std::runtime_error("Timeline needs the whole tree.");
+}
+
+bool Timeline::ParseFormat(char const * name, TimelineFormat & format)
+{
+    if (strcmp(name, "body") == 0)
+        format = eTimelineBody;
+    else if (strcmp(name, "csv") == 0)
+        format = eTimelineCsv;
+    else if (strcmp(name, "jsonl") == 0)
+        format = eTimelineJsonl;
+    else
+        return false;
+    return true;
+}
+
+void Timeline::Write(std::ostream & os)
+{
+    SORTER sorter(_memoryBudget);
+    {
+        TraceSpan span("timeline collect", "timeline");
+        NodeStore const & store = _tree.GetStore();
+        for (u32 i = 0; i < store.Size(); ++i)
+        {
+            NodeRecord const & n = store[i];
+            AddEvents(sorter, i, eInfo, store.InfoTimes(n));
+            if (n.flags & eNodeNameTimes)
+                AddEvents(sorter, i, eName, store.NameTimes(n));
+        }
+        sorter.Sort();
+    }
+
+    TraceSpan span("timeline write", "timeline", sorter.Count());
+    if (_format == eTimelineCsv)
+        os << "time,macb,source,mft,size,path\n";
+    Event e;
+    while (sorter.Next(e))
+        WriteEvent(os, e);
+    os.flush();
+    _count = sorter.Count();
+    _spilled = sorter.Spilled();
+}
+
+//=============================================================================
+void Timeline::AddEvents(SORTER & sorter, u32 node, u8 source, TimeRecord const & times)
+{
+    u64 const t[4] = { times.written, times.accessed, times.changed, times.created };
+    Event e;
+    memset(&e, 0, sizeof(e));   // raw bytes go to the sort's files
+    e.node = node;
+    e.source = source;
+
+    // bodyfile lists all four times on a line, at the earliest of them
+    if (_format == eTimelineBody)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            if (t[i] != 0 && (e.macb == 0 || t[i] < e.time))
+                e.time = t[i];
+            if (t[i] != 0)
+                e.macb |= (u8)(1 << i);
+        }
+        if (e.macb != 0)
+            sorter.Add(e);
+        return;
+    }
+
+    // one event per distinct time, with the letters of all equal to it
+    for (int i = 0; i < 4; ++i)
+    {
+        if (t[i] == 0)
+            continue;
+        bool seen = false;
+        for (int k = 0; k < i && !seen; ++k)
+            seen = (t[k] == t[i]);
+        if (seen)
+            continue;
+        e.time = t[i];
+        e.macb = 0;
+        for (int k = i; k < 4; ++k)
+            if (t[k] == t[i])
+                e.macb |= (u8)(1 << k);
+        sorter.Add(e);
+    }
+}
+
+void Timeline::WriteEvent(std::ostream & os, Event const & e)
+{
+    NodeStore const & store = _tree.GetStore();
+    NodeRecord const & n = store[e.node];
+    std::basic_string<u16> path(store.Path(e.node));
+    _path.clear();
+    AppendUtf8(_path, path.data(), path.size());
+    if (_path.empty())
+        _path = "/";    // root
+
+    _line.clear();
+    if (_format == eTimelineBody)
+    {
+        // MD5|name|inode|mode|UID|GID|size|atime|mtime|ctime|crtime
+        TimeRecord const & t = (e.source == eName) ? store.NameTimes(n) : store.InfoTimes(n);
+        _line += "0|";
+        _line += _path;
+        if (e.source == eName)
+            _line += " ($FILE_NAME)";
+        _line.push_back('|');
+        AppendNumber(_line, (s64)n.mftRef);
+        _line += n.IsDir() ? "|d/drwxrwxrwx|0|0|" : "|r/rrwxrwxrwx|0|0|";
+        AppendNumber(_line, (s64)FileSize(n));
+        _line.push_back('|');
+        AppendNumber(_line, UnixTime(t.accessed));
+        _line.push_back('|');
+        AppendNumber(_line, UnixTime(t.written));
+        _line.push_back('|');
+        AppendNumber(_line, UnixTime(t.changed));
+        _line.push_back('|');
+        AppendNumber(_line, UnixTime(t.created));
+        _line.push_back('\n');
+        os.write(_line.data(), _line.size());
+        return;
+    }
+
+    char time[40];
+    FormatTime(e.time, time);
+    char macb[5];
+    for (int i = 0; i < 4; ++i)
+        macb[i] = (e.macb & (1 << i)) ? MACB_LETTERS[i] : '.';
+    macb[4] = 0;
+
+    if (_format == eTimelineCsv)
+    {
+        _line += time;
+        _line.push_back(',');
+        _line += macb;
+        _line.push_back(',');
+        _line += SOURCE_NAMES[e.source];
+        _line.push_back(',');
+        AppendNumber(_line, (s64)n.mftRef);
+        _line.push_back(',');
+        AppendNumber(_line, (s64)FileSize(n));
+        _line.push_back(',');
+        AppendCsv(_line, _path);
+    }
+    else
+    {
+        _line += "{\"time\":\"";
+        _line += time;
+        _line += "\",\"macb\":\"";
+        _line += macb;
+        _line += "\",\"source\":\"";
+        _line += SOURCE_NAMES[e.source];
+        _line += "\",\"mft\":";
+        AppendNumber(_line, (s64)n.mftRef);
+        _line += ",\"size\":";
+        AppendNumber(_line, (s64)FileSize(n));
+        _line += ",\"path\":";
+        AppendJson(_line, _path);
+        _line.push_back('}');
+    }
+    _line.push_back('\n');
+    os.write(_line.data(), _line.size());
+}
+
+u64 Timeline::FileSize(NodeRecord const & n) const
+{
+    // of the unnamed stream, folders have none
+    NodeStore const & store = _tree.GetStore();
+    for (u32 k = n.firstStream; k < n.firstStream + n.streamCount; ++k)
+    {
+        StreamRecord const & s = store.GetStream(k);
+        if (s.nameLen == 0)
+            return s.realSize;
+    }
+    return 0;
+}
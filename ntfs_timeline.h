@@ -0,0 +1,95 @@
+//
+// NTFS Timeline
+// Orders the MACB times of every file & folder of a Tree, both of
+// their $STANDARD_INFORMATION and (where different) of the $FILE_NAME
+// their name is from, into a single timeline.
+//
+// Events go through an external sort bounded by a memory budget, so
+// volumes with tens of millions of them are no trouble. Equal times
+// of the same node & attribute make one event with all their letters.
+//
+// Output formats:
+//   - body:  TSK 3 bodyfile, a line per node & attribute (the latter
+//            with " ($FILE_NAME)" after the path) in order of its
+//            earliest time, times in seconds since 1970
+//   - csv:   "time,macb,source,mft,size,path" per event, header first
+//   - jsonl: one JSON object per event
+// Times other than bodyfile's are UTC, "YYYY-MM-DD hh:mm:ss.fffffff".
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __NTFS_TIMELINE_H
+#define __NTFS_TIMELINE_H
+
+#include "types.h"
+#include "ntfs_tree.h"
+#include "extsort.h"
+
+#include <iostream>
+#include <string>
+
+namespace ntfs
+{
+    enum TimelineFormat
+    {
+        eTimelineBody,
+        eTimelineCsv,
+        eTimelineJsonl,
+    };
+
+    class Timeline
+    {
+    public:
+        static u64 const DEFAULT_MEMORY = 256 * 1024 * 1024;
+
+        // memory budget is for sorting, the tree's own not counted
+        Timeline(ntfs::Tree & tree, TimelineFormat format = eTimelineCsv, u64 memoryBudget = DEFAULT_MEMORY);
+
+        void Write(std::ostream & os);
+
+        u64 Count() const { return _count; }
+        u32 Spilled() const { return _spilled; }
+
+        // "body", "csv" or "jsonl"
+        static bool ParseFormat(char const * name, TimelineFormat & format);
+
+    private:
+        enum Source { eInfo, eName };
+
+        struct Event
+        {
+            u64 time;
+            u32 node;
+            u8 source;
+            u8 macb;    // 1 = modified, 2 = accessed, 4 = changed, 8 = born
+            bool operator < (Event const & other) const
+            {
+                if (time != other.time)
+                    return time < other.time;
+                if (node != other.node)
+                    return node < other.node;
+                return source < other.source;
+            }
+        };
+
+        typedef ExternalSorter<Event> SORTER;
+
+        Timeline & operator = (Timeline const &);   // not assignable
+        void AddEvents(SORTER & sorter, u32 node, u8 source, TimeRecord const & times);
+        void WriteEvent(std::ostream & os, Event const & e);
+        u64 FileSize(NodeRecord const & n) const;
+
+        ntfs::Tree & _tree;
+        TimelineFormat _format;
+        u64 _memoryBudget;
+        u64 _count;
+        u32 _spilled;
+        std::string _path;
+        std::string _line;
+    };
+}
+
+#endif // __NTFS_TIMELINE_H
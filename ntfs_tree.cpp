@@ -3,6 +3,9 @@
 // Parses the entire $MFT file and
 // reconstructs files and folders hierarchy.
 //
+// The hierarchy is kept in a compact ntfs::NodeStore, Node and
+// Stream are only materialized on demand (e.g. by ntfs::File).
+//
 // Author: Derek Saw
 //
 // Copyright (c) 2009. All rights reserved.
@@ -10,15 +13,181 @@
 
 #include "ntfs_tree.h"
 
+#include "ntfs_list.h"
 #include "utf8.h"
+#include "trace.h"
+
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
 
 
 using namespace ntfs;
 
-Tree::Tree(ntfs::Ntfs & ntfs)
-: _ntfs(ntfs)
+namespace
+{
+    // default budget for folders loaded by lazy tree
+    u64 const DEFAULT_CACHE_SIZE = 64 * 1024 * 1024;
+
+    // records per traced span of the MFT scan
+    u64 const MFT_TRACE_BATCH = 1024;
+
+    // names of a folder's child as listed in the folder's index
+    struct ChildNames
+    {
+        u64 ref;
+        std::basic_string<u16> name;
+        std::basic_string<u16> shortname;
+    };
+
+    // snapshot file starts with this, the node store follows at storeOffset
+    struct SnapshotHeader
+    {
+        char magic[8];          // "NTFSTREE"
+        u32 version;
+        u32 byteOrder;          // 0x01020304 as written by the host
+        u64 volumeSerial;
+        s64 mftLsn;
+        u64 mftSize;
+        u64 imageId;
+        u64 storeOffset;
+        u64 storeSize;
+    };
+    char const SNAPSHOT_MAGIC[8] = { 'N', 'T', 'F', 'S', 'T', 'R', 'E', 'E' };
+    u32 const SNAPSHOT_VERSION = 3;
+    u32 const SNAPSHOT_BYTE_ORDER = 0x01020304;
+}
+
+Tree::Tree(ntfs::Ntfs & ntfs, bool lazy, bool recover)
+: _ntfs(ntfs), _lazy(lazy), _recover(recover), _clustersBuilt(false), _index(ntfs), _cacheSize(DEFAULT_CACHE_SIZE), _cacheUsed(0)
+{
+    if (!_lazy)
+        Init();
+}
+
+Tree::Tree(ntfs::Ntfs & ntfs, char const * snapshotFile, u64 imageId)
+: _ntfs(ntfs), _lazy(false), _recover(false), _clustersBuilt(false), _index(ntfs), _cacheSize(DEFAULT_CACHE_SIZE), _cacheUsed(0)
 {
-    Init();
+    if (!LoadSnapshot(snapshotFile, imageId))
+    {
+        Init();
+        SaveSnapshot(snapshotFile, imageId);    // best effort, it is only a cache
+    }
+}
+
+Tree::Tree(ntfs::Ntfs & ntfs, Tree const & base, char const * snapshotFile, u64 imageId)
+: _ntfs(ntfs), _lazy(false), _recover(false), _clustersBuilt(false), _index(ntfs), _cacheSize(DEFAULT_CACHE_SIZE), _cacheUsed(0)
+{
+    if (snapshotFile && LoadSnapshot(snapshotFile, imageId))
+        return;
+
+    if (base._lazy)
+    {
+        Init();     // nothing to patch from
+    }
+    else
+    {
+        std::vector<ntfs::Ntfs*> layers(1, &_ntfs);
+        std::vector<bool> changed;
+        FindChangedRecords(layers, changed);
+        Patch(base, changed);
+    }
+    if (snapshotFile)
+        SaveSnapshot(snapshotFile, imageId);
+}
+
+Tree::Tree(ntfs::Ntfs & ntfs, Tree const & base, std::vector<bool> const & changed)
+: _ntfs(ntfs), _lazy(false), _recover(false), _clustersBuilt(false), _index(ntfs), _cacheSize(DEFAULT_CACHE_SIZE), _cacheUsed(0)
+{
+    if (base._lazy)
+        Init();
+    else
+        Patch(base, changed);
+}
+
+bool Tree::LoadSnapshot(char const * snapshotFile, u64 imageId)
+{
+    TraceSpan span("load snapshot", "tree");
+    if (!_snapshot.Open(snapshotFile))
+        return false;
+
+    SnapshotHeader const * phdr = (SnapshotHeader const *)_snapshot.Data();
+    if (_snapshot.Size() < sizeof(SnapshotHeader) ||
+        memcmp(phdr->magic, SNAPSHOT_MAGIC, sizeof(phdr->magic)) != 0 ||
+        phdr->version != SNAPSHOT_VERSION ||
+        phdr->byteOrder != SNAPSHOT_BYTE_ORDER ||
+        phdr->volumeSerial != _ntfs.GetVolumeSerial() ||
+        phdr->mftLsn != _ntfs.GetMftLsn() ||
+        phdr->mftSize != _ntfs.GetMftSize() ||
+        phdr->imageId != imageId ||
+        phdr->storeOffset > _snapshot.Size() ||
+        phdr->storeSize > _snapshot.Size() - phdr->storeOffset ||
+        !_store.Attach(P_add(_snapshot.Data(), phdr->storeOffset), phdr->storeSize, _ntfs.GetUpCase()))
+    {
+        _store.Clear();
+        _snapshot.Close();
+        return false;
+    }
+
+    // verify root folder must exists
+    u32 root = _store.Find(5);
+    if (root == NodeStore::NPOS || !_store[root].IsDir())
+    {
+        _store.Clear();
+        _snapshot.Close();
+        return false;
+    }
+    return true;
+}
+
+bool Tree::SaveSnapshot(char const * snapshotFile, u64 imageId) const
+{
+    if (_lazy)
+        return false;
+
+    // write aside then rename, so readers never map a partial file
+    std::string tmpFile(snapshotFile);
+    tmpFile.append(".tmp");
+    {
+        std::ofstream ofs(tmpFile.c_str(), std::ios_base::binary | std::ios_base::trunc);
+        if (!ofs.is_open())
+            return false;
+
+        SnapshotHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+        hdr.version = SNAPSHOT_VERSION;
+        hdr.byteOrder = SNAPSHOT_BYTE_ORDER;
+        hdr.volumeSerial = _ntfs.GetVolumeSerial();
+        hdr.mftLsn = _ntfs.GetMftLsn();
+        hdr.mftSize = _ntfs.GetMftSize();
+        hdr.imageId = imageId;
+        hdr.storeOffset = (sizeof(hdr) + 7) & ~7ULL;
+
+        char const pad[8] = { 0 };
+        ofs.write((char const *)&hdr, sizeof(hdr));
+        ofs.write(pad, hdr.storeOffset - sizeof(hdr));
+        _store.Save(ofs);
+        hdr.storeSize = (u64)ofs.tellp() - hdr.storeOffset;
+        ofs.seekp(0);
+        ofs.write((char const *)&hdr, sizeof(hdr));
+        if (!ofs.good())
+        {
+            ofs.close();
+            remove(tmpFile.c_str());
+            return false;
+        }
+    }
+
+#ifdef _MSC_VER
+    remove(snapshotFile);   // rename doesn't replace on Win32
+#endif
+    if (rename(tmpFile.c_str(), snapshotFile) != 0)
+    {
+        remove(tmpFile.c_str());
+        return false;
+    }
+    return true;
 }
 
 
@@ -42,66 +211,191 @@ void Tree::Init()
         throw std::runtime_error("Too much MFT entries.");
 
     std::vector<u8> buf(_ntfs.GetFileRecordSize());
+
+    // root folder goes first, then every in used record in MFT order
+    // (and every intact unused one too when recovering)
+    {
+        TraceSpan span("mft scan", "tree", n);
+        if (!AddRecord(5, buf) || !_store[0].IsDir())
+            throw std::runtime_error("Missing root folders.");
+        for (u64 i = 16; i < n; )     // 16 is the 1st non-special file records
+        {
+            // traced a batch of records at a time
+            TraceSpan batch("mft batch", "tree", i);
+            for (u64 end = std::min<u64>(i + MFT_TRACE_BATCH, n); i < end; ++i)
+                AddRecord(i, buf);
+        }
+    }
+
+    // groups nodes under their parent folders
+    TraceSpan span("link", "tree", _store.Size());
+    _store.Link(_ntfs.GetUpCase());
+    //printf("Total file records: %llu\n", n);
+    //printf("In used file records: %u\n", _store.Size());
+    //printf("Node store: %llu bytes\n", _store.MemoryUsage());
+}
+
+void Tree::FindChangedRecords(std::vector<ntfs::Ntfs*> const & layers, std::vector<bool> & changed)
+{
+    ntfs::Ntfs & top = *layers.front();
+    u64 n = top.GetMftSize() / top.GetFileRecordSize();
+    if (n > MFT_MASK)
+        throw std::runtime_error("Too much MFT entries.");
+
+    std::vector<u8> buf(top.GetFileRecordSize());
     ntfs::FILE_RECORD_HEADER * phdr = (ntfs::FILE_RECORD_HEADER*)&buf[0];
-    ntfs::FILE_RECORD_HEADER * phdrEnd = (ntfs::FILE_RECORD_HEADER*)P_add(&buf[0], buf.size());
-    u64 count = 0;
-    for(u64 i = 16; i < n; ++i)     // 16 is the 1st non-special file records
+
+    // records in sectors of these images may differ from base, where a changed
+    // extension record (of attribute list) also changes its base record's node
+    TraceSpan span("find changed records", "tree", n);
+    changed.assign((size_t)n, false);
+    for (size_t k = 0; k < layers.size(); ++k)
+        layers[k]->MarkOwnedRecords(changed);
+    for (u64 i = 16; i < n; ++i)
     {
-        _ntfs.ReadFileRecord(i, phdr);
-        if (phdr->Ntfs.Type != magic_FILE || !(phdr->Flags & 0x3))
+        if (!changed[(size_t)i])
             continue;
+        top.ReadFileRecord(i, phdr);
+        u64 baseRef = phdr->BaseFileRecord & MFT_MASK;
+        if (phdr->Ntfs.Type == magic_FILE && baseRef != 0 && baseRef < n)
+            changed[(size_t)baseRef] = true;
+    }
+}
 
-        // create node
-        ntfs::Node node;
-        node.mftRef = i; //phdr->BaseFileRecord & MFT_MASK;
-        node.isdir = ((phdr->Flags & 0x2) == 0x2);
-        if (node.isdir)
-            _folders.insert(std::make_pair(node.mftRef, NODES()));
+void Tree::Patch(Tree const & base, std::vector<bool> const & changed)
+{
+    u64 n = _ntfs.GetMftSize() / _ntfs.GetFileRecordSize();
+    if (n > MFT_MASK)
+        throw std::runtime_error("Too much MFT entries.");
+    if (changed.size() < n)
+        throw std::runtime_error("Changed records don't cover the MFT.");
+
+    TraceSpan merge("merge with base", "tree", n);
+    std::vector<u8> buf(_ntfs.GetFileRecordSize());
+    u64 i;
+
+    // merge re-read records with the rest of base, both in MFT order
+    ntfs::NodeStore const & from = base._store;
+    u32 b = from.Find(5);
+    if (changed[5])
+        AddRecord(5, buf);
+    else if (b != NodeStore::NPOS)
+        _store.Add(from, b);
+    if (_store.Size() == 0 || !_store[0].IsDir())
+        throw std::runtime_error("Missing root folders.");
 
-        // iterate each attr
+    b = 0;
+    for (i = 16; i < n; ++i)
+    {
+        while (b < from.Size() && from[b].mftRef < i)
+            ++b;
+        if (changed[(size_t)i])
+            AddRecord(i, buf);
+        else if (b < from.Size() && from[b].mftRef == i)
+            _store.Add(from, b);
+    }
+
+    _store.Link(_ntfs.GetUpCase());
+}
+
+bool Tree::AddRecord(u64 i, std::vector<u8> & buf)
+{
+    ntfs::Node node;
+    if (!ReadNode(_ntfs, i, node, buf, _recover))
+        return false;
+
+    // ignore parentRef=0 entry:
+    //   - probably is reserved entry or,
+    //   - is an attribute list extended from other MFT entry
+    if ((node.parentRef & MFT_MASK) == 0)
+        return false;
+
+    _store.Add(node);
+    return true;
+}
+
+bool Tree::ReadNode(ntfs::Ntfs & ntfs, u64 mftRef, ntfs::Node & node, std::vector<u8> & buf, bool recover)
+{
+    buf.resize(ntfs.GetFileRecordSize());
+    ntfs::FILE_RECORD_HEADER * phdr = (ntfs::FILE_RECORD_HEADER*)&buf[0];
+    bool intact = ntfs.ReadFileRecord(mftRef, phdr);
+    if (phdr->Ntfs.Type != magic_FILE)
+        return false;
+    if (recover && !(phdr->Flags & 0x1))
+        return ReadDeletedNode(ntfs, mftRef, node, buf, intact);
+    if (!(phdr->Flags & 0x3))
+        return false;
+
+    // create node
+    node.Clear();
+    node.mftRef = mftRef & MFT_MASK; //phdr->BaseFileRecord & MFT_MASK;
+    node.isdir = ((phdr->Flags & 0x2) == 0x2);
+    node.sequence = phdr->SequenceNumber;
+    node.recordHash = HashRecord(14695981039346656037ULL, phdr, buf.size());
+
+    // iterate each attr
+    ProcessAttribute(
+        ntfs,
+        (ntfs::ATTRIBUTE*)P_add(phdr, phdr->AttributesOffset),
+        (ntfs::ATTRIBUTE*)P_add(phdr, buf.size()),
+        node);
+    return true;
+}
+
+bool Tree::ReadDeletedNode(ntfs::Ntfs & ntfs, u64 mftRef, ntfs::Node & node, std::vector<u8> & buf, bool intact)
+{
+    // a torn or half overwritten record is not worth guessing at,
+    // neither are extension records, their base has what they held
+    ntfs::FILE_RECORD_HEADER * phdr = (ntfs::FILE_RECORD_HEADER*)&buf[0];
+    if (!intact || phdr->BaseFileRecord != 0 || !IsWellFormed(phdr, buf.size()))
+        return false;
+
+    node.Clear();
+    node.mftRef = mftRef & MFT_MASK;
+    node.isdir = ((phdr->Flags & 0x2) == 0x2);
+    node.deleted = 1;
+    node.sequence = phdr->SequenceNumber;
+    node.recordHash = HashRecord(14695981039346656037ULL, phdr, buf.size());
+    try
+    {
+        // extension records were freed along, those still intact &
+        // still of this record are read from its attribute list
         ProcessAttribute(
+            ntfs,
             (ntfs::ATTRIBUTE*)P_add(phdr, phdr->AttributesOffset),
-            (ntfs::ATTRIBUTE*)phdrEnd,
+            (ntfs::ATTRIBUTE*)P_add(phdr, phdr->BytesInUse),
             node);
-
-        // ignore parentRef=0 entry:
-        //   - probably is reserved entry or,
-        //   - is an attribute list extended from other MFT entry
-        // or ignore system reserved entry (i < 16)
-        if (node.parentRef == 0 || node.mftRef == 5 || i < 16)
-            continue;
-
-        // adds to folders container
-        ntfs::FOLDERS::iterator it;
-        it = _folders.find(node.parentRef);
-        if (it == _folders.end())
-        {
-            NODES nodes;
-            nodes.push_back(node);
-            _folders.insert(std::make_pair(node.parentRef, nodes));
-        }
-        else
-        {
-            it->second.push_back(node);
-        }
-        ++count;
     }
-    //printf("Total file records: %llu\n", n);
-    //printf("In used file records: %llu\n", count);
-    //printf("Total folder: %lu\n", _folders.size());
-
-    // verify root folder must exists
-    if (_folders.find(5) == _folders.end())
-        throw std::runtime_error("Missing root folders.");
+    catch(std::exception &)
+    {
+        return false;   // leftovers that don't parse
+    }
+    return !node.name.empty() || !node.shortname.empty();
 }
 
-void Tree::ProcessAttribute(ATTRIBUTE * pattr, ATTRIBUTE * pattrEnd, ntfs::Node & node, u64 listref, u16 attrNum)
+void Tree::ProcessAttribute(ntfs::Ntfs & ntfs, ATTRIBUTE * pattr, ATTRIBUTE * pattrEnd, ntfs::Node & node, u64 listref, u16 attrNum)
 {
     // iterate each attr
     for (; pattr->AttributeType != eAttributeTerminator && pattr < pattrEnd; pattr = P_add(pattr, pattr->Length))
     {
         switch (pattr->AttributeType)
         {
+        case eAttributeStandardInformation:
+            {
+                if (pattr->Nonresident)
+                    throw std::runtime_error("WTF! Non resident standard information attribute.");
+
+                ntfs::RESIDENT_ATTRIBUTE * prattr = (RESIDENT_ATTRIBUTE*)pattr;
+                if (prattr->ValueLength < 4 * sizeof(u64) || prattr->ValueOffset + 4 * sizeof(u64) > pattr->Length)
+                    throw std::runtime_error("Out of range standard information reading.");
+                ntfs::STANDARD_INFORMATION * psi = (ntfs::STANDARD_INFORMATION*)P_add(pattr, prattr->ValueOffset);
+                node.infoTimes.created = psi->CreationTime;
+                node.infoTimes.written = psi->LastWriteTime;
+                node.infoTimes.changed = psi->ChangeTime;
+                node.infoTimes.accessed = psi->LastAccessTime;
+            }
+            break;
+
         case eAttributeFileName:
             {
                 if (pattr->Nonresident)
@@ -111,7 +405,15 @@ void Tree::ProcessAttribute(ATTRIBUTE * pattr, ATTRIBUTE * pattrEnd, ntfs::Node
                 ntfs::FILENAME_ATTRIBUTE * pfa = (ntfs::FILENAME_ATTRIBUTE*)P_add(pattr, prattr->ValueOffset);
                 void * p = P_add(pfa, prattr->ValueLength);
                 node.attr = pfa->FileAttributes;
-                node.parentRef = pfa->DirectoryFileReferenceNumber & MFT_MASK;
+                node.parentRef = pfa->DirectoryFileReferenceNumber;
+                if ((pfa->NameType & 0x1) || node.name.empty())
+                {
+                    // times of the long name, any other name's till then
+                    node.nameTimes.created = pfa->CreationTime;
+                    node.nameTimes.written = pfa->LastWriteTime;
+                    node.nameTimes.changed = pfa->ChangeTime;
+                    node.nameTimes.accessed = pfa->LastAccessTime;
+                }
                 if (pfa->NameType & 0x2)
                 {
                     if ((pfa->Name + pfa->NameLength) > p)
@@ -124,7 +426,6 @@ void Tree::ProcessAttribute(ATTRIBUTE * pattr, ATTRIBUTE * pattrEnd, ntfs::Node
                         throw std::runtime_error("Out of range name reading.");
                     node.name.assign(pfa->Name, pfa->Name + pfa->NameLength);
                 }
-                _parentMap[node.mftRef] = node.parentRef;
             }
             break;
 
@@ -140,6 +441,7 @@ void Tree::ProcessAttribute(ATTRIBUTE * pattr, ATTRIBUTE * pattrEnd, ntfs::Node
                 s.compressed = ((attr._flags & 0x1) == 1);
                 s.compressSize = attr._compressSize;
                 s.compressUnitSize = attr._compressionUnitSize;
+                s.record = listref ? listref : node.mftRef;
                 s.data.swap(attr._data);
 
                 STREAMS::iterator it = node.streams.find(s.name);
@@ -191,25 +493,30 @@ void Tree::ProcessAttribute(ATTRIBUTE * pattr, ATTRIBUTE * pattrEnd, ntfs::Node
                 }
                 else
                 {
-                    std::vector<u8> buf(_ntfs.GetFileRecordSize());
+                    std::vector<u8> buf(ntfs.GetFileRecordSize());
                     ntfs::FILE_RECORD_HEADER * phdr = (ntfs::FILE_RECORD_HEADER*)&buf[0];
                     ATTRIBUTE_LIST * pListEntry = (ATTRIBUTE_LIST*)&attrlist._data[0];
                     ATTRIBUTE_LIST * pListEntryEnd = P_add(pListEntry, attrlist._data.size());
                     for (; pListEntry < pListEntryEnd && pListEntry->Length > 0;
                             pListEntry = P_add(pListEntry, pListEntry->Length))
                     {
-                        if (!(pListEntry->FileReferenceNumber & MFT_MASK))  // skip if is $MFT entry (#0 entry in MFT)
+                        u64 ref = pListEntry->FileReferenceNumber;
+                        if (!(ref & MFT_MASK))  // skip if is $MFT entry (#0 entry in MFT)
+                            continue;
+                        if ((ref & MFT_MASK) == node.mftRef)    // the base's own, read already
                             continue;
 
-                        _ntfs.ReadFileRecord(pListEntry->FileReferenceNumber, phdr);
-                        if (buf[0] != 'F' || buf[1] != 'I' || buf[2] != 'L' || buf[3] != 'E')   // skip non file record
+                        bool intact = ntfs.ReadFileRecord(ref, phdr);
+                        if (!IsExtensionOf(phdr, ref, node))
                             continue;
-                        if (!(phdr->Flags & 0x01)) // skip not in used entry
+                        if (node.deleted && (!intact || !IsWellFormed(phdr, buf.size())))
                             continue;
+                        node.recordHash = HashRecord(node.recordHash, phdr, buf.size());
 
                         ProcessAttribute(
+                            ntfs,
                             (ntfs::ATTRIBUTE*)P_add(phdr, phdr->AttributesOffset),
-                            (ntfs::ATTRIBUTE*)P_add(&buf[0], buf.size()),
+                            (ntfs::ATTRIBUTE*)P_add(&buf[0], node.deleted ? phdr->BytesInUse : buf.size()),
                             node,
                             pListEntry->FileReferenceNumber & MFT_MASK,
                             pListEntry->AttributeNumber);
@@ -225,9 +532,60 @@ void Tree::ProcessAttribute(ATTRIBUTE * pattr, ATTRIBUTE * pattrEnd, ntfs::Node
 
 }
 
+bool Tree::IsWellFormed(FILE_RECORD_HEADER const * phdr, u32 size)
+{
+    if (phdr->BytesInUse > size || phdr->AttributesOffset < sizeof(FILE_RECORD_HEADER)
+        || phdr->AttributesOffset >= phdr->BytesInUse)
+        return false;
+
+    // attributes must chain up to the terminator within the bytes in use
+    ATTRIBUTE const * pattr = (ATTRIBUTE const *)P_add(phdr, phdr->AttributesOffset);
+    ATTRIBUTE const * pattrEnd = (ATTRIBUTE const *)P_add(phdr, phdr->BytesInUse);
+    for (;;)
+    {
+        if ((u8 const *)pattr + sizeof(u32) > (u8 const *)pattrEnd)
+            return false;
+        if (pattr->AttributeType == eAttributeTerminator)
+            return true;
+        if (pattr + 1 > pattrEnd || pattr->Length < sizeof(ATTRIBUTE) || (pattr->Length & 7)
+            || P_add(pattr, pattr->Length) > pattrEnd)
+            return false;
+        pattr = P_add(pattr, pattr->Length);
+    }
+}
+
+bool Tree::IsExtensionOf(FILE_RECORD_HEADER const * phdr, u64 ref, ntfs::Node const & node)
+{
+    // the record ref (from node's attribute list) names must still be
+    // an extension of node. freeing a record bumps its sequence number,
+    // so those of a deleted node may be one past what was referred to
+    if (phdr->Ntfs.Type != magic_FILE || (phdr->BaseFileRecord & MFT_MASK) != node.mftRef)
+        return false;
+    if (((phdr->Flags & 0x1) != 0) == (node.deleted != 0))
+        return false;
+    u16 refSeq = (u16)(ref >> MFT_MASK_BITS);
+    u16 baseSeq = (u16)(phdr->BaseFileRecord >> MFT_MASK_BITS);
+    if (node.deleted)
+        return (refSeq == 0 || phdr->SequenceNumber == refSeq || phdr->SequenceNumber == (u16)(refSeq + 1))
+            && (baseSeq == 0 || baseSeq == node.sequence || (u16)(baseSeq + 1) == node.sequence);
+    return (refSeq == 0 || phdr->SequenceNumber == refSeq)
+        && (baseSeq == 0 || baseSeq == node.sequence);
+}
+
+u64 Tree::HashRecord(u64 hash, FILE_RECORD_HEADER const * phdr, u32 size)
+{
+    // FNV-1a over the bytes in use, slack after them may hold anything
+    u8 const * p = (u8 const *)phdr;
+    u32 used = std::min(phdr->BytesInUse, size);
+    for (u32 i = 0; i < used; ++i)
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    return hash;
+}
+
 void Tree::Print(char const * prefixDir, std::ostream & os, u64 folderMftIndex)
 {
-    PrintInternal(prefixDir, os, folderMftIndex);
+    ntfs::Lister lister(*this, os);
+    lister.List(prefixDir, folderMftIndex);
 }
 
 void Tree::Print(wchar_t const * baseDir, std::ostream & os, u64 folderMftIndex)
@@ -235,63 +593,213 @@ void Tree::Print(wchar_t const * baseDir, std::ostream & os, u64 folderMftIndex)
     std::basic_string<wchar_t> wstr(baseDir);
     std::string u8dir;
     wchar_to_utf8(wstr, u8dir);
-    PrintInternal(u8dir, os, folderMftIndex);
+    Print(u8dir.c_str(), os, folderMftIndex);
 }
 
-void Tree::PrintInternal(std::string const & prefixDir, std::ostream & os, u64 folderMftIndex)
+ntfs::NodeStore const * Tree::GetFolder(u64 folderRef, u32 & folder)
 {
-    ntfs::FOLDERS::iterator it;
-    it = _folders.find(folderMftIndex);
-    if (it == _folders.end())
-        throw std::runtime_error("Can't find folder with the given MFT index.");
-
-    os << prefixDir;
-    if (prefixDir.length() < 3 && *prefixDir.rbegin() != '\\')
-        os << '\\';
-    os << std::endl;
-
-    std::string u8name;
-    std::string u8stream;
-    ntfs::NODES::iterator nit;
-    for (nit = it->second.begin(); nit != it->second.end(); ++nit)
+    folderRef &= MFT_MASK;
+    if (!_lazy)
+    {
+        folder = _store.Find(folderRef);
+        if (folder == NodeStore::NPOS || !_store[folder].IsDir())
+            return 0;
+        return &_store;
+    }
+
+    FOLDERMAP::iterator it = _folderMap.find(folderRef);
+    if (it != _folderMap.end())
+    {
+        _folderLru.splice(_folderLru.begin(), _folderLru, it->second);
+    }
+    else
     {
-        if (!nit->isdir)
+        _folderLru.push_front(LazyFolder());
+        if (!LoadFolder(folderRef, _folderLru.front()))
         {
-            ntfs::STREAMS::iterator sit;
+            _folderLru.pop_front();
+            return 0;
+        }
+        _folderMap[folderRef] = _folderLru.begin();
+        _cacheUsed += _folderLru.front().store.MemoryUsage();
+        TrimFolders();
+    }
+    folder = _folderLru.front().folder;
+    return &_folderLru.front().store;
+}
 
-            for (sit = nit->streams.begin(); sit != nit->streams.end(); ++sit)
-            {
-                u8name.clear();
-                utf8::utf16to8(nit->name.begin(), nit->name.end(), std::back_inserter(u8name));
+ntfs::ClusterMap const & Tree::GetClusterMap()
+{
+    if (_lazy)
+        throw std::runtime_error("Cluster map needs the whole tree.");
+    if (!_clustersBuilt)
+    {
+        TraceSpan span("build cluster map", "tree");
+        _clusters.Build(_store);
+        _clustersBuilt = true;
+    }
+    return _clusters;
+}
 
-                if (sit->second.name.empty())  // default data stream
-                {
-                    os << '\t'
-                        << u8name << '\t'
-                        << sit->second.realSize << std::endl;
-                }
-                else
-                {
-                    u8stream.clear();
-                    utf8::utf16to8(sit->second.name.begin(), sit->second.name.end(), std::back_inserter(u8stream));
-                    os << '\t'
-                        << u8name << ':' << u8stream << '\t'
-                        << sit->second.realSize << std::endl;
-                }
-            }
+void Tree::SetCacheSize(u64 bytes)
+{
+    _cacheSize = bytes;
+    TrimFolders();
+}
+
+void Tree::TrimFolders()
+{
+    // least recently visited go first, the most recent one always stays
+    while (_folderLru.size() > 1 && _cacheUsed > _cacheSize)
+    {
+        _cacheUsed -= _folderLru.back().store.MemoryUsage();
+        _folderMap.erase(_folderLru.back().mftRef);
+        _folderLru.pop_back();
+    }
+}
+
+bool Tree::LoadFolder(u64 folderRef, LazyFolder & lf)
+{
+    std::vector<FolderElement> entries;
+    if (!_index.List(folderRef, entries))
+        return false;
+
+    // each child's names as listed in this folder (hard links may have
+    // other names elsewhere), skipping system files of the root folder
+    typedef std::map<u64, ChildNames> CHILDREN;
+    CHILDREN children;
+    std::vector<FolderElement>::iterator eit;
+    for (eit = entries.begin(); eit != entries.end(); ++eit)
+    {
+        u64 mftRef = eit->mftref & MFT_MASK;
+        if (mftRef < 16 || mftRef == folderRef)
+            continue;
+        ChildNames & cn = children[mftRef];
+        cn.ref = eit->mftref;
+        if (eit->nameType & 0x2)
+            cn.shortname = eit->name;
+        if ((eit->nameType & 0x1) || eit->nameType == 0)
+            cn.name = eit->name;
+    }
+
+    // nodes go into store in MFT order, the folder itself included
+    lf.mftRef = folderRef;
+    lf.store.Clear();
+    ntfs::Node node;
+    std::vector<u8> buf;
+    if (!ReadNode(_ntfs, folderRef, node, buf) || !node.isdir)
+        return false;
+    ntfs::Node folderNode(node);
+
+    bool folderAdded = false;
+    CHILDREN::iterator it;
+    for (it = children.begin(); it != children.end(); ++it)
+    {
+        if (!folderAdded && folderRef < it->first)
+        {
+            lf.store.Add(folderNode);
+            folderAdded = true;
         }
+
+        if (!ReadNode(_ntfs, it->first, node, buf))
+            continue;
+        u16 seq = ((ntfs::FILE_RECORD_HEADER*)&buf[0])->SequenceNumber;
+        if ((it->second.ref >> MFT_MASK_BITS) != 0 && (it->second.ref >> MFT_MASK_BITS) != seq)
+            continue;   // stale index entry
+
+        node.parentRef = folderRef | ((u64)folderNode.sequence << MFT_MASK_BITS);
+        if (!it->second.name.empty())
+            node.name = it->second.name;
+        if (!it->second.shortname.empty())
+            node.shortname = it->second.shortname;
+        lf.store.Add(node);
     }
+    if (!folderAdded)
+        lf.store.Add(folderNode);
 
-    std::string newPrefixDir;
-    for (nit = it->second.begin(); nit != it->second.end(); ++nit)
+    lf.store.Link(_ntfs.GetUpCase());
+    lf.folder = lf.store.Find(folderRef);
+    return true;
+}
+
+void Tree::GetNode(ntfs::NodeStore const & store, u32 index, ntfs::Node & node) const
+{
+    ntfs::NodeRecord const & n = store[index];
+    node.Clear();
+    node.mftRef = n.mftRef;
+    node.parentRef = n.parentRef;
+    node.attr = n.attr;
+    node.isdir = n.IsDir();
+    node.name.assign(store.Name(n.name), n.nameLen);
+    node.shortname.assign(store.Name(n.shortName), n.shortNameLen);
+    node.infoTimes = store.InfoTimes(n);
+    node.nameTimes = store.NameTimes(n);
+}
+
+u32 Tree::FindStream(ntfs::NodeStore const & store, u32 index, u16 const * name, u32 len) const
+{
+    ntfs::NodeRecord const & n = store[index];
+    u32 i;
+    for (i = n.firstStream; i < n.firstStream + n.streamCount; ++i)
     {
-        if (nit->isdir)
+        ntfs::StreamRecord const & s = store.GetStream(i);
+        if (s.nameLen == len && std::equal(name, name + len, store.Name(s.name)))
+            return i;
+    }
+    for (i = n.firstStream; i < n.firstStream + n.streamCount; ++i)
+    {
+        ntfs::StreamRecord const & s = store.GetStream(i);
+        u16 const * sname = store.Name(s.name);
+        u32 k = 0;
+        while (k < s.nameLen && k < len && _ntfs.UpCase(sname[k]) == _ntfs.UpCase(name[k]))
+            ++k;
+        if (k == s.nameLen && k == len)
+            return i;
+    }
+    return NodeStore::NPOS;
+}
+
+bool Tree::GetStream(ntfs::NodeStore const & store, u32 index, std::basic_string<u16> const & name, ntfs::Stream & stream)
+{
+    u32 match = FindStream(store, index, name.data(), name.size());
+    if (match != NodeStore::NPOS)
+    {
+        ntfs::StreamRecord const & s = store.GetStream(match);
+        stream.Clear();
+        stream.name.assign(store.Name(s.name), s.nameLen);
+        stream.realSize = s.realSize;
+        stream.nonResident = s.nonResident;
+        stream.compressed = (s.compressed != 0);
+        stream.compressSize = s.compressSize;
+        stream.compressUnitSize = s.compressUnitSize;
+        if (s.nonResident)
+        {
+            store.GetDataRun(s, stream.dataRun);
+            return true;
+        }
+
+        // look up the resident $DATA attribute again from its record
+        stream.record = s.location;
+        std::vector<u8> buf(_ntfs.GetFileRecordSize());
+        ntfs::FILE_RECORD_HEADER * phdr = (ntfs::FILE_RECORD_HEADER*)&buf[0];
+        _ntfs.ReadFileRecord(s.location, phdr);
+        if (phdr->Ntfs.Type != magic_FILE)
+            throw std::runtime_error("Resident stream record is gone.");
+
+        ATTRIBUTE * pattr = (ATTRIBUTE*)P_add(phdr, phdr->AttributesOffset);
+        ATTRIBUTE * pattrEnd = (ATTRIBUTE*)P_add(&buf[0], buf.size());
+        for (; pattr < pattrEnd && pattr->AttributeType != eAttributeTerminator; pattr = P_add(pattr, pattr->Length))
         {
-            newPrefixDir.assign(prefixDir);
-            newPrefixDir.push_back('\\');
-            utf8::utf16to8(nit->name.begin(), nit->name.end(), std::back_inserter(newPrefixDir));
-            //os << newPrefixDir << std::endl;
-            PrintInternal(newPrefixDir, os, nit->mftRef);
+            if (pattr->AttributeType != eAttributeData || pattr->Nonresident)
+                continue;
+            ntfs::AttributeData attr;
+            attr.Init((u8*)pattr, pattr->Length);
+            if (attr._attrName.size() != s.nameLen || !std::equal(attr._attrName.begin(), attr._attrName.end(), store.Name(s.name)))
+                continue;
+            stream.data.swap(attr._data);
+            return true;
         }
+        throw std::runtime_error("Resident stream data is gone.");
     }
+    return false;
 }
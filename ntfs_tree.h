@@ -3,6 +3,14 @@
 // Parses the entire $MFT file and
 // reconstructs files and folders hierarchy.
 //
+// The hierarchy is kept in a compact ntfs::NodeStore, Node and
+// Stream are only materialized on demand (e.g. by ntfs::File).
+// A lazy tree instead loads folders from their $I30 indexes as
+// they are visited, keeping a bounded number of them around.
+// A full tree can be cached in a snapshot file, which later runs
+// map and use as is, as long as volume & image are unchanged;
+// and a snapshot image's tree patched from its parent image's.
+//
 // Author: Derek Saw
 //
 // Copyright (c) 2009. All rights reserved.
@@ -12,9 +20,13 @@
 #define __NTFS_TREE_H
 
 #include "ntfs.h"
+#include "ntfs_store.h"
+#include "ntfs_index.h"
+#include "ntfs_clustermap.h"
+#include "mapfile.h"
 
 #include <map>
-#include <deque>
+#include <list>
 #include <string>
 #include <set>
 
@@ -34,9 +46,10 @@ namespace ntfs
         bool compressed;
         u16 compressUnitSize;   // ??
         u64 compressSize;   // size of compressed data
+        u64 record;         // MFT record holding the attribute
 
-        Stream() : attrId(0), realSize(0), nonResident(0), compressed(false), compressUnitSize(0), compressSize(0) { }
-        void Clear() { name.clear(); data.clear(); dataRun.Clear(); realSize = compressSize = attrId = compressUnitSize = nonResident = 0; compressed = false;}
+        Stream() : attrId(0), realSize(0), nonResident(0), compressed(false), compressUnitSize(0), compressSize(0), record(0) { }
+        void Clear() { name.clear(); data.clear(); dataRun.Clear(); realSize = compressSize = attrId = compressUnitSize = nonResident = 0; record = 0; compressed = false;}
         bool IsEmpty() const { return !realSize; }
     };
 
@@ -49,26 +62,22 @@ namespace ntfs
     struct Node
     {
         u64 mftRef;
-        u64 parentRef; // parent MFT ref index
+        u64 parentRef; // parent MFT ref, its sequence number in the top 16 bits
         u32 attr; // file attributes
         int isdir;  // non-zero if is dir
+        int deleted;    // non-zero if the record is no longer in use
+        u16 sequence;   // of the base record, bumped each time the record is reused
+        u64 recordHash; // of the base record & its extensions, as written on disk
+        TimeRecord infoTimes;   // of $STANDARD_INFORMATION
+        TimeRecord nameTimes;   // of the $FILE_NAME the name is from
         std::basic_string<u16> shortname;
         std::basic_string<u16> name;
         STREAMS streams;
-        Node() : mftRef(0), parentRef(0), attr(0) { }
-        void Clear() { shortname.clear(); name.clear(); streams.clear(); mftRef = parentRef = attr = 0; }
+        Node() : mftRef(0), parentRef(0), attr(0), isdir(0), deleted(0), sequence(0), recordHash(0), infoTimes(), nameTimes() { }
+        void Clear() { shortname.clear(); name.clear(); streams.clear(); mftRef = parentRef = recordHash = attr = isdir = deleted = sequence = 0; infoTimes = nameTimes = TimeRecord(); }
         bool IsEmpty() const { return !mftRef || !parentRef || !attr; }
     };
 
-    // a file container -> folder
-    typedef std::deque<Node> NODES;
-
-    // a folder container indexed by folder's MFT reference
-    typedef std::map<u64, NODES> FOLDERS;
-
-    // a parent map for each MFT record
-    typedef std::map<u64, u64> PARENTMAP;
-
 
     // forward declare
     class File;
@@ -77,19 +86,105 @@ namespace ntfs
     {
         friend class File;  // only friends can touch private parts
     public:
-        Tree(ntfs::Ntfs & ntfs);
+        // lazy tree skips the MFT scan, and loads a folder's children
+        // from its $I30 index when the folder is first enumerated.
+        // recovering tree also keeps the unused records still intact
+        // in the scan, as deleted nodes linked to their old folders
+        Tree(ntfs::Ntfs & ntfs, bool lazy = false, bool recover = false);
+
+        // full tree cached in a snapshot file: used straight from a mapping of the
+        // file if it matches this volume & image, else built by scanning and saved
+        Tree(ntfs::Ntfs & ntfs, char const * snapshotFile, u64 imageId);
+        bool SaveSnapshot(char const * snapshotFile, u64 imageId) const;
+
+        // tree of a snapshot image, patched from base: the full tree of the same
+        // volume in its parent image. only MFT records this image holds its own
+        // sectors of are read again, the rest are copied from base.
+        // with a snapshot file given, it is used or saved as above
+        Tree(ntfs::Ntfs & ntfs, Tree const & base, char const * snapshotFile = 0, u64 imageId = 0);
+
+        // tree patched from base as above, with the records to read again given,
+        // e.g. when base is further up the chain than the parent image
+        Tree(ntfs::Ntfs & ntfs, Tree const & base, std::vector<bool> const & changed);
+
+        // records that may differ from the parent image: those in sectors any of
+        // layers (the same volume in consecutive images of a chain) holds its own
+        // sectors of, and the base records of changed extension records
+        static void FindChangedRecords(std::vector<ntfs::Ntfs*> const & layers, std::vector<bool> & changed);
+        bool IsSnapshot() const { return _snapshot.IsOpen(); }
         void Print(wchar_t const * prefixDir, std::ostream & os = std::cout, u64 folderMftIndex = 5);
         void Print(char const * prefixDir, std::ostream & os = std::cout, u64 folderMftIndex = 5);
 
+        bool IsLazy() const { return _lazy; }
+
+        // whole volume store, empty for lazy tree
+        ntfs::NodeStore const & GetStore() const { return _store; }
+
+        // which streams own which clusters, over the whole volume store;
+        // built on first call, not for lazy tree
+        ntfs::ClusterMap const & GetClusterMap();
+
+        // store holding the given folder and its children, and the folder's index in it;
+        // null if it is not an in used folder.
+        // for lazy tree the store is only valid until next GetFolder() call
+        ntfs::NodeStore const * GetFolder(u64 folderRef, u32 & folder);
+
+        // memory budget of loaded folders for lazy tree
+        // at least the most recent folder is always kept regardless of the budget
+        void SetCacheSize(u64 bytes);
+
+        // materialize a node (without its streams) or one of its streams,
+        // resident stream data is read back from its MFT record
+        void GetNode(ntfs::NodeStore const & store, u32 index, ntfs::Node & node) const;
+        bool GetStream(ntfs::NodeStore const & store, u32 index, std::basic_string<u16> const & name, ntfs::Stream & stream);
+
+        // stream of a node by name, case-insensitive too, exact case wins;
+        // returns stream index in store or NPOS
+        u32 FindStream(ntfs::NodeStore const & store, u32 index, u16 const * name, u32 len) const;
+
+        // parses a single in used MFT record (and its attribute list extensions)
+        // into node, buf is scratch space for the record. with recover, an unused
+        // base record is parsed too if intact, into a deleted node
+        static bool ReadNode(ntfs::Ntfs & ntfs, u64 mftRef, ntfs::Node & node, std::vector<u8> & buf, bool recover = false);
+
     private:
+        // children of a single folder, loaded by lazy tree
+        struct LazyFolder
+        {
+            u64 mftRef;
+            u32 folder;     // folder's own index in store
+            ntfs::NodeStore store;
+        };
+        typedef std::list<LazyFolder> FOLDERLIST;
+        typedef std::map<u64, FOLDERLIST::iterator> FOLDERMAP;
+
         void Init();
-        void PrintInternal(std::string const & prefixDir, std::ostream & os, u64 folderMftIndex);
-        void ProcessAttribute(ATTRIBUTE * pattr, ATTRIBUTE * pattrEnd, Node & node, u64 listref = 0, u16 attrNum = 0);
+        void Patch(Tree const & base, std::vector<bool> const & changed);
+        bool LoadSnapshot(char const * snapshotFile, u64 imageId);
+        bool AddRecord(u64 i, std::vector<u8> & buf);
+        bool LoadFolder(u64 folderRef, LazyFolder & lf);
+        void TrimFolders();
+        static void ProcessAttribute(ntfs::Ntfs & ntfs, ATTRIBUTE * pattr, ATTRIBUTE * pattrEnd, Node & node, u64 listref = 0, u16 attrNum = 0);
+        static bool ReadDeletedNode(ntfs::Ntfs & ntfs, u64 mftRef, ntfs::Node & node, std::vector<u8> & buf, bool intact);
+        static bool IsWellFormed(FILE_RECORD_HEADER const * phdr, u32 size);
+        static bool IsExtensionOf(FILE_RECORD_HEADER const * phdr, u64 ref, ntfs::Node const & node);
+        static u64 HashRecord(u64 hash, FILE_RECORD_HEADER const * phdr, u32 size);
         //ntfs::Tree & operator = (ntfs::Tree &) { return *this; }    // not allow assignment
 
         ntfs::Ntfs & _ntfs;
-        FOLDERS _folders;
-        PARENTMAP _parentMap;
+        ntfs::NodeStore _store;
+        bool _lazy;
+        bool _recover;
+        MappedFile _snapshot;   // backing _store if loaded from snapshot
+        ntfs::ClusterMap _clusters;
+        bool _clustersBuilt;
+
+        // for lazy tree, LRU of loaded folders, most recent in front
+        ntfs::Index _index;
+        FOLDERLIST _folderLru;
+        FOLDERMAP _folderMap;
+        u64 _cacheSize;
+        u64 _cacheUsed;
     };
 }
 
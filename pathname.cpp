@@ -0,0 +1,80 @@
+//
+// Path Names
+// NTFS names (UTF-16) turned into UTF-8 paths.
+// Both Win32 & POSIX definition are conditionally preprocessed
+// depends on compiler platforms.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "pathname.h"
+#include "utf8.h"
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef _MSC_VER
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+#ifdef _MSC_VER
+
+//-----------------------------------------------------------------------------
+// Windows system
+//-----------------------------------------------------------------------------
+bool MakeDir(std::string const & path)
+{
+    return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+}
+
+#else
+
+//-----------------------------------------------------------------------------
+// POSIX system
+//-----------------------------------------------------------------------------
+bool MakeDir(std::string const & path)
+{
+    return mkdir(path.c_str(), 0777) == 0 || errno == EEXIST;
+}
+
+#endif // _MSC_VER
+
+
+//-----------------------------------------------------------------------------
+// generic  system
+//-----------------------------------------------------------------------------
+void AppendUtf8(std::string & out, u16 const * s, size_t len)
+{
+    utf8::utf16to8(s, s + len, std::back_inserter(out));
+}
+
+std::string ToUtf8(std::basic_string<u16> const & s)
+{
+    std::string u8;
+    AppendUtf8(u8, s.data(), s.size());
+    return u8;
+}
+
+void AppendSafeName(std::string & out, u16 const * s, size_t len)
+{
+    // a name of dots only would climb out of the folder
+    if ((len == 1 && s[0] == '.') || (len == 2 && s[0] == '.' && s[1] == '.'))
+    {
+        out.append(len, '_');
+        return;
+    }
+
+    size_t begin = out.size();
+    AppendUtf8(out, s, len);
+    for (size_t i = begin; i < out.size(); ++i)
+    {
+        char c = out[i];
+        if ((unsigned char)c < 0x20 || strchr("\\/:*?\"<>|", c))
+            out[i] = '_';
+    }
+}
@@ -0,0 +1,31 @@
+//
+// Path Names
+// NTFS names (UTF-16) turned into UTF-8 paths, for listing or for
+// creating files by on the local file system. Both Win32 & POSIX
+// definition are conditionally preprocessed depends on compiler
+// platforms.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __PATHNAME_H
+#define __PATHNAME_H
+
+#include "types.h"
+
+#include <string>
+
+// as is, for listing
+void AppendUtf8(std::string & out, u16 const * s, size_t len);
+std::string ToUtf8(std::basic_string<u16> const & s);
+
+// one name of a path, made safe to create under a folder: characters
+// Windows or POSIX won't take in a name become '_', as do "." & ".."
+void AppendSafeName(std::string & out, u16 const * s, size_t len);
+
+// true if made or already there
+bool MakeDir(std::string const & path);
+
+#endif // __PATHNAME_H
@@ -0,0 +1,90 @@
+//
+// Slow Storage
+// Wraps the IFile64 maker so every file made afterwards reads
+// like remote storage: latency, jitter & a shared bandwidth cap.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "slowfile.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <stdio.h>
+
+//=============================================================================
+Mutex SlowStorage::s_lock;
+SlowStorage::Options SlowStorage::s_options;
+u32 SlowStorage::s_random = 1;
+u64 SlowStorage::s_linkFree = 0;
+IFile64::MAKER SlowStorage::s_wrapped = 0;
+
+void SlowStorage::Start(Options const & options)
+{
+    ScopedLock lock(s_lock);
+    if (s_wrapped)
+        throw std::runtime_error("Slow storage already started.");
+    s_options = options;
+    s_random = options.seed ? options.seed : 1;
+    s_linkFree = 0;
+    s_wrapped = IFile64::SetMaker(&SlowStorage::Maker);
+}
+
+void SlowStorage::Stop()
+{
+    ScopedLock lock(s_lock);
+    if (!s_wrapped)
+        return;
+    IFile64::SetMaker(s_wrapped);
+    s_wrapped = 0;
+    s_options = Options();      // files still open read at full speed again
+}
+
+bool SlowStorage::Parse(char const * spec, Options & options)
+{
+    unsigned long long latency = 0, mbps = 0, jitter = 0;
+    int n = sscanf(spec, "%llu,%llu,%llu", &latency, &mbps, &jitter);
+    if (n < 1)
+        return false;
+    options.latency = latency;
+    options.bandwidth = mbps * 1000000;
+    options.jitter = jitter;
+    return true;
+}
+
+IFile64 * SlowStorage::Maker()
+{
+    return new File(s_wrapped());
+}
+
+void SlowStorage::Delay(u64 bytes)
+{
+    // the transfer queues up behind earlier ones on the link,
+    // then the request's own latency comes on top
+    u64 now = Stats::Now();
+    u64 until;
+    {
+        ScopedLock lock(s_lock);
+        u64 transfer = s_options.bandwidth ? bytes * 1000000000ULL / s_options.bandwidth : 0;
+        s_linkFree = std::max(s_linkFree, now) + transfer;
+        u64 jitter = 0;
+        if (s_options.jitter)
+        {
+            s_random = s_random * 1103515245 + 12345;     // same LCG as common rand()
+            jitter = (s_random >> 8) % (s_options.jitter + 1);
+        }
+        until = s_linkFree + (s_options.latency + jitter) * 1000;
+    }
+    if (until > now)
+        Thread::Sleep((until - now) / 1000);
+}
+
+unsigned long SlowStorage::File::Read(void * buf, unsigned long size)
+{
+    unsigned long reads = _file->Read(buf, size);
+    Delay(reads);
+    return reads;
+}
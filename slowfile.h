@@ -0,0 +1,71 @@
+//
+// Slow Storage
+// Wraps the IFile64 maker so every file made afterwards reads
+// like remote storage (NFS, VMFS datastores): each read waits a
+// latency with jitter, and all reads share one bandwidth-capped
+// link. For benchmarking read batching & prefetch on a local box.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __SLOWFILE_H
+#define __SLOWFILE_H
+
+#include "types.h"
+#include "file64.h"
+#include "thread.h"
+
+class SlowStorage
+{
+public:
+    struct Options
+    {
+        u64 latency;        // microseconds per read request
+        u64 jitter;         // up to this many microseconds more, at random
+        u64 bandwidth;      // bytes per second of the shared link, 0 for no cap
+        u32 seed;           // of the jitter, same seed same delays
+        Options() : latency(0), jitter(0), bandwidth(0), seed(1) { }
+    };
+
+    static void Start(Options const & options);
+    static void Stop();
+
+    // "latency[,MB/s[,jitter]]", times in microseconds
+    static bool Parse(char const * spec, Options & options);
+
+private:
+    // forwards to the file made by the wrapped maker, delaying reads
+    class File : public IFile64
+    {
+    public:
+        File(IFile64 * file) : _file(file) { }
+        ~File() { delete _file; }
+        bool Open(char const * filename) { return _file->Open(filename); }
+        bool Open(wchar_t const * filename) { return _file->Open(filename); }
+        void Close() { _file->Close(); }
+        bool IsOpen() const { return _file->IsOpen(); }
+        bool Eof() const { return _file->Eof(); }
+        unsigned long Read(void * buf, unsigned long size);
+        bool Seek(s64 pos, u32 moveMethod = 0) { return _file->Seek(pos, moveMethod); }
+        s64 Size() const { return _file->Size(); }
+        void NoAutoClose() { _file->NoAutoClose(); }
+
+    private:
+        File(File const &);
+        File & operator = (File const &);
+        IFile64 * _file;
+    };
+
+    static IFile64 * Maker();
+    static void Delay(u64 bytes);
+
+    static Mutex s_lock;
+    static Options s_options;       // guarded by s_lock
+    static u32 s_random;            // ditto, jitter state
+    static u64 s_linkFree;          // ditto, when the link is done with earlier reads, ns
+    static IFile64::MAKER s_wrapped;
+};
+
+#endif // __SLOWFILE_H
@@ -0,0 +1,200 @@
+//
+// I/O Statistics
+// Counters & latency histograms per layer of the reading stack.
+// Both Win32 & POSIX definition are conditionally preprocessed
+// depends on compiler platforms.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "stats.h"
+
+#ifdef _MSC_VER
+
+#include <windows.h>
+
+//=============================================================================
+// for Win32
+namespace
+{
+    u64 AtomicAdd(u64 volatile * p, u64 x) { return (u64)::InterlockedExchangeAdd64((LONGLONG volatile *)p, (LONGLONG)x) + x; }
+    u64 AtomicExchange(u64 volatile * p, u64 x) { return (u64)::InterlockedExchange64((LONGLONG volatile *)p, (LONGLONG)x); }
+}
+
+u64 Stats::Now()
+{
+    static LARGE_INTEGER s_freq;
+    if (s_freq.QuadPart == 0)
+        ::QueryPerformanceFrequency(&s_freq);
+    LARGE_INTEGER now;
+    ::QueryPerformanceCounter(&now);
+    return (u64)(now.QuadPart / s_freq.QuadPart) * 1000000000ULL
+        + (u64)(now.QuadPart % s_freq.QuadPart) * 1000000000ULL / s_freq.QuadPart;
+}
+
+#else
+
+#include <time.h>
+
+//=============================================================================
+// for POSIX, gcc builtins
+namespace
+{
+    u64 AtomicAdd(u64 volatile * p, u64 x) { return __sync_add_and_fetch(p, x); }
+    u64 AtomicExchange(u64 volatile * p, u64 x)
+    {
+        u64 old = __sync_add_and_fetch(p, 0);
+        for (u64 seen; (seen = __sync_val_compare_and_swap(p, old, x)) != old; )
+            old = seen;
+        return old;
+    }
+}
+
+u64 Stats::Now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif // _MSC_VER
+
+
+//=============================================================================
+// generic part
+namespace
+{
+    struct Layer
+    {
+        u64 volatile calls;
+        u64 volatile bytes;
+        u64 volatile seeks;
+        u64 volatile seekDistance;
+        u64 volatile cacheHits;
+        u64 volatile nanos;
+        u64 volatile latency[STAT_BUCKETS];
+        u64 volatile lastEnd;   // where the previous call ended, + 1 so 0 is none yet
+    };
+
+    Layer s_layers[eStatLayers];
+
+    char const * const s_names[eStatLayers] =
+    {
+        "vmdk.rawSector",
+        "vmdk.readSectors",
+        "vmdk.grainDirectory",
+        "vmdk.grainTable",
+        "ntfs.mftRecord",
+        "ntfs.readLcn",
+        "ntfs.fileRead",
+        "ntfs.decompress",
+    };
+
+    u32 Bucket(u64 nanos)
+    {
+        u32 k = 0;
+        while (k + 1 < STAT_BUCKETS && (nanos >> k) != 0)
+            ++k;
+        return k;
+    }
+}
+
+bool Stats::s_enabled = false;
+
+void Stats::Enable(bool on)
+{
+    s_enabled = on;
+}
+
+void Stats::Reset()
+{
+    for (u32 i = 0; i < eStatLayers; ++i)
+    {
+        Layer & l = s_layers[i];
+        AtomicExchange(&l.calls, 0);
+        AtomicExchange(&l.bytes, 0);
+        AtomicExchange(&l.seeks, 0);
+        AtomicExchange(&l.seekDistance, 0);
+        AtomicExchange(&l.cacheHits, 0);
+        AtomicExchange(&l.nanos, 0);
+        for (u32 k = 0; k < STAT_BUCKETS; ++k)
+            AtomicExchange(&l.latency[k], 0);
+        AtomicExchange(&l.lastEnd, 0);
+    }
+}
+
+void Stats::Record(StatLayer layer, u64 bytes, u64 nanos)
+{
+    Layer & l = s_layers[layer];
+    AtomicAdd(&l.calls, 1);
+    AtomicAdd(&l.bytes, bytes);
+    AtomicAdd(&l.nanos, nanos);
+    AtomicAdd(&l.latency[Bucket(nanos)], 1);
+}
+
+void Stats::Position(StatLayer layer, u64 offset, u64 size)
+{
+    // calls from many threads interleave, each is still seen as
+    // following the one just before it, whichever thread made it
+    Layer & l = s_layers[layer];
+    u64 last = AtomicExchange(&l.lastEnd, offset + size + 1);
+    if (last == 0 || last - 1 == offset)
+        return;
+    AtomicAdd(&l.seeks, 1);
+    AtomicAdd(&l.seekDistance, (last - 1 < offset) ? offset - (last - 1) : (last - 1) - offset);
+}
+
+void Stats::CacheHit(StatLayer layer)
+{
+    if (s_enabled)
+        AtomicAdd(&s_layers[layer].cacheHits, 1);
+}
+
+void Stats::Get(StatLayer layer, StatCounters & counters)
+{
+    Layer & l = s_layers[layer];
+    counters.calls = AtomicAdd(&l.calls, 0);
+    counters.bytes = AtomicAdd(&l.bytes, 0);
+    counters.seeks = AtomicAdd(&l.seeks, 0);
+    counters.seekDistance = AtomicAdd(&l.seekDistance, 0);
+    counters.cacheHits = AtomicAdd(&l.cacheHits, 0);
+    counters.nanos = AtomicAdd(&l.nanos, 0);
+    for (u32 k = 0; k < STAT_BUCKETS; ++k)
+        counters.latency[k] = AtomicAdd(&l.latency[k], 0);
+}
+
+char const * Stats::Name(StatLayer layer)
+{
+    return s_names[layer];
+}
+
+void Stats::WriteJson(std::ostream & os)
+{
+    // histogram keyed by bucket's upper bound in ns, empty buckets left out
+    os << "{\"layers\":{";
+    for (u32 i = 0; i < eStatLayers; ++i)
+    {
+        StatCounters c;
+        Get((StatLayer)i, c);
+        os << (i ? "," : "") << "\n\"" << s_names[i] << "\":{"
+            << "\"calls\":" << c.calls
+            << ",\"bytes\":" << c.bytes
+            << ",\"seeks\":" << c.seeks
+            << ",\"seekDistance\":" << c.seekDistance
+            << ",\"cacheHits\":" << c.cacheHits
+            << ",\"nanos\":" << c.nanos
+            << ",\"latencyNs\":{";
+        bool first = true;
+        for (u32 k = 0; k < STAT_BUCKETS; ++k)
+        {
+            if (c.latency[k] == 0)
+                continue;
+            os << (first ? "" : ",") << "\"" << (1ULL << k) << "\":" << c.latency[k];
+            first = false;
+        }
+        os << "}}";
+    }
+    os << "\n}}" << std::endl;
+}
@@ -0,0 +1,88 @@
+//
+// I/O Statistics
+// Counters & latency histograms per layer of the reading stack,
+// from VMDK sectors up to NTFS file reads, to tell where a slow
+// run spends its time.
+//
+// Off by default: then a probe costs a flag test. Once enabled,
+// counters are updated with atomic adds, so any thread may record.
+// Both Win32 & POSIX definition are conditionally preprocessed
+// depends on compiler platforms.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include "types.h"
+
+#include <iostream>
+
+// instrumented layers, bottom up
+enum StatLayer
+{
+    eStatVmdkRawSector,     // Vmdk::RawSector, incl. reads through to parent images
+    eStatVmdkReadSectors,   // Vmdk::ReadSector & ReadSectorN
+    eStatGrainDirectory,    // Vmdk::Extent::GetGDE
+    eStatGrainTable,        // Vmdk::Extent::GetGTE
+    eStatMftRecord,         // Ntfs::ReadFileRecord, incl. fixups
+    eStatReadLcn,           // Ntfs::ReadLCN
+    eStatFileRead,          // ntfs::File::Read
+    eStatDecompress,        // ntfs::decompress, per compression unit
+    eStatLayers
+};
+
+u32 const STAT_BUCKETS = 32;    // latency histogram, bucket k counts calls under 2^k ns, the last one the rest
+
+struct StatCounters
+{
+    u64 calls;
+    u64 bytes;
+    u64 seeks;          // calls not starting where the previous one ended
+    u64 seekDistance;   // bytes skipped over by them, either way
+    u64 cacheHits;
+    u64 nanos;          // time spent, summed over threads
+    u64 latency[STAT_BUCKETS];
+};
+
+class Stats
+{
+public:
+    static void Enable(bool on = true);     // before reading starts
+    static bool IsEnabled() { return s_enabled; }
+    static void Reset();
+
+    static void Record(StatLayer layer, u64 bytes, u64 nanos);
+    static void Position(StatLayer layer, u64 offset, u64 size);   // where a call reads, in bytes
+    static void CacheHit(StatLayer layer);
+
+    static void Get(StatLayer layer, StatCounters & counters);
+    static char const * Name(StatLayer layer);
+    static void WriteJson(std::ostream & os);
+
+    static u64 Now();   // monotonic nanoseconds
+
+private:
+    static bool s_enabled;
+};
+
+// times a call from construction to destruction, when enabled
+class StatScope
+{
+public:
+    StatScope(StatLayer layer) : _layer(layer), _bytes(0), _on(Stats::IsEnabled()), _start(_on ? Stats::Now() : 0) { }
+    ~StatScope() { if (_on) Stats::Record(_layer, _bytes, Stats::Now() - _start); }
+    void SetBytes(u64 bytes) { _bytes = bytes; }
+    void Position(u64 offset, u64 size) { if (_on) Stats::Position(_layer, offset, size); }
+
+private:
+    StatLayer _layer;
+    u64 _bytes;
+    bool _on;
+    u64 _start;
+};
+
+#endif // __STATS_H
@@ -0,0 +1,228 @@
+//
+// Tar Writer
+// Writes a POSIX.1-2001 (pax) tar stream to an std::ostream,
+// one file after another, without seeking back.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "tar.h"
+
+#include <sstream>
+#include <stdexcept>
+#include <string.h>
+
+namespace
+{
+    u32 const BLOCK_SIZE = 512;
+    u64 const MAX_USTAR_SIZE = 077777777777ULL;     // 11 octal digits
+
+    // ustar header block
+    struct TarHeader
+    {
+        char name[100];
+        char mode[8];
+        char uid[8];
+        char gid[8];
+        char size[12];
+        char mtime[12];
+        char chksum[8];
+        char typeflag;
+        char linkname[100];
+        char magic[6];
+        char version[2];
+        char uname[32];
+        char gname[32];
+        char devmajor[8];
+        char devminor[8];
+        char prefix[155];
+        char pad[12];
+    };
+
+    // zero padded octal with terminating NUL
+    void Octal(char * field, size_t len, u64 value)
+    {
+        field[--len] = 0;
+        while (len > 0)
+        {
+            field[--len] = (char)('0' + (value & 7));
+            value >>= 3;
+        }
+    }
+
+    bool IsPlainAscii(std::string const & s)
+    {
+        for (size_t i = 0; i < s.size(); ++i)
+        {
+            if ((u8)s[i] < 0x20 || (u8)s[i] >= 0x7f)
+                return false;
+        }
+        return true;
+    }
+
+    std::string ToString(u64 x)
+    {
+        std::ostringstream ostr;
+        ostr << x;
+        return ostr.str();
+    }
+}
+
+//=============================================================================
+TarWriter::TarWriter(std::ostream & os)
+: _os(os), _left(0), _size(0)
+{
+}
+
+void TarWriter::BeginFile(std::string const & path, u64 size, u64 mtime)
+{
+    if (_left != 0)
+        throw std::runtime_error("Previous tar entry is not complete.");
+
+    std::string records;
+    if (path.size() > sizeof(((TarHeader*)0)->name) || !IsPlainAscii(path))
+        AddRecord(records, "path", path);
+    if (size > MAX_USTAR_SIZE)
+        AddRecord(records, "size", ToString(size));
+    if (!records.empty())
+        WritePax(path, records, mtime);
+
+    WriteHeader(path, '0', size, mtime);
+    _left = _size = size;
+}
+
+void TarWriter::BeginSparseFile(std::string const & path, u64 realSize, RANGES const & ranges, u64 mtime)
+{
+    if (_left != 0)
+        throw std::runtime_error("Previous tar entry is not complete.");
+
+    // sparse map goes first in the data: count, then offset & length per
+    // range, a line each; padded to a block. a trailing hole needs
+    // an empty range at the end, so the file gets its full size
+    RANGES map(ranges);
+    if (map.empty() || map.back().first + map.back().second < realSize)
+        map.push_back(std::make_pair(realSize, 0ULL));
+    std::string header(ToString(map.size()));
+    header.push_back('\n');
+    u64 data = 0;
+    for (size_t i = 0; i < map.size(); ++i)
+    {
+        header.append(ToString(map[i].first));
+        header.push_back('\n');
+        header.append(ToString(map[i].second));
+        header.push_back('\n');
+        data += map[i].second;
+    }
+    header.resize((header.size() + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE, 0);
+    u64 size = header.size() + data;
+
+    std::string records;
+    AddRecord(records, "GNU.sparse.major", "1");
+    AddRecord(records, "GNU.sparse.minor", "0");
+    AddRecord(records, "GNU.sparse.name", path);
+    AddRecord(records, "GNU.sparse.realsize", ToString(realSize));
+    if (size > MAX_USTAR_SIZE)
+        AddRecord(records, "size", ToString(size));
+    WritePax(path, records, mtime);
+
+    // name seen by tars without sparse support
+    std::string::size_type slash = path.find_last_of('/');
+    std::string name = (slash == std::string::npos)
+        ? "GNUSparseFile.0/" + path
+        : path.substr(0, slash) + "/GNUSparseFile.0" + path.substr(slash);
+    WriteHeader(name, '0', size, mtime);
+    _os.write(header.data(), header.size());
+    _left = data;
+    _size = size;
+}
+
+void TarWriter::Write(void const * data, u64 size)
+{
+    if (size > _left)
+        throw std::runtime_error("Writing beyond tar entry size.");
+    _os.write((char const *)data, size);
+    _left -= size;
+}
+
+void TarWriter::EndFile()
+{
+    if (_left != 0)
+        throw std::runtime_error("Tar entry data is short.");
+    Pad(_size);
+    _size = 0;
+    if (!_os.good())
+        throw std::runtime_error("Can't write tar stream.");
+}
+
+void TarWriter::Finish()
+{
+    if (_left != 0)
+        throw std::runtime_error("Last tar entry is not complete.");
+    char zeroes[2 * BLOCK_SIZE] = { 0 };
+    _os.write(zeroes, sizeof(zeroes));
+    _os.flush();
+    if (!_os.good())
+        throw std::runtime_error("Can't write tar stream.");
+}
+
+//=============================================================================
+void TarWriter::WriteHeader(std::string const & name, char type, u64 size, u64 mtime)
+{
+    TarHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    // a name too long is in the pax header, this one is just for old tars
+    strncpy(hdr.name, name.c_str(), sizeof(hdr.name));
+    Octal(hdr.mode, sizeof(hdr.mode), type == '5' ? 0755 : 0644);
+    Octal(hdr.uid, sizeof(hdr.uid), 0);
+    Octal(hdr.gid, sizeof(hdr.gid), 0);
+    Octal(hdr.size, sizeof(hdr.size), size > MAX_USTAR_SIZE ? 0 : size);
+    Octal(hdr.mtime, sizeof(hdr.mtime), mtime);
+    hdr.typeflag = type;
+    memcpy(hdr.magic, "ustar", 6);
+    memcpy(hdr.version, "00", 2);
+
+    // checksum is taken with its own field as spaces
+    memset(hdr.chksum, ' ', sizeof(hdr.chksum));
+    u32 sum = 0;
+    for (size_t i = 0; i < sizeof(hdr); ++i)
+        sum += ((u8 const *)&hdr)[i];
+    Octal(hdr.chksum, 7, sum);
+    hdr.chksum[7] = ' ';
+
+    _os.write((char const *)&hdr, sizeof(hdr));
+}
+
+void TarWriter::WritePax(std::string const & path, std::string const & records, u64 mtime)
+{
+    std::string::size_type slash = path.find_last_of('/');
+    std::string name("PaxHeaders.0/");
+    name.append(slash == std::string::npos ? path : path.substr(slash + 1));
+    WriteHeader(name, 'x', records.size(), mtime);
+    _os.write(records.data(), records.size());
+    Pad(records.size());
+}
+
+void TarWriter::Pad(u64 size)
+{
+    char zeroes[BLOCK_SIZE] = { 0 };
+    u32 rest = (u32)(size % BLOCK_SIZE);
+    if (rest != 0)
+        _os.write(zeroes, BLOCK_SIZE - rest);
+}
+
+void TarWriter::AddRecord(std::string & records, char const * key, std::string const & value)
+{
+    // "<length> key=value\n", where length counts itself too
+    size_t len = strlen(key) + value.size() + 3;
+    size_t digits = ToString(len).size();
+    if (ToString(len + digits).size() > digits)
+        ++digits;
+    records.append(ToString(len + digits));
+    records.push_back(' ');
+    records.append(key);
+    records.push_back('=');
+    records.append(value);
+    records.push_back('\n');
+}
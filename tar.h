@@ -0,0 +1,56 @@
+//
+// Tar Writer
+// Writes a POSIX.1-2001 (pax) tar stream to an std::ostream,
+// one file after another, without seeking back: the size of a
+// file must be known when it begins.
+//
+// Paths & sizes that don't fit the ustar header go into a pax
+// extended header. Sparse files are written in GNU sparse 1.0
+// format (pax based), with only their data ranges following.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __TAR_H
+#define __TAR_H
+
+#include "types.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+class TarWriter
+{
+public:
+    // (offset, length) of data in a sparse file, ascending & not overlapping
+    typedef std::vector<std::pair<u64, u64> > RANGES;
+
+    TarWriter(std::ostream & os);
+
+    // path is UTF-8 & '/' separated, size bytes of data then follow by Write()
+    void BeginFile(std::string const & path, u64 size, u64 mtime = 0);
+
+    // file of realSize bytes where only the ranges are data, the rest reads as
+    // zeroes; all ranges' bytes then follow by Write(), in range order
+    void BeginSparseFile(std::string const & path, u64 realSize, RANGES const & ranges, u64 mtime = 0);
+
+    void Write(void const * data, u64 size);
+    void EndFile();     // all data of the file must have been written
+    void Finish();      // end of archive, after the last file
+
+private:
+    TarWriter & operator = (TarWriter const &);
+    void WriteHeader(std::string const & name, char type, u64 size, u64 mtime);
+    void WritePax(std::string const & path, std::string const & records, u64 mtime);
+    void Pad(u64 size);
+    static void AddRecord(std::string & records, char const * key, std::string const & value);
+
+    std::ostream & _os;
+    u64 _left;      // data bytes left of current file
+    u64 _size;      // data bytes of current file
+};
+
+#endif // __TAR_H
@@ -0,0 +1,501 @@
+//
+// NTFS Compress Test
+// Checks ntfs::decompress against the decoder it replaced, kept
+// below as the reference, on generated LZNT1 streams and on random,
+// bit-flipped & truncated ones; with --bench, times both instead.
+//
+// The two must agree on success or failure and on every output
+// byte, except where the reference reads or writes outside its
+// buffers: a back reference token cut off by the end of the data,
+// or a literal past the end of a full sub-block (which the
+// reference wrote one byte beyond the sub-block, and so beyond the
+// output buffer for its last sub-block). ntfs::decompress throws
+// on both instead.
+//
+// usage: compress_test [--bench] [iterations] [seed]
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "ntfs_compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+    u32 const SB_SIZE = 0x1000;
+    u32 const UNIT_SIZE = 16 * SB_SIZE;     // compression unit of 4k clusters
+    u32 const SLACK = 16;                   // past the buffers, to catch the reference out
+
+    //=========================================================================
+    // the decoder as it was, untouched but for the two flags
+    // marking where it went outside its buffers
+    namespace reference
+    {
+        template <class T> inline u16 get_u16(T * t)
+        {
+            u8 * p = (u8*)t;
+            return (u16)(((*p) & 0xff) | ((*(p+1) & 0xff) << 8));
+        }
+
+        enum NtfsCompressionConstants
+        {
+            NTFS_SB_SIZE_MASK   =   0x0fff,
+            NTFS_SB_SIZE        =   0x1000,
+            NTFS_SB_IS_COMPRESSED   =   0x8000,
+        };
+
+        bool decompress(u8 * dest, u32 const destSize, u8 const * src, u32 const srcSize, bool & outOfBounds)
+        {
+            u8 const * srcEnd = src + srcSize;
+            u8 * destEnd = dest + destSize;
+
+            u8 const * srcSub = 0;
+            u8 const * srcSubEnd = 0;
+            u8 * destSub = 0;
+            u8 * destSubEnd = 0;
+
+            u8 const * pos = src;
+            u8 tag;
+            int token;
+
+            outOfBounds = false;
+            while (pos < srcEnd && dest < destEnd && get_u16(pos))
+            {
+                destSub = dest;
+                destSubEnd = destSub + NTFS_SB_SIZE;
+
+                if (destSubEnd > destEnd)
+                    throw std::runtime_error("Destination sub-block beyond output buffer.");
+
+                if (pos + 6 > srcEnd)
+                    throw std::runtime_error("Insufficient compress data.");
+
+                srcSub = pos;
+                srcSubEnd = srcSub + (get_u16(pos) & NTFS_SB_SIZE_MASK) + 3;
+                if (srcSubEnd > srcEnd)
+                    throw std::runtime_error("Sub-block beyond compress data.");
+
+                if (!(get_u16(pos) & NTFS_SB_IS_COMPRESSED))
+                {
+                    pos += 2;
+                    if (srcSubEnd - pos != NTFS_SB_SIZE)
+                        throw std::runtime_error("Uncompressed sub-block must be full size.");
+                    memcpy(dest, pos, NTFS_SB_SIZE);
+                    pos += NTFS_SB_SIZE;
+                    dest += NTFS_SB_SIZE;
+                    continue;
+                }
+
+                pos += 2;
+                while (pos < srcSubEnd)
+                {
+                    if (pos > srcSubEnd || dest > destSubEnd)
+                        throw std::runtime_error("Sub-block out of range.");
+
+                    tag = *pos++;
+                    for (token = 0; token < 8; ++token, tag >>= 1)
+                    {
+                        if (pos >= srcSubEnd || dest > destSubEnd)
+                           break;
+
+                        if ((tag & 0x1) == 0x0)
+                        {
+                            if (dest >= destSubEnd)
+                                outOfBounds = true;     // flagged
+                            *dest++ = *pos++;
+                            continue;
+                        }
+
+                        if (dest == destSub)
+                             throw std::runtime_error("Back ref token must not be the first.");
+
+                        unsigned maxLengthBit = 0;
+                        for (unsigned i = dest - destSub - 1;
+                                i >= 0x10;
+                                i >>= 1)
+                            ++maxLengthBit;
+
+                        if (pos + 2 > srcEnd)
+                            outOfBounds = true;         // flagged
+                        u16 backRefToken = get_u16(pos);
+                        pos += 2;
+
+                        u8 * destBackRef = dest - (backRefToken >> (12 - maxLengthBit)) - 1;
+                        if (destBackRef < destSub)
+                            throw std::runtime_error("Refer too far back.");
+
+                        u16 length = (backRefToken & (0xfff >> maxLengthBit)) + 3;
+
+                        if (dest + length > destSubEnd)
+                            throw std::runtime_error("Output buffer too small.");
+
+                        while (length--)
+                            *dest++ = *destBackRef++;
+                    }
+                }
+
+                if (dest < destSubEnd)
+                {
+                    int zerobytes = destSubEnd - dest;
+                    memset(dest, 0, zerobytes);
+                    dest += zerobytes;
+                }
+            }
+
+            return true;
+        }
+    }
+
+    //=========================================================================
+    // xorshift, so runs are the same everywhere for a seed
+    class Random
+    {
+    public:
+        Random(u32 seed) : _x(seed ? seed : 1) { }
+        u32 Next()
+        {
+            _x ^= _x << 13;
+            _x ^= _x >> 17;
+            _x ^= _x << 5;
+            return _x;
+        }
+        u32 Below(u32 n) { return Next() % n; }
+    private:
+        u32 _x;
+    };
+
+    // bits of a back ref token for length at the offset within the sub-block
+    u32 LengthShift(u32 offset)
+    {
+        u32 bits = 0;
+        for (u32 i = offset - 1; i >= 0x10; i >>= 1)
+            ++bits;
+        return bits;
+    }
+
+    // greedy LZNT1 of a sub-block, hash chained 3 byte matches
+    void CompressSubBlock(u8 const * data, u32 size, std::vector<u8> & out)
+    {
+        std::vector<u8> body;
+        std::vector<int> head(4096, -1);
+        std::vector<int> prev(size, -1);
+        u32 p = 0;
+        while (p < size)
+        {
+            size_t tagPos = body.size();
+            body.push_back(0);
+            for (int token = 0; token < 8 && p < size; ++token)
+            {
+                u32 bestLen = 0;
+                u32 bestDist = 0;
+                if (p > 0 && p + 3 <= size)
+                {
+                    u32 bits = LengthShift(p);
+                    u32 maxLen = std::min<u32>((0xfff >> bits) + 3, size - p);
+                    u32 maxDist = std::min<u32>(1U << (4 + bits), p);
+                    u32 h = (data[p] * 33 * 33 + data[p + 1] * 33 + data[p + 2]) & 4095;
+                    int depth = 32;
+                    for (int c = head[h]; c >= 0 && depth-- > 0 && p - c <= maxDist; c = prev[c])
+                    {
+                        u32 len = 0;
+                        while (len < maxLen && data[c + len] == data[p + len])
+                            ++len;
+                        if (len > bestLen)
+                        {
+                            bestLen = len;
+                            bestDist = p - c;
+                        }
+                    }
+                }
+
+                u32 take = (bestLen >= 3) ? bestLen : 1;
+                if (bestLen >= 3)
+                {
+                    u32 bits = LengthShift(p);
+                    u16 t = (u16)(((bestDist - 1) << (12 - bits)) | (bestLen - 3));
+                    body[tagPos] |= (u8)(1 << token);
+                    body.push_back((u8)t);
+                    body.push_back((u8)(t >> 8));
+                }
+                else
+                {
+                    body.push_back(data[p]);
+                }
+                for (u32 k = p; k < p + take; ++k)
+                {
+                    if (k + 3 > size)
+                        continue;
+                    u32 h = (data[k] * 33 * 33 + data[k + 1] * 33 + data[k + 2]) & 4095;
+                    prev[k] = head[h];
+                    head[h] = k;
+                }
+                p += take;
+            }
+        }
+
+        // stored as is if that is no smaller, a short one zero padded as it decodes
+        if (body.size() >= SB_SIZE)
+        {
+            u16 header = 0x3000 | (SB_SIZE + 2 - 3);
+            out.push_back((u8)header);
+            out.push_back((u8)(header >> 8));
+            out.insert(out.end(), data, data + size);
+            out.insert(out.end(), SB_SIZE - size, 0);
+            return;
+        }
+        u16 header = (u16)(0xb000 | (body.size() + 2 - 3));
+        out.push_back((u8)header);
+        out.push_back((u8)(header >> 8));
+        out.insert(out.end(), body.begin(), body.end());
+    }
+
+    void Compress(std::vector<u8> const & data, std::vector<u8> & out)
+    {
+        out.clear();
+        for (u32 i = 0; i < data.size(); i += SB_SIZE)
+            CompressSubBlock(&data[i], std::min<u32>(SB_SIZE, data.size() - i), out);
+
+        // zero header ends it, then zeroes to the end of the sector as on disk
+        out.resize((out.size() + 2 + 511) / 512 * 512, 0);
+    }
+
+    // mix of what compresses well, badly, and long & overlapping references
+    void Generate(Random & rnd, u32 size, std::vector<u8> & data)
+    {
+        data.clear();
+        while (data.size() < size)
+        {
+            u32 n = 1 + rnd.Below(300);
+            switch (rnd.Below(5))
+            {
+            case 0:     // noise
+                for (u32 i = 0; i < n; ++i)
+                    data.push_back((u8)rnd.Next());
+                break;
+            case 1:     // run
+                data.insert(data.end(), n, (u8)rnd.Next());
+                break;
+            case 2:     // small alphabet text
+                for (u32 i = 0; i < n; ++i)
+                    data.push_back((u8)('a' + rnd.Below(4)));
+                break;
+            case 3:     // short repeating pattern
+                {
+                    u32 period = 2 + rnd.Below(20);
+                    for (u32 i = 0; i < n; ++i)
+                        data.push_back(i < period ? (u8)rnd.Next() : data[data.size() - period]);
+                }
+                break;
+            default:    // copy of something earlier
+                if (data.empty())
+                    break;
+                {
+                    u32 from = rnd.Below(data.size());
+                    for (u32 i = 0; i < n; ++i)
+                        data.push_back(data[from + i]);
+                }
+                break;
+            }
+        }
+        data.resize(size);
+    }
+
+    // corrupts a stream one of several ways
+    void Mutate(Random & rnd, std::vector<u8> & s)
+    {
+        switch (rnd.Below(4))
+        {
+        case 0:     // flip bits
+            for (u32 n = 1 + rnd.Below(8); n > 0 && !s.empty(); --n)
+                s[rnd.Below(s.size())] ^= (u8)(1 << rnd.Below(8));
+            break;
+        case 1:     // truncate
+            s.resize(rnd.Below(s.size() + 1));
+            break;
+        case 2:     // garble bytes
+            for (u32 n = 1 + rnd.Below(4); n > 0 && !s.empty(); --n)
+                s[rnd.Below(s.size())] = (u8)rnd.Next();
+            break;
+        default:    // random through & through, compressed header first
+            {
+                u32 len = rnd.Below(64);
+                s.assign(2 + len, 0);
+                s[0] = (u8)(len - 1 + rnd.Below(3));
+                s[1] = 0xb0;
+                for (u32 i = 2; i < s.size(); ++i)
+                    s[i] = (u8)rnd.Next();
+            }
+            break;
+        }
+    }
+
+    struct Outcome
+    {
+        bool ok;
+        std::string error;
+        std::vector<u8> out;
+    };
+
+    // decodes with a pattern around the buffers; src copy has zero slack
+    // after it, as the reference may read there
+    void Run(bool ref, std::vector<u8> const & src, u32 destSize, Outcome & o, bool & outOfBounds)
+    {
+        std::vector<u8> in(src);
+        in.resize(src.size() + SLACK, 0);
+        o.out.assign(destSize + SLACK, 0xcd);
+        o.error.clear();
+        outOfBounds = false;
+        try
+        {
+            if (ref)
+                reference::decompress(&o.out[0], destSize, &in[0], src.size(), outOfBounds);
+            else
+                ntfs::decompress(&o.out[0], destSize, &in[0], src.size());
+            o.ok = true;
+        }
+        catch(std::exception & err)
+        {
+            o.ok = false;
+            o.error = err.what();
+        }
+    }
+
+    // a stream the reference accepted by writing past the output buffer:
+    // a literal, a back ref filling the sub-block up, then a literal at 4096
+    void OverrunStream(std::vector<u8> & s)
+    {
+        u16 backRef = (u16)(SB_SIZE - 1 - 3);   // distance 1, length 4095 at offset 1
+        u8 const body[] = { 0x02, 'A', (u8)backRef, (u8)(backRef >> 8), 'B' };
+        u16 header = (u16)(0xb000 | (sizeof(body) + 2 - 3));
+        s.clear();
+        s.push_back((u8)header);
+        s.push_back((u8)(header >> 8));
+        s.insert(s.end(), body, body + sizeof(body));
+    }
+
+    int Test(u32 iterations, u32 seed)
+    {
+        Random rnd(seed);
+        std::vector<u8> data, stream;
+        Outcome a, b;
+        bool outOfBounds, unused;
+        u32 failed = 0, accepted = 0, rejected = 0, divergent = 0;
+
+        // the known difference, checked explicitly
+        OverrunStream(stream);
+        Run(true, stream, SB_SIZE, a, outOfBounds);
+        Run(false, stream, SB_SIZE, b, unused);
+        if (!a.ok || !outOfBounds || a.out[SB_SIZE] != 'B' || b.ok || b.error != "Sub-block out of range.")
+        {
+            printf("FAIL overrun stream: reference %s, out of bounds %d; new %s\n",
+                a.ok ? "ok" : a.error.c_str(), outOfBounds, b.ok ? "ok" : b.error.c_str());
+            ++failed;
+        }
+
+        for (u32 i = 0; i < iterations; ++i)
+        {
+            u32 size = 1 + rnd.Below(UNIT_SIZE);
+            u32 destSize = (size + SB_SIZE - 1) / SB_SIZE * SB_SIZE;
+            Generate(rnd, size, data);
+            Compress(data, stream);
+
+            // every other stream corrupted
+            bool mutated = (i & 1) != 0;
+            if (mutated)
+                Mutate(rnd, stream);
+
+            Run(true, stream, destSize, a, outOfBounds);
+            Run(false, stream, destSize, b, unused);
+            if (b.out[destSize] != 0xcd)
+            {
+                printf("FAIL #%u: wrote past the output buffer\n", i);
+                ++failed;
+                continue;
+            }
+            if (outOfBounds)
+            {
+                ++divergent;
+                if (b.ok)
+                {
+                    printf("FAIL #%u: reference went out of bounds, new accepted\n", i);
+                    ++failed;
+                }
+                continue;
+            }
+            if (a.ok != b.ok || (a.ok && memcmp(&a.out[0], &b.out[0], destSize) != 0))
+            {
+                printf("FAIL #%u: reference %s, new %s\n", i, a.ok ? "ok" : a.error.c_str(), b.ok ? "ok" : b.error.c_str());
+                ++failed;
+                continue;
+            }
+            if (!mutated && (!b.ok || memcmp(&b.out[0], &data[0], size) != 0))
+            {
+                printf("FAIL #%u: generated stream did not round trip\n", i);
+                ++failed;
+                continue;
+            }
+            if (b.ok)
+                ++accepted;
+            else
+                ++rejected;
+        }
+
+        printf("%u streams: %u accepted, %u rejected alike, %u out of bounds in reference, %u failed\n",
+            iterations, accepted, rejected, divergent, failed);
+        return failed ? 1 : 0;
+    }
+
+    int Bench(u32 units, u32 seed)
+    {
+        Random rnd(seed);
+        std::vector<u8> data;
+        std::vector<std::vector<u8> > streams(units);
+        for (u32 i = 0; i < units; ++i)
+        {
+            Generate(rnd, UNIT_SIZE, data);
+            Compress(data, streams[i]);
+        }
+
+        std::vector<u8> out(UNIT_SIZE + SLACK);
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            bool ref = (pass == 0);
+            bool outOfBounds;
+            clock_t start = clock();
+            int rounds = 0;
+            do
+            {
+                for (u32 i = 0; i < units; ++i)
+                {
+                    std::vector<u8> & s = streams[i];
+                    if (ref)
+                        reference::decompress(&out[0], UNIT_SIZE, &s[0], s.size(), outOfBounds);
+                    else
+                        ntfs::decompress(&out[0], UNIT_SIZE, &s[0], s.size());
+                }
+                ++rounds;
+            } while (clock() - start < CLOCKS_PER_SEC);
+            double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+            printf("%-10s %8.1f MB/s\n", ref ? "reference" : "new", (double)rounds * units * UNIT_SIZE / secs / (1024 * 1024));
+        }
+        return 0;
+    }
+}
+
+int main(int argc, char * argv[])
+{
+    bool bench = (argc >= 2 && strcmp(argv[1], "--bench") == 0);
+    int arg = bench ? 2 : 1;
+    u32 iterations = (argc > arg) ? (u32)atoi(argv[arg]) : (bench ? 256 : 20000);
+    u32 seed = (argc > arg + 1) ? (u32)atoi(argv[arg + 1]) : 12345;
+    return bench ? Bench(iterations, seed) : Test(iterations, seed);
+}
@@ -0,0 +1,290 @@
+//
+// Threading
+// Minimal mutex, condition variable, thread and thread pool
+// wrappers. Both Win32 & POSIX definition are conditionally
+// preprocessed depends on compiler platforms.
+//
+// Based on the _MSC_VER symbol, if defined means Win32,
+// otherwise Linux (pthread).
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "thread.h"
+
+#include <stdexcept>
+
+// if using Microsoft Visual Studio compiler
+// We can safely assume Win32 API exists
+#ifdef _MSC_VER
+
+#include <windows.h>
+#include <process.h>
+
+//=============================================================================
+// for Win32 threading (condition variables need Vista or later)
+Mutex::Mutex() : _impl(new CRITICAL_SECTION) { ::InitializeCriticalSection((CRITICAL_SECTION*)_impl); }
+Mutex::~Mutex() { ::DeleteCriticalSection((CRITICAL_SECTION*)_impl); delete (CRITICAL_SECTION*)_impl; }
+void Mutex::Lock() { ::EnterCriticalSection((CRITICAL_SECTION*)_impl); }
+void Mutex::Unlock() { ::LeaveCriticalSection((CRITICAL_SECTION*)_impl); }
+
+Condition::Condition() : _impl(new CONDITION_VARIABLE) { ::InitializeConditionVariable((CONDITION_VARIABLE*)_impl); }
+Condition::~Condition() { delete (CONDITION_VARIABLE*)_impl; }
+void Condition::Wait(Mutex & m)
+{
+    ::SleepConditionVariableCS((CONDITION_VARIABLE*)_impl, (CRITICAL_SECTION*)m._impl, INFINITE);
+}
+void Condition::Signal() { ::WakeConditionVariable((CONDITION_VARIABLE*)_impl); }
+void Condition::Broadcast() { ::WakeAllConditionVariable((CONDITION_VARIABLE*)_impl); }
+
+struct ThreadEntry
+{
+    static unsigned __stdcall Proc(void * p)
+    {
+        ((Thread*)p)->Run();
+        return 0;
+    }
+};
+
+void Thread::Sleep(u64 micros)
+{
+    // millisecond granularity, rounded up so short waits still wait
+    ::Sleep((DWORD)((micros + 999) / 1000));
+}
+
+unsigned Thread::HardwareConcurrency()
+{
+    SYSTEM_INFO si;
+    ::GetSystemInfo(&si);
+    return si.dwNumberOfProcessors > 0 ? si.dwNumberOfProcessors : 1;
+}
+
+Thread::Thread() : _impl(0), _started(false) { }
+Thread::~Thread() { Join(); }
+void Thread::Start()
+{
+    if (_started)
+        throw std::runtime_error("Thread already started.");
+    _impl = (void*)::_beginthreadex(0, 0, &ThreadEntry::Proc, this, 0, 0);
+    if (!_impl)
+        throw std::runtime_error("Can't create thread.");
+    _started = true;
+}
+void Thread::Join()
+{
+    if (!_started)
+        return;
+    ::WaitForSingleObject((HANDLE)_impl, INFINITE);
+    ::CloseHandle((HANDLE)_impl);
+    _impl = 0;
+    _started = false;
+}
+
+#else
+
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+//=============================================================================
+// for POSIX threading
+Mutex::Mutex() : _impl(new pthread_mutex_t) { pthread_mutex_init((pthread_mutex_t*)_impl, 0); }
+Mutex::~Mutex() { pthread_mutex_destroy((pthread_mutex_t*)_impl); delete (pthread_mutex_t*)_impl; }
+void Mutex::Lock() { pthread_mutex_lock((pthread_mutex_t*)_impl); }
+void Mutex::Unlock() { pthread_mutex_unlock((pthread_mutex_t*)_impl); }
+
+Condition::Condition() : _impl(new pthread_cond_t) { pthread_cond_init((pthread_cond_t*)_impl, 0); }
+Condition::~Condition() { pthread_cond_destroy((pthread_cond_t*)_impl); delete (pthread_cond_t*)_impl; }
+void Condition::Wait(Mutex & m) { pthread_cond_wait((pthread_cond_t*)_impl, (pthread_mutex_t*)m._impl); }
+void Condition::Signal() { pthread_cond_signal((pthread_cond_t*)_impl); }
+void Condition::Broadcast() { pthread_cond_broadcast((pthread_cond_t*)_impl); }
+
+struct ThreadEntry
+{
+    static void * Proc(void * p)
+    {
+        ((Thread*)p)->Run();
+        return 0;
+    }
+};
+
+void Thread::Sleep(u64 micros)
+{
+    timespec ts;
+    ts.tv_sec = micros / 1000000;
+    ts.tv_nsec = (micros % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+unsigned Thread::HardwareConcurrency()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned)n : 1;
+}
+
+Thread::Thread() : _impl(new pthread_t), _started(false) { }
+Thread::~Thread() { Join(); delete (pthread_t*)_impl; }
+void Thread::Start()
+{
+    if (_started)
+        throw std::runtime_error("Thread already started.");
+    if (pthread_create((pthread_t*)_impl, 0, &ThreadEntry::Proc, this) != 0)
+        throw std::runtime_error("Can't create thread.");
+    _started = true;
+}
+void Thread::Join()
+{
+    if (!_started)
+        return;
+    pthread_join(*(pthread_t*)_impl, 0);
+    _started = false;
+}
+
+#endif // _MSC_VER
+
+
+//=============================================================================
+// generic thread pool
+ThreadPool::ThreadPool(unsigned threads)
+: _stop(false)
+{
+    if (threads == 0)
+        threads = Thread::HardwareConcurrency();
+    _workers.reserve(threads);
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        _workers.push_back(new Worker(*this));
+        _workers.back()->Start();
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        ScopedLock lock(_lock);
+        _stop = true;
+        _wake.Broadcast();
+    }
+    for (size_t i = 0; i < _workers.size(); ++i)
+    {
+        _workers[i]->Join();
+        delete _workers[i];
+    }
+}
+
+void ThreadPool::Submit(Task * task)
+{
+    ScopedLock lock(_lock);
+    _tasks.push_back(task);
+    _wake.Signal();
+}
+
+void ThreadPool::Worker::Run()
+{
+    for (;;)
+    {
+        Task * task = 0;
+        {
+            ScopedLock lock(_pool._lock);
+            while (_pool._tasks.empty() && !_pool._stop)
+                _pool._wake.Wait(_pool._lock);
+            if (_pool._tasks.empty())
+                return;     // stopping & nothing left to do
+            task = _pool._tasks.front();
+            _pool._tasks.pop_front();
+        }
+        task->Run();
+    }
+}
+
+//=============================================================================
+// generic work queue
+WorkQueue::WorkQueue()
+: _next(0), _count(0), _running(0)
+{
+}
+
+WorkQueue::~WorkQueue()
+{
+    WaitIdle();
+}
+
+void WorkQueue::Start(ThreadPool & pool, size_t count)
+{
+    WaitIdle();
+    {
+        ScopedLock lock(_lock);
+        _next = 0;
+        _count = count;
+        _error.clear();
+        for (u32 i = 0; i < pool.Size() && i < count; ++i)
+        {
+            _workers.push_back(new Worker(*this));
+            ++_running;
+        }
+    }
+    for (size_t i = 0; i < _workers.size(); ++i)
+        pool.Submit(_workers[i]);
+}
+
+void WorkQueue::Stop(std::string const & error)
+{
+    ScopedLock lock(_lock);
+    _next = _count;
+    if (_error.empty())
+        _error = error;
+}
+
+void WorkQueue::Wait()
+{
+    WaitIdle();
+    std::string error;
+    {
+        ScopedLock lock(_lock);
+        error.swap(_error);
+    }
+    if (!error.empty())
+        throw std::runtime_error(error);
+}
+
+bool WorkQueue::Take(size_t & item)
+{
+    ScopedLock lock(_lock);
+    if (_next >= _count)
+        return false;
+    item = _next++;
+    return true;
+}
+
+void WorkQueue::WaitIdle()
+{
+    // workers refer to us
+    {
+        ScopedLock lock(_lock);
+        while (_running > 0)
+            _workerDone.Wait(_lock);
+    }
+    for (size_t i = 0; i < _workers.size(); ++i)
+        delete _workers[i];
+    _workers.clear();
+}
+
+void WorkQueue::Worker::Run()
+{
+    try
+    {
+        _owner.Work();
+    }
+    catch(std::exception & err)
+    {
+        _owner.Stop(err.what());
+    }
+
+    ScopedLock lock(_owner._lock);
+    --_owner._running;
+    _owner._workerDone.Broadcast();
+}
@@ -0,0 +1,179 @@
+//
+// Threading
+// Minimal mutex, condition variable, thread and thread pool
+// wrappers. Both Win32 & POSIX definition are conditionally
+// preprocessed depends on compiler platforms.
+//
+// Based on the _MSC_VER symbol, if defined means Win32,
+// otherwise Linux (pthread).
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __THREAD_H
+#define __THREAD_H
+
+#include "types.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+//=============================================================================
+class Mutex
+{
+public:
+    Mutex();
+    ~Mutex();
+    void Lock();
+    void Unlock();
+
+private:
+    friend class Condition;
+    Mutex(Mutex const &);               // not copyable
+    Mutex & operator = (Mutex const &); // not assignable
+    void * _impl;
+};
+
+//=============================================================================
+// locks the given mutex for the lifetime of the scope
+class ScopedLock
+{
+public:
+    ScopedLock(Mutex & m) : _m(m) { _m.Lock(); }
+    ~ScopedLock() { _m.Unlock(); }
+
+private:
+    ScopedLock & operator = (ScopedLock const &);   // not assignable
+    Mutex & _m;
+};
+
+//=============================================================================
+class Condition
+{
+public:
+    Condition();
+    ~Condition();
+    void Wait(Mutex & m);   // m must be locked by caller
+    void Signal();
+    void Broadcast();
+
+private:
+    Condition(Condition const &);
+    Condition & operator = (Condition const &);
+    void * _impl;
+};
+
+//=============================================================================
+// derive and implement Run(), then Start() & Join()
+class Thread
+{
+public:
+    static unsigned HardwareConcurrency();
+    static void Sleep(u64 micros);  // calling thread
+
+    Thread();
+    virtual ~Thread();
+    void Start();
+    void Join();
+
+protected:
+    virtual void Run() = 0;
+
+private:
+    Thread(Thread const &);
+    Thread & operator = (Thread const &);
+    friend struct ThreadEntry;  // platform thread entry point
+    void * _impl;
+    bool _started;
+};
+
+//=============================================================================
+// unit of work for ThreadPool
+// the pool never owns nor touches a task after its Run() returns,
+// so completion signalling (and deletion) is up to the submitter.
+class Task
+{
+public:
+    virtual ~Task() { }
+    virtual void Run() = 0;
+};
+
+//=============================================================================
+// fixed number of worker threads draining a FIFO of tasks
+class ThreadPool
+{
+public:
+    ThreadPool(unsigned threads = 0);   // 0 = one per hardware thread
+    ~ThreadPool();                      // waits for queued tasks to finish
+    void Submit(Task * task);
+    unsigned Size() const { return _workers.size(); }
+
+private:
+    class Worker : public Thread
+    {
+    public:
+        Worker(ThreadPool & pool) : _pool(pool) { }
+    protected:
+        void Run();
+    private:
+        Worker & operator = (Worker const &);
+        ThreadPool & _pool;
+    };
+
+    ThreadPool(ThreadPool const &);
+    ThreadPool & operator = (ThreadPool const &);
+
+    Mutex _lock;
+    Condition _wake;
+    std::deque<Task*> _tasks;
+    std::vector<Worker*> _workers;
+    bool _stop;
+};
+
+//=============================================================================
+// items 0..count-1 shared out in order to a worker per pool thread:
+// derive and implement Work(), which Take()s items till none left,
+// then Start() & Wait(). the 1st error of a worker stops the others
+// after their current item, Wait() throws it once all are done
+class WorkQueue
+{
+public:
+    WorkQueue();
+    virtual ~WorkQueue();               // Wait() first, Work() is gone by then
+
+    void Start(ThreadPool & pool, size_t count);
+    void Stop(std::string const & error = std::string());  // no more items taken
+    void Wait();
+
+protected:
+    virtual void Work() = 0;            // per worker, its own state in locals
+    bool Take(size_t & item);           // false once none left or stopped
+
+private:
+    class Worker : public Task
+    {
+    public:
+        Worker(WorkQueue & owner) : _owner(owner) { }
+        void Run();
+    private:
+        Worker & operator = (Worker const &);
+        WorkQueue & _owner;
+    };
+
+    WorkQueue(WorkQueue const &);
+    WorkQueue & operator = (WorkQueue const &);
+    void WaitIdle();
+
+    std::vector<Worker*> _workers;
+    Mutex _lock;
+    Condition _workerDone;
+    size_t _next;       // next item to take, guarded by _lock
+    size_t _count;      // ditto, items in all
+    u32 _running;       // ditto, workers not finished yet
+    std::string _error; // ditto, 1st error
+};
+
+#endif // __THREAD_H
@@ -0,0 +1,170 @@
+//
+// Trace Events
+// Records timed spans of the reading stack, per thread, for a
+// timeline in Chrome trace-event JSON format.
+// Both Win32 & POSIX definition are conditionally preprocessed
+// depends on compiler platforms.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#include "trace.h"
+#include "thread.h"
+
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+#ifdef _MSC_VER
+#define TRACE_THREAD_LOCAL __declspec(thread)
+#else
+#define TRACE_THREAD_LOCAL __thread
+#endif
+
+namespace
+{
+    struct Span
+    {
+        char const * name;
+        char const * category;
+        u64 start;
+        u64 end;
+        u64 arg;
+    };
+
+    // written only by its thread, read at flush
+    struct Ring
+    {
+        u32 tid;
+        u64 next;       // spans recorded so far, next goes at next % size
+        std::vector<Span> spans;
+    };
+
+    Mutex s_lock;                   // guards the rest, taken once per thread
+    std::vector<Ring*> s_rings;
+    std::string s_path;
+    u32 s_ringSize = 0;
+    u64 s_origin = 0;
+    bool s_atExit = false;
+    u32 s_generation = 1;           // bumped as Flush frees the rings
+
+    // a ring of an earlier generation is freed, never to be touched
+    TRACE_THREAD_LOCAL Ring * t_ring = 0;
+    TRACE_THREAD_LOCAL u32 t_generation = 0;
+
+    Ring * ThreadRing()
+    {
+        if (t_ring == 0 || t_generation != s_generation)
+        {
+            ScopedLock lock(s_lock);
+            Ring * ring = new Ring;
+            ring->tid = s_rings.size() + 1;
+            ring->next = 0;
+            ring->spans.resize(s_ringSize);
+            s_rings.push_back(ring);
+            t_ring = ring;
+            t_generation = s_generation;
+        }
+        return t_ring;
+    }
+
+    void FlushAtExit()
+    {
+        Trace::Flush();
+    }
+
+    void PutString(std::ostream & os, char const * s)
+    {
+        // names are literals of ours, only quotes & backslashes to escape
+        os << '"';
+        for (; *s; ++s)
+        {
+            if (*s == '"' || *s == '\\')
+                os << '\\';
+            os << *s;
+        }
+        os << '"';
+    }
+
+    void PutMicros(std::ostream & os, u64 nanos)
+    {
+        os << nanos / 1000 << '.' << std::setw(3) << std::setfill('0') << nanos % 1000;
+    }
+}
+
+bool Trace::s_enabled = false;
+
+void Trace::Start(char const * path, u32 spansPerThread)
+{
+    ScopedLock lock(s_lock);
+    s_path = path;
+    s_ringSize = spansPerThread > 0 ? spansPerThread : 1;
+    s_origin = Stats::Now();
+    s_enabled = true;
+    if (!s_atExit)
+        s_atExit = (atexit(&FlushAtExit) == 0);
+}
+
+void Trace::Record(char const * name, char const * category, u64 start, u64 end, u64 arg)
+{
+    Ring * ring = ThreadRing();
+    Span & s = ring->spans[(size_t)(ring->next++ % ring->spans.size())];
+    s.name = name;
+    s.category = category;
+    s.start = start;
+    s.end = end;
+    s.arg = arg;
+}
+
+void Trace::Flush()
+{
+    ScopedLock lock(s_lock);
+    if (!s_enabled)
+        return;
+    s_enabled = false;
+
+    std::ofstream os(s_path.c_str());
+    if (!os.is_open())
+        return;     // nothing to throw to at exit
+
+    // complete ("X") events in microseconds, a thread name each
+    os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    for (size_t i = 0; i < s_rings.size(); ++i)
+    {
+        Ring const & ring = *s_rings[i];
+        os << (first ? "" : ",") << "\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << ring.tid
+            << ",\"args\":{\"name\":\"thread " << ring.tid << "\"}}";
+        first = false;
+
+        u64 size = ring.spans.size();
+        u64 begin = ring.next > size ? ring.next - size : 0;
+        for (u64 k = begin; k < ring.next; ++k)
+        {
+            Span const & s = ring.spans[(size_t)(k % size)];
+            os << ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":" << ring.tid << ",\"name\":";
+            PutString(os, s.name);
+            os << ",\"cat\":";
+            PutString(os, s.category);
+            os << ",\"ts\":";
+            PutMicros(os, s.start > s_origin ? s.start - s_origin : 0);
+            os << ",\"dur\":";
+            PutMicros(os, s.end - s.start);
+            if (s.arg != NO_ARG)
+                os << ",\"args\":{\"v\":" << s.arg << "}";
+            os << '}';
+        }
+    }
+    os << "\n]}" << std::endl;
+
+    // other threads still holding theirs see the generation moved on
+    for (size_t i = 0; i < s_rings.size(); ++i)
+        delete s_rings[i];
+    s_rings.clear();
+    ++s_generation;
+    t_ring = 0;
+}
@@ -0,0 +1,58 @@
+//
+// Trace Events
+// Records timed spans of the reading stack, per thread, for a
+// timeline in Chrome trace-event JSON format, as loaded by
+// chrome://tracing or Perfetto.
+//
+// Each thread appends to its own ring buffer, no locking nor
+// sharing while recording; the oldest spans are overwritten once
+// a buffer is full. All buffers are written out at exit.
+// Both Win32 & POSIX definition are conditionally preprocessed
+// depends on compiler platforms.
+//
+// Author: Derek Saw
+//
+// Copyright (c) 2009. All rights reserved.
+//
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include "types.h"
+#include "stats.h"
+
+class Trace
+{
+public:
+    static u64 const NO_ARG = ~0ULL;
+
+    // starts recording, written to path at exit (or by Flush)
+    static void Start(char const * path, u32 spansPerThread = 1 << 18);
+    static bool IsEnabled() { return s_enabled; }
+
+    // name & category must be string literals, they are kept as pointers
+    static void Record(char const * name, char const * category, u64 start, u64 end, u64 arg);
+
+    // writes every thread's spans out, recording threads must have finished
+    static void Flush();
+
+private:
+    static bool s_enabled;
+};
+
+// a span from construction to destruction, when tracing
+class TraceSpan
+{
+public:
+    TraceSpan(char const * name, char const * category, u64 arg = Trace::NO_ARG)
+    : _name(name), _category(category), _arg(arg), _start(Trace::IsEnabled() ? Stats::Now() : 0) { }
+    ~TraceSpan() { if (_start) Trace::Record(_name, _category, _start, Stats::Now(), _arg); }
+
+private:
+    char const * _name;
+    char const * _category;
+    u64 _arg;
+    u64 _start;
+};
+
+#endif // __TRACE_H
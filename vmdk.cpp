@@ -15,6 +15,8 @@
 // Also supports opening snapshot-ed .vmdk files:
 //   - will resolve through parent-link if needed
 //
+// Sector reads are serialized, so a Vmdk can be shared between threads.
+//
 
 #include <iostream>
 #include <fstream>
@@ -27,6 +29,8 @@
 
 #include "vmdk.h"
 #include "ntfs.h"
+#include "stats.h"
+#include "trace.h"
 
 using namespace disk;
 
@@ -66,7 +70,7 @@ std::string strip(std::string const & s)
 
 //=============================================================================
 Vmdk::Extent::Extent()
-: sectors(0), offset(0), fp(IFile64::FileMaker())
+: sectors(0), offset(0), fp(IFile64::FileMaker()), gtNumber(~0ULL)
 {
 }
 
@@ -80,27 +84,45 @@ u32 Vmdk::Extent::GetGDE(u64 x)
     u64 index = x / (u64)seh.GetGtCoverage();
     u64 pos = (SECTOR_SIZE * (u64)seh.gdOffset) + (sizeof(u32) * index);
     u32 gde = 0;
+    StatScope stat(eStatGrainDirectory);
+    stat.Position(pos, sizeof(gde));
+    stat.SetBytes(sizeof(gde));
     if (!fp->Seek(pos)) throw std::runtime_error("Seek error in GetGDE");
     if (sizeof(gde) != fp->Read(&gde, sizeof(gde))) throw std::runtime_error("GetGDE read error");
     return gde;
 }
 
-u32 Vmdk::Extent::GetGTE(u64 x, u32 gde)
+// grain table entry of sector x, from the grain table it is in, which
+// is read whole & kept, as sectors nearby are most likely read next
+u32 Vmdk::Extent::GetGTE(u64 x)
 {
-    u64 index = (x % seh.GetGtCoverage()) / (u64)seh.grainSize;
-    u64 pos = SECTOR_SIZE * (u64)gde + (sizeof(u32) * index);
-    u32 gte = 0;
-    if (!fp->Seek(pos)) throw std::runtime_error("Seek error in GetGTE");
-    if (sizeof(gte) != fp->Read(&gte, sizeof(gte))) throw std::runtime_error("GetGTE read error");
-    return gte;
+    u64 number = x / seh.GetGtCoverage();
+    if (number != gtNumber)
+    {
+        TraceSpan span("grain table", "vmdk", number);
+        u32 gde = GetGDE(x);
+        gt.assign(seh.numGTEsPerGT, 0);
+        gtNumber = ~0ULL;
+        if (gde > 0)
+        {
+            u64 pos = SECTOR_SIZE * (u64)gde;
+            u32 size = seh.numGTEsPerGT * sizeof(u32);
+            StatScope stat(eStatGrainTable);
+            stat.Position(pos, size);
+            stat.SetBytes(size);
+            if (!fp->Seek(pos)) throw std::runtime_error("Seek error in GetGTE");
+            if (size != fp->Read(&gt[0], size)) throw std::runtime_error("GetGTE read error");
+        }
+        gtNumber = number;
+    }
+    return gt[(size_t)((x % seh.GetGtCoverage()) / seh.grainSize)];
 }
 
 bool Vmdk::Extent::RawSector(u64 x, void * buf)
 {
     if (type == eSPARSE)
     {
-        u32 gde = GetGDE(x);
-        u32 gte = GetGTE(x, gde);
+        u32 gte = GetGTE(x);
         if (gte > 0)
         {
             u64 index = x % (int)seh.grainSize;
@@ -125,6 +147,11 @@ bool Vmdk::Extent::RawSector(u64 x, void * buf)
     //return false; // unreachable code
 }
 
+bool Vmdk::Extent::HasGrain(u64 x)
+{
+    return type != eSPARSE || GetGTE(x) > 0;
+}
+
 //=============================================================================
 Vmdk::Vmdk(std::string const & descriptorFilename)
 : _descriptorFilename(descriptorFilename)
@@ -164,7 +191,11 @@ bool Vmdk::ReadSector(u64 x, void * buf, unsigned partitionNum)
     if (partitionNum >= _partitions.size())
         throw std::runtime_error("Partition number out of range.");
     x += _partitions[partitionNum].firstSectorLBA;
-    return RawSector(x, buf);
+    StatScope stat(eStatVmdkReadSectors);
+    stat.Position(x * SECTOR_SIZE, SECTOR_SIZE);
+    stat.SetBytes(SECTOR_SIZE);
+    ScopedLock lock(_lock);
+    return ReadRaw(x, buf);
 }
 
 bool Vmdk::ReadSectorN(u64 x, u32 count, void * buf, unsigned partitionNum)
@@ -173,9 +204,13 @@ bool Vmdk::ReadSectorN(u64 x, u32 count, void * buf, unsigned partitionNum)
         throw std::runtime_error("Partition number out of range.");
     u8* bytes = (u8*)buf;
     x += _partitions[partitionNum].firstSectorLBA; //_mbr.part[partitionNum].firstSectorLBA;
+    StatScope stat(eStatVmdkReadSectors);
+    stat.Position(x * SECTOR_SIZE, (u64)count * SECTOR_SIZE);
+    stat.SetBytes((u64)count * SECTOR_SIZE);
+    ScopedLock lock(_lock);
     while (count --> 0)
     {
-        if (!RawSector(x, bytes))
+        if (!ReadRaw(x, bytes))
             return false;
         ++x;
         bytes += SECTOR_SIZE;
@@ -183,7 +218,84 @@ bool Vmdk::ReadSectorN(u64 x, u32 count, void * buf, unsigned partitionNum)
     return true;
 }
 
+void Vmdk::GetOwnSectors(u64 x, u64 count, SectorRanges & ranges, unsigned partitionNum)
+{
+    if (partitionNum >= _partitions.size())
+        throw std::runtime_error("Partition number out of range.");
+    ranges.clear();
+    if (!_pParent.get())
+    {
+        ranges.push_back(std::make_pair(x, count));     // nothing to read through to
+        return;
+    }
+
+    u64 first = _partitions[partitionNum].firstSectorLBA;
+    x += first;
+    ScopedLock lock(_lock);
+    for (u64 end = x + count; x < end; )
+    {
+        // get the correct extents
+        u64 y = x;
+        size_t i = 0;
+        while (i < _extents.size() && y >= _extents[i].sectors)
+        {
+            y -= _extents[i].sectors;
+            ++i;
+        }
+        if (i == _extents.size())
+            break;
+
+        // a grain at a time, or the rest of a flat extent
+        Extent & e = _extents[i];
+        u64 n = (e.type == eSPARSE) ? e.seh.grainSize - (y % e.seh.grainSize) : e.sectors - y;
+        n = std::min(n, end - x);
+        if (e.HasGrain(y))
+        {
+            if (!ranges.empty() && ranges.back().first + ranges.back().second == x - first)
+                ranges.back().second += n;
+            else
+                ranges.push_back(std::make_pair(x - first, n));
+        }
+        x += n;
+    }
+}
+
 bool Vmdk::RawSector(u64 sectorNumber, void * buf)
+{
+    StatScope stat(eStatVmdkRawSector);
+    stat.Position(sectorNumber * SECTOR_SIZE, SECTOR_SIZE);
+    stat.SetBytes(SECTOR_SIZE);
+    ScopedLock lock(_lock);
+    return ReadRaw(sectorNumber, buf);
+}
+
+bool Vmdk::RawSectorN(u64 x, u32 count, void * buf)
+{
+    u8* bytes = (u8*)buf;
+    StatScope stat(eStatVmdkRawSector);
+    stat.Position(x * SECTOR_SIZE, (u64)count * SECTOR_SIZE);
+    stat.SetBytes((u64)count * SECTOR_SIZE);
+    ScopedLock lock(_lock);
+    while (count --> 0)
+    {
+        if (!ReadRaw(x, bytes))
+            return false;
+        ++x;
+        bytes += SECTOR_SIZE;
+    }
+    return true;
+}
+
+u64 Vmdk::GetSectors() const
+{
+    u64 sectors = 0;
+    for (size_t i = 0; i < _extents.size(); ++i)
+        sectors += _extents[i].sectors;
+    return sectors;
+}
+
+// caller must hold _lock
+bool Vmdk::ReadRaw(u64 sectorNumber, void * buf)
 {
     // get the correct extents
     u64 x = sectorNumber;
@@ -274,6 +386,39 @@ void Vmdk::InitExtendedPartition(u64 ebrSector, u64 ebrLeft)
     }
 }
 
+u64 Vmdk::GetIdentity()
+{
+    ScopedLock lock(_lock);
+
+    // FNV-1a
+    u64 h = 14695981039346656037ULL;
+    std::string id(_descriptorFilename);
+    Properties::iterator pit = _properties.find("CID");
+    if (pit != _properties.end())
+        id.append(1, '\n').append(pit->second);
+    for (std::string::size_type i = 0; i < id.size(); ++i)
+        h = (h ^ (u8)id[i]) * 1099511628211ULL;
+
+    ExtentsArray::iterator it;
+    for (it = _extents.begin(); it != _extents.end(); ++it)
+    {
+        for (std::string::size_type i = 0; i < it->filename.size(); ++i)
+            h = (h ^ (u8)it->filename[i]) * 1099511628211ULL;
+        h = (h ^ (u64)it->fp->Size()) * 1099511628211ULL;
+    }
+
+    if (_pParent.get())
+        h = (h ^ _pParent->GetIdentity()) * 1099511628211ULL;
+    return h;
+}
+
+std::string Vmdk::GetCid()
+{
+    ScopedLock lock(_lock);
+    Properties::iterator it = _properties.find("CID");
+    return (it != _properties.end()) ? it->second : std::string();
+}
+
 void Vmdk::InitParent()
 {
     static const std::string s_parentFileNameHint("parentFileNameHint");
@@ -15,6 +15,8 @@
 // Also supports opening snapshot-ed .vmdk files:
 //   - will resolve through parent-link if needed
 //
+// Sector reads are serialized, so a Vmdk can be shared between threads.
+//
 
 #ifndef __VMDK_H
 #define __VMDK_H
@@ -30,6 +32,7 @@
 #include "types.h"
 #include "file64.h"
 #include "idiskread.h"
+#include "thread.h"
 
 #define SECTOR_SIZE 512
 
@@ -110,11 +113,14 @@ namespace disk
 
 
             IFile64 * fp;   // TODO: this must be exception safe
+            u64             gtNumber;   // grain table held in gt, ~0 if none
+            std::vector<u32> gt;        // entries of the last grain table read
             Extent();
             void Clear();
             u32 GetGDE(u64 x);
-            u32 GetGTE(u64 x, u32 gde);
+            u32 GetGTE(u64 x);
             bool RawSector(u64 x, void * buf);
+            bool HasGrain(u64 x);
         };
         typedef std::deque<Extent> ExtentsArray;
 
@@ -128,7 +134,22 @@ namespace disk
         virtual bool RawSector(u64 x, void * buf);
         virtual bool ReadSector(u64 x, void * buf, unsigned partitionNum=0);
         virtual bool ReadSectorN(u64 x, u32 count, void * buf, unsigned partitionNum = 0);
+        virtual void GetOwnSectors(u64 x, u64 count, SectorRanges & ranges, unsigned partitionNum = 0);
+        bool RawSectorN(u64 x, u32 count, void * buf);
+        u64 GetSectors() const;     // of the whole disk
         void Test();
+
+        // changes whenever the image content does, i.e. VMware assigns a new
+        // CID on write; covers descriptor, extents' sizes & parent chain
+        u64 GetIdentity();
+
+        // content ID of the descriptor, which a child names as its parentCID;
+        // empty if none
+        std::string GetCid();
+
+        // parent (base) disk of a snapshot, null if none
+        Vmdk * GetParent() { return _pParent.get(); }
+
         disk::Partitions::iterator BeginPartition() { return _partitions.begin(); }
         disk::Partitions::iterator EndPartition() { return _partitions.end(); }
 
@@ -139,6 +160,7 @@ namespace disk
         void InitParent();
         void InitPartition();
         void InitExtendedPartition(u64 ebrSector, u64 ebrLeft);
+        bool ReadRaw(u64 x, void * buf);
         void ReadSeh(SparseExtentHeader & seh, IFile64 & ifs);
         void ParseDescriptor(std::istream & ifs);
 
@@ -151,6 +173,7 @@ namespace disk
         std::auto_ptr<Vmdk> _pParent;
         Mbr _mbr;
         disk::Partitions _partitions;
+        Mutex _lock;    // extents' file positions are shared state
     };
 
 }